@@ -0,0 +1,509 @@
+#ifndef LINUX_SOCKET_ASYNC_CLIENT_H
+#define LINUX_SOCKET_ASYNC_CLIENT_H
+
+// 基于C++20协程的异步客户端库
+// 一个线程一个EventLoop(epoll), 业务代码写成Task协程, 用co_await conn.request(body)发请求, 等回复时协程挂起,
+// 线程去跑别的协程, 所以一个线程里可以同时有成千上万个请求在飞
+// 请求用kRequest帧发送, 帧里带一个连接内唯一的请求id, 回复按id找到等待的协程, 不要求服务器按顺序回复
+// 协程发的请求先攒在连接的发送缓冲区里, 每轮事件循环每个连接只send一次, 同一轮里发的请求自然就pipeline起来了
+// 回复到达时不直接恢复协程, 而是排进就绪队列, 等这一批事件处理完再统一恢复, 协程里接着发请求或者关连接不会打乱正在进行的读处理
+//
+// 用法:
+//   Task<void> worker(AsyncConnection& conn) {
+//       std::optional<std::string> reply = co_await conn.request("hello");
+//   }
+//   EventLoop loop;
+//   AsyncConnection conn(loop);
+//   conn.connect(address);
+//   loop.spawn(worker(conn));
+//   loop.run();
+
+#if __cplusplus < 202002L
+#error "async_client.h needs C++20 coroutines"
+#endif
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "protocol.h"
+#include "socket.h"
+#include "socket_address.h"
+
+template <typename T = void>
+class Task;
+
+struct TaskPromiseBase {
+    // 结束时切回co_await这个Task的协程, 没有的话(被spawn出来的)就停在这里, 由Task析构时销毁
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    // Task被co_await之前不开始执行
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    // 整个项目都不用异常, 协程里漏出来的异常直接终止
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U&& value) {
+        result.emplace(std::forward<U>(value));
+    }
+
+    std::optional<T> result;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+};
+
+// 协程的返回类型, co_await它时开始执行, 执行完得到co_return的值
+template <typename T>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Task() = default;
+    explicit Task(Handle handle) : handle_(handle) {}
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
+    bool await_ready() const noexcept { return false; }
+    // 对称转移: 直接切到这个Task里执行, 不会因为一长串嵌套的Task把栈用完
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*handle_.promise().result);
+        }
+    }
+
+private:
+    Handle handle_;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// 注册在EventLoop上的fd, epoll_event.data.ptr指向它
+class IoHandler {
+public:
+    // fd上有事件
+    virtual void on_event(uint32_t events) = 0;
+    // 这一轮就绪的协程都跑完了, 把它们攒下的数据发出去
+    virtual void flush() = 0;
+
+protected:
+    ~IoHandler() = default;
+};
+
+// spawn出来的协程外面包的一层, 创建时立即执行, 结束时自己销毁
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+// 单线程的事件循环, 只能在创建它的线程里使用
+class EventLoop {
+public:
+    EventLoop() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~EventLoop() {
+        if (epoll_fd_ != -1) {
+            close(epoll_fd_);
+        }
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool valid() const { return epoll_fd_ != -1; }
+    int epoll_fd() const { return epoll_fd_; }
+
+    // 开始执行一个协程, 执行到第一个挂起点为止, 之后由run()驱动
+    void spawn(Task<void> task) {
+        active_tasks_++;
+        run_spawned(*this, std::move(task));
+    }
+
+    // 让一个挂起的协程在这一轮事件处理完之后恢复
+    void schedule(std::coroutine_handle<> handle) { ready_.push_back(handle); }
+
+    // 让handler在这一轮就绪的协程跑完之后flush一次, 由handler自己保证不重复登记
+    void request_flush(IoHandler* handler) { dirty_.push_back(handler); }
+    void cancel_flush(IoHandler* handler) { dirty_.erase(std::remove(dirty_.begin(), dirty_.end(), handler), dirty_.end()); }
+
+    // 一直跑到spawn出来的协程全部结束, 或者有协程调用了stop()
+    void run() {
+        std::vector<epoll_event> events(256);
+        stopped_ = false;
+        while (true) {
+            // flush失败会关连接, 等在上面的协程又会变成就绪, 所以要交替处理到两边都空
+            while (!ready_.empty() || !dirty_.empty()) {
+                resume_ready();
+                flush_dirty();
+            }
+            if (stopped_ || active_tasks_ == 0) {
+                break;
+            }
+            int num_of_fds = epoll_wait(epoll_fd_, events.data(), events.size(), -1);
+            if (num_of_fds == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            for (int i = 0; i < num_of_fds; i++) {
+                static_cast<IoHandler*>(events[i].data.ptr)->on_event(events[i].events);
+            }
+        }
+    }
+
+    void stop() { stopped_ = true; }
+
+    // 还没结束的spawn出来的协程数
+    size_t active_tasks() const { return active_tasks_; }
+
+private:
+    static DetachedTask run_spawned(EventLoop& loop, Task<void> task) {
+        co_await task;
+        loop.active_tasks_--;
+    }
+
+    void resume_ready() {
+        while (!ready_.empty()) {
+            std::coroutine_handle<> handle = ready_.front();
+            ready_.pop_front();
+            handle.resume();
+        }
+    }
+
+    void flush_dirty() {
+        dirty_.swap(flushing_);
+        for (IoHandler* handler : flushing_) {
+            handler->flush();
+        }
+        flushing_.clear();
+    }
+
+    int epoll_fd_ = -1;
+    size_t active_tasks_ = 0;
+    bool stopped_ = false;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::vector<IoHandler*> dirty_;
+    std::vector<IoHandler*> flushing_;
+};
+
+class AsyncConnection;
+
+// conn.request()返回的等待对象, co_await的结果是回复的内容, 连接断开或者请求发不出去时是nullopt
+class RequestAwaiter {
+public:
+    RequestAwaiter(AsyncConnection* conn, std::string_view body) : conn_(conn), body_(body) {}
+
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> handle);
+    std::optional<std::string> await_resume() { return std::move(reply_); }
+
+private:
+    friend class AsyncConnection;
+
+    AsyncConnection* conn_;
+    std::string_view body_;
+    std::coroutine_handle<> handle_;
+    std::optional<std::string> reply_;
+};
+
+// 一个到服务器的连接, 上面可以同时有任意多个请求在飞
+class AsyncConnection : public IoHandler {
+public:
+    explicit AsyncConnection(EventLoop& loop) : loop_(loop) {}
+    ~AsyncConnection() {
+        close();
+        if (flush_pending_) {
+            loop_.cancel_flush(this);
+        }
+    }
+
+    AsyncConnection(const AsyncConnection&) = delete;
+    AsyncConnection& operator=(const AsyncConnection&) = delete;
+
+    // 阻塞地连上服务器, 之后的收发都是非阻塞的, 失败返回false, errno是失败的原因
+    // 一般只在启动时建连接, 没必要为了connect再写一个协程
+    bool connect(const SocketAddress& address) {
+        close();
+        Socket sock = connect_socket(address);
+        if (!sock.valid()) {
+            return false;
+        }
+        // 小请求不能等Nagle攒包
+        int nodelay = 1;
+        setsockopt(sock.get(), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        int flags = fcntl(sock.get(), F_GETFL, 0);
+        fcntl(sock.get(), F_SETFL, flags | O_NONBLOCK);
+        epoll_event ev;
+        ev.data.ptr = static_cast<IoHandler*>(this);
+        ev.events = EPOLLIN;
+        if (epoll_ctl(loop_.epoll_fd(), EPOLL_CTL_ADD, sock.get(), &ev) == -1) {
+            return false;
+        }
+        sock_ = std::move(sock);
+        return true;
+    }
+
+    bool connected() const { return sock_.valid(); }
+
+    // 已经发出去还没收到回复的请求数
+    size_t outstanding() const { return pending_.size(); }
+
+    // 发一个请求, body在co_await结束之前要保持有效
+    RequestAwaiter request(std::string_view body) { return RequestAwaiter(this, body); }
+
+    // 关闭连接, 还在等回复的请求都以nullopt结束
+    void close() {
+        if (sock_.valid()) {
+            epoll_ctl(loop_.epoll_fd(), EPOLL_CTL_DEL, sock_.get(), nullptr);
+            sock_.reset();
+        }
+        for (auto& entry : pending_) {
+            loop_.schedule(entry.second->handle_);
+        }
+        pending_.clear();
+        send_buf_.clear();
+        send_pos_ = 0;
+        recv_buf_.read_pos = recv_buf_.write_pos = 0;
+        want_write_ = false;
+    }
+
+private:
+    friend class RequestAwaiter;
+
+    void submit(RequestAwaiter& awaiter) {
+        // id回绕之后跳过还在用的
+        while (pending_.count(next_id_) != 0) {
+            next_id_++;
+        }
+        uint32_t request_id = next_id_++;
+        append_request_frame(send_buf_, request_id, awaiter.body_.data(), awaiter.body_.size());
+        pending_.emplace(request_id, &awaiter);
+        if (!flush_pending_) {
+            flush_pending_ = true;
+            loop_.request_flush(this);
+        }
+    }
+
+    void flush() override {
+        flush_pending_ = false;
+        if (sock_.valid() && !send_queued()) {
+            close();
+        }
+    }
+
+    void on_event(uint32_t events) override {
+        if ((events & EPOLLOUT) && !send_queued()) {
+            close();
+            return;
+        }
+        if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !read_replies()) {
+            close();
+        }
+    }
+
+    // 尽量把send_buf_发出去, 发不完就等EPOLLOUT, 返回false表示连接出错
+    bool send_queued() {
+        while (send_pos_ < send_buf_.size()) {
+            ssize_t sent_len = send(sock_.get(), send_buf_.data() + send_pos_, send_buf_.size() - send_pos_, MSG_NOSIGNAL);
+            if (sent_len == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return false;
+            }
+            send_pos_ += sent_len;
+        }
+        if (send_pos_ == send_buf_.size()) {
+            send_buf_.clear();
+            send_pos_ = 0;
+        } else if (send_pos_ > send_buf_.size() / 2) {
+            send_buf_.erase(0, send_pos_);
+            send_pos_ = 0;
+        }
+        bool want_write = !send_buf_.empty();
+        if (want_write != want_write_) {
+            epoll_event ev;
+            ev.data.ptr = static_cast<IoHandler*>(this);
+            ev.events = EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0u);
+            epoll_ctl(loop_.epoll_fd(), EPOLL_CTL_MOD, sock_.get(), &ev);
+            want_write_ = want_write;
+        }
+        return true;
+    }
+
+    // 收完socket里的数据, 把每个回复交给等它的协程, 返回false表示连接断开或者协议错误
+    bool read_replies() {
+        bool failed = false;
+        while (true) {
+            char* buf = recv_buf_.prepare(64 * 1024);
+            ssize_t recv_len = recv(sock_.get(), buf, recv_buf_.writable(), 0);
+            if (recv_len == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = errno != EAGAIN && errno != EWOULDBLOCK;
+                break;
+            } else if (recv_len == 0) {
+                failed = true;
+                break;
+            }
+            recv_buf_.commit(recv_len);
+        }
+
+        // 断开之前已经收全的回复照样交出去
+        Frame frame;
+        ParseResult result;
+        while ((result = parse_frame(recv_buf_, frame)) == ParseResult::kFrame) {
+            uint32_t request_id;
+            if (frame.opcode != Opcode::kRequest || !parse_request_id(frame.payload, frame.payload_len, request_id)) {
+                return false;
+            }
+            auto it = pending_.find(request_id);
+            if (it == pending_.end()) {
+                return false;
+            }
+            RequestAwaiter& awaiter = *it->second;
+            awaiter.reply_.emplace(frame.payload + kRequestIdSize, frame.payload_len - kRequestIdSize);
+            loop_.schedule(awaiter.handle_);
+            pending_.erase(it);
+        }
+        return result != ParseResult::kError && !failed;
+    }
+
+    EventLoop& loop_;
+    Socket sock_;
+    std::string send_buf_;
+    size_t send_pos_ = 0;
+    bool want_write_ = false;
+    bool flush_pending_ = false;
+    RecvBuffer recv_buf_;
+    uint32_t next_id_ = 0;
+    // 请求id -> 等回复的协程, awaiter在协程帧里, 协程恢复之前一直有效
+    std::unordered_map<uint32_t, RequestAwaiter*> pending_;
+};
+
+// 连接已经断开, 或者请求太大服务器一定会拒绝, 就不挂起直接以nullopt结束
+inline bool RequestAwaiter::await_ready() const noexcept {
+    return conn_ == nullptr || !conn_->connected() || body_.size() > kMaxPayloadSize - kRequestIdSize;
+}
+
+inline void RequestAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    conn_->submit(*this);
+}
+
+// 到同一个服务器的一组连接, 每个请求发到在飞请求最少的那个连接上
+class AsyncClientPool {
+public:
+    explicit AsyncClientPool(EventLoop& loop) : loop_(loop) {}
+
+    // 再建count个连接, 有一个连不上就返回false, 已经连上的留在池里
+    bool connect(const SocketAddress& address, int count) {
+        for (int i = 0; i < count; i++) {
+            conns_.push_back(std::make_unique<AsyncConnection>(loop_));
+            if (!conns_.back()->connect(address)) {
+                conns_.pop_back();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t size() const { return conns_.size(); }
+    AsyncConnection& connection(size_t i) { return *conns_[i]; }
+
+    // 和AsyncConnection::request一样, 所有连接都断开了就以nullopt结束
+    RequestAwaiter request(std::string_view body) {
+        AsyncConnection* best = nullptr;
+        for (const std::unique_ptr<AsyncConnection>& conn : conns_) {
+            if (conn->connected() && (best == nullptr || conn->outstanding() < best->outstanding())) {
+                best = conn.get();
+            }
+        }
+        return RequestAwaiter(best, body);
+    }
+
+    void close() {
+        for (const std::unique_ptr<AsyncConnection>& conn : conns_) {
+            conn->close();
+        }
+    }
+
+private:
+    EventLoop& loop_;
+    std::vector<std::unique_ptr<AsyncConnection>> conns_;
+};
+
+#endif
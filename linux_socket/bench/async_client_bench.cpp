@@ -0,0 +1,54 @@
+#include <benchmark/benchmark.h>
+
+#include <optional>
+#include <string>
+
+#include "async_client.h"
+#include "loopback_server.h"
+
+namespace {
+
+Task<void> call_once(AsyncClientPool& pool, const std::string& body, bool& failed) {
+    std::optional<std::string> reply = co_await pool.request(body);
+    if (!reply) {
+        failed = true;
+    }
+}
+
+// 单线程协程客户端: 每轮同时发出concurrency个请求, 全部回来算一轮
+// 参数: 连接数, 并发请求数
+void BM_AsyncClientConcurrency(benchmark::State& state) {
+    const int conns = state.range(0);
+    const int concurrency = state.range(1);
+    LoopbackServer server;
+    if (!server.start(Backend::kEpollLevel)) {
+        state.SkipWithError("failed to start server");
+        return;
+    }
+    SocketAddress address;
+    resolve_address("127.0.0.1", server.port(), address);
+    EventLoop loop;
+    AsyncClientPool pool(loop);
+    if (!loop.valid() || !pool.connect(address, conns)) {
+        state.SkipWithError("failed to connect");
+        return;
+    }
+    std::string body(64, 'x');
+    bool failed = false;
+    for (auto _ : state) {
+        for (int i = 0; i < concurrency; i++) {
+            loop.spawn(call_once(pool, body, failed));
+        }
+        loop.run();
+        if (failed) {
+            state.SkipWithError("request failed");
+            break;
+        }
+    }
+    state.counters["requests"] = benchmark::Counter(state.iterations() * concurrency, benchmark::Counter::kIsRate);
+    pool.close();
+    server.stop();
+}
+BENCHMARK(BM_AsyncClientConcurrency)->ArgsProduct({{1, 4}, {1, 64, 1024}})->UseRealTime();
+
+}  // namespace
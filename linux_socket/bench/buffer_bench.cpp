@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "buffer.h"
+#include "protocol.h"
+
+namespace {
+
+// 模拟服务器收一批数据: prepare, 写进去, 全部解析掉
+void BM_RecvBufferAppendConsume(benchmark::State& state) {
+    const size_t chunk = state.range(0);
+    std::string data(chunk, 'x');
+    RecvBuffer buf;
+    for (auto _ : state) {
+        char* dst = buf.prepare(chunk);
+        memcpy(dst, data.data(), chunk);
+        buf.commit(chunk);
+        buf.read_pos = buf.write_pos;
+    }
+    state.SetBytesProcessed(state.iterations() * chunk);
+}
+BENCHMARK(BM_RecvBufferAppendConsume)->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// 每次只解析掉一部分, 剩下的半帧要被搬到头部
+void BM_RecvBufferPartialCompaction(benchmark::State& state) {
+    const size_t chunk = state.range(0);
+    std::string data(chunk, 'x');
+    RecvBuffer buf;
+    for (auto _ : state) {
+        char* dst = buf.prepare(chunk);
+        memcpy(dst, data.data(), chunk);
+        buf.commit(chunk);
+        buf.read_pos = buf.write_pos - 3;
+    }
+    state.SetBytesProcessed(state.iterations() * chunk);
+}
+BENCHMARK(BM_RecvBufferPartialCompaction)->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// 回声路径: 把收到的帧切片挂到发送队列, 再按一次sendmsg的量消费掉
+void BM_OutputBufferAppendSlices(benchmark::State& state) {
+    const size_t frames = state.range(0);
+    std::string payload(64, 'x');
+    std::string batch;
+    for (size_t i = 0; i < frames; i++) {
+        append_frame(batch, Opcode::kEcho, payload.data(), payload.size());
+    }
+    RecvBuffer recv_buf;
+    OutputBuffer out;
+    for (auto _ : state) {
+        char* dst = recv_buf.prepare(batch.size());
+        memcpy(dst, batch.data(), batch.size());
+        recv_buf.commit(batch.size());
+        Frame frame;
+        while (parse_frame(recv_buf, frame) == ParseResult::kFrame) {
+            out.append(recv_buf.slice(frame.payload - kFrameHeaderSize, kFrameHeaderSize + frame.payload_len));
+        }
+        out.consume(out.size());
+    }
+    state.SetItemsProcessed(state.iterations() * frames);
+}
+BENCHMARK(BM_OutputBufferAppendSlices)->Arg(1)->Arg(16)->Arg(256);
+
+// 服务器自己生成的回复要拷贝进新的Block
+void BM_OutputBufferAppendCopy(benchmark::State& state) {
+    const size_t len = state.range(0);
+    std::string data(len, 'x');
+    OutputBuffer out;
+    for (auto _ : state) {
+        out.append(data.data(), data.size());
+        out.consume(out.size());
+    }
+    state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_OutputBufferAppendCopy)->Arg(16)->Arg(1024);
+
+}  // namespace
@@ -0,0 +1,151 @@
+#include <benchmark/benchmark.h>
+
+#include <poll.h>
+
+#include <string>
+
+#include "loopback_server.h"
+
+namespace {
+
+// 回环上一条消息的往返时间, 包括客户端两次系统调用和服务器一整轮事件循环
+// 参数: 后端, payload大小
+void BM_EchoRoundTrip(benchmark::State& state) {
+    Backend backend = static_cast<Backend>(state.range(0));
+    if (backend == Backend::kUring && !uring_supported()) {
+        state.SkipWithError("io_uring features not supported by this kernel");
+        return;
+    }
+    state.SetLabel(backend_name(backend));
+    LoopbackServer server;
+    if (!server.start(backend)) {
+        state.SkipWithError("failed to start server");
+        return;
+    }
+    Socket sock = server.connect();
+    int nodelay = 1;
+    setsockopt(sock.get(), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    std::string payload(state.range(1), 'x');
+    std::string frame;
+    append_frame(frame, Opcode::kEcho, payload.data(), payload.size());
+    RecvBuffer buf;
+    std::string reply;
+    for (auto _ : state) {
+        if (!send_all(sock.get(), frame.data(), frame.size()) || !recv_frame(sock.get(), buf, reply)) {
+            state.SkipWithError("connection failed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+    sock.reset();
+    server.stop();
+}
+BENCHMARK(BM_EchoRoundTrip)
+    ->ArgsProduct({{(int)Backend::kEpollLevel, (int)Backend::kEpollEdge, (int)Backend::kUring}, {64, 4096}})
+    ->UseRealTime();
+
+// 把一帧发出去的同时收回复, 大帧不能先发完再收, 两边的socket缓冲区都满了会卡住
+bool exchange_frame(int fd, const std::string& frame, RecvBuffer& buf, std::string& reply) {
+    size_t sent = 0;
+    while (sent < frame.size()) {
+        pollfd pfd{fd, POLLIN | POLLOUT, 0};
+        if (poll(&pfd, 1, 5000) <= 0) {
+            return false;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t len = send(fd, frame.data() + sent, frame.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (len > 0) {
+                sent += len;
+            } else if (len == -1 && errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+        }
+        if (pfd.revents & POLLIN) {
+            char* dst = buf.prepare(1024 * 1024);
+            ssize_t len = recv(fd, dst, buf.writable(), MSG_DONTWAIT);
+            if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+                return false;
+            }
+            if (len > 0) {
+                buf.commit(len);
+            }
+        }
+    }
+    return recv_frame(fd, buf, reply);
+}
+
+// 大payload的往返, 对比普通回声(服务器收进用户态再发出去)和bulk echo(服务器splice)
+// 参数: opcode, payload大小
+void BM_BulkRoundTrip(benchmark::State& state) {
+    Opcode opcode = static_cast<Opcode>(state.range(0));
+    state.SetLabel(opcode == Opcode::kBulkEcho ? "splice" : "copy");
+    LoopbackServer server;
+    if (!server.start(Backend::kEpollLevel)) {
+        state.SkipWithError("failed to start server");
+        return;
+    }
+    Socket sock = server.connect();
+    std::string payload(state.range(1), 'x');
+    std::string frame;
+    append_frame(frame, opcode, payload.data(), payload.size());
+    RecvBuffer buf;
+    std::string reply;
+    for (auto _ : state) {
+        if (!exchange_frame(sock.get(), frame, buf, reply)) {
+            state.SkipWithError("connection failed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size());
+    sock.reset();
+    server.stop();
+}
+BENCHMARK(BM_BulkRoundTrip)
+    ->ArgsProduct({{(int)Opcode::kEcho, (int)Opcode::kBulkEcho}, {1 << 20, 8 << 20}})
+    ->UseRealTime();
+
+// 用sendfile下载一个在page cache里的文件, 参数: 文件大小
+void BM_ServeFile(benchmark::State& state) {
+    char dir[] = "/tmp/serve_file_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        state.SkipWithError("failed to create temp dir");
+        return;
+    }
+    std::string path = std::string(dir) + "/data.bin";
+    std::string content(state.range(0), 'x');
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr || fwrite(content.data(), 1, content.size(), file) != content.size()) {
+        state.SkipWithError("failed to write file");
+    }
+    if (file != nullptr) {
+        fclose(file);
+    }
+    transfer_options.file_root = dir;
+    LoopbackServer server;
+    if (state.error_occurred() || !server.start(Backend::kEpollLevel)) {
+        state.SkipWithError("failed to start server");
+    } else {
+        Socket sock = server.connect();
+        std::string request;
+        append_frame(request, Opcode::kServeFile, "data.bin", 8);
+        RecvBuffer buf;
+        std::string reply;
+        for (auto _ : state) {
+            if (!send_all(sock.get(), request.data(), request.size()) || !recv_frame(sock.get(), buf, reply)
+                || reply.size() != content.size()) {
+                state.SkipWithError("download failed");
+                break;
+            }
+        }
+        state.SetBytesProcessed(state.iterations() * content.size());
+        sock.reset();
+        server.stop();
+    }
+    transfer_options.file_root.clear();
+    std::remove(path.c_str());
+    rmdir(dir);
+}
+BENCHMARK(BM_ServeFile)->Arg(1 << 20)->Arg(8 << 20)->UseRealTime();
+
+}  // namespace
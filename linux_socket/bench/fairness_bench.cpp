@@ -0,0 +1,103 @@
+#include <benchmark/benchmark.h>
+
+#include <poll.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "histogram.h"
+#include "loopback_server.h"
+
+namespace {
+
+// 一直全速发大echo帧, 同时把回复读掉丢了的客户端, 让服务器的事件循环一直有大块数据要收发
+void run_flooder(uint16_t port, std::atomic<bool>& stop) {
+    SocketAddress address;
+    resolve_address("127.0.0.1", port, address);
+    Socket sock = connect_socket(address);
+    if (!sock.valid()) {
+        return;
+    }
+    std::string message(64 * 1024, 'f');
+    std::string data;
+    for (int i = 0; i < 16; i++) {
+        append_frame(data, Opcode::kEcho, message.data(), message.size());
+    }
+    std::string sink(1024 * 1024, '\0');
+    size_t sent = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        pollfd pfd{sock.get(), POLLIN | POLLOUT, 0};
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            return;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t len = send(sock.get(), data.data() + sent, data.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (len > 0) {
+                sent = (sent + len) % data.size();
+            }
+        }
+        if (pfd.revents & POLLIN) {
+            if (recv(sock.get(), sink.data(), sink.size(), MSG_DONTWAIT) == 0) {
+                return;
+            }
+        }
+    }
+}
+
+// 混合负载: 普通客户端一次一个64字节的往返, 旁边可以有一个全速收发的大流量客户端
+// 参数: 有没有大流量客户端, 调度方式(0: 每个连接发到EAGAIN为止, 1: DRR每轮64KB, 2: DRR加上每连接32MB/s的限速)
+// 计数器里的p50_us和p99_us是普通客户端的往返时间
+void BM_MixedWorkload(benchmark::State& state) {
+    const bool flood = state.range(0) != 0;
+    const int policy = state.range(1);
+    static const char* const kPolicyNames[] = {"unfair", "drr", "drr+rate"};
+    state.SetLabel(std::string(flood ? "flooder, " : "quiet, ") + kPolicyNames[policy]);
+    rate_limit_options.write_quantum = policy == 0 ? 0 : 64 * 1024;
+    rate_limit_options.conn_bytes = policy == 2 ? 32 * 1024 * 1024 : 0;
+    LoopbackServer server;
+    if (!server.start(Backend::kEpollLevel)) {
+        state.SkipWithError("failed to start server");
+        rate_limit_options = RateLimitOptions();
+        return;
+    }
+    std::atomic<bool> stop{false};
+    std::thread flooder;
+    if (flood) {
+        flooder = std::thread(run_flooder, server.port(), std::ref(stop));
+        // 等它把两边的缓冲区都灌满
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    Socket sock = server.connect();
+    std::string payload(64, 'x');
+    std::string frame;
+    append_frame(frame, Opcode::kEcho, payload.data(), payload.size());
+    RecvBuffer buf;
+    std::string reply;
+    Histogram latency;
+    for (auto _ : state) {
+        uint64_t start = now_ns();
+        if (!send_all(sock.get(), frame.data(), frame.size()) || !recv_frame(sock.get(), buf, reply)) {
+            state.SkipWithError("connection failed");
+            break;
+        }
+        latency.record((now_ns() - start) / 1000);
+    }
+    state.counters["p50_us"] = latency.percentile(50);
+    state.counters["p99_us"] = latency.percentile(99);
+    state.counters["max_us"] = latency.max();
+    stop = true;
+    if (flooder.joinable()) {
+        flooder.join();
+    }
+    sock.reset();
+    server.stop();
+    rate_limit_options = RateLimitOptions();
+}
+BENCHMARK(BM_MixedWorkload)->ArgsProduct({{0, 1}, {0, 1, 2}})->UseRealTime();
+
+}  // namespace
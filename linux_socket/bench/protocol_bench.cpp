@@ -0,0 +1,47 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "protocol.h"
+
+namespace {
+
+// 一次recv收到一批同样大小的帧, 测解析每一帧的开销
+void BM_ParseFrames(benchmark::State& state) {
+    const size_t payload_len = state.range(0);
+    const size_t frames = 64;
+    std::string payload(payload_len, 'x');
+    std::string batch;
+    for (size_t i = 0; i < frames; i++) {
+        append_frame(batch, Opcode::kEcho, payload.data(), payload.size());
+    }
+    RecvBuffer buf;
+    char* dst = buf.prepare(batch.size());
+    memcpy(dst, batch.data(), batch.size());
+    buf.commit(batch.size());
+    for (auto _ : state) {
+        buf.read_pos = 0;
+        Frame frame;
+        while (parse_frame(buf, frame) == ParseResult::kFrame) {
+            benchmark::DoNotOptimize(frame.payload);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * frames);
+    state.SetBytesProcessed(state.iterations() * batch.size());
+}
+BENCHMARK(BM_ParseFrames)->Arg(0)->Arg(64)->Arg(4096);
+
+void BM_AppendFrame(benchmark::State& state) {
+    const size_t payload_len = state.range(0);
+    std::string payload(payload_len, 'x');
+    std::string out;
+    for (auto _ : state) {
+        out.clear();
+        append_frame(out, Opcode::kEcho, payload.data(), payload.size());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * (payload_len + kFrameHeaderSize));
+}
+BENCHMARK(BM_AppendFrame)->Arg(64)->Arg(4096);
+
+}  // namespace
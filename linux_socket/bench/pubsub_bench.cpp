@@ -0,0 +1,100 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "loopback_server.h"
+#include "pubsub.h"
+
+namespace {
+
+struct BenchConn {
+    bool can_enqueue() const { return true; }
+
+    OutputBuffer send_buf;
+    SubscriberState subscriber;
+};
+
+// 只测broker扇出本身: 一帧挂到N个订阅者的发送队列, 再全部消费掉
+// 参数: 订阅者数量
+void BM_BrokerFanOut(benchmark::State& state) {
+    const size_t subscribers = state.range(0);
+    TopicBroker<BenchConn> broker;
+    std::vector<BenchConn> conns(subscribers);
+    for (BenchConn& conn : conns) {
+        broker.subscribe(conn, "bench");
+    }
+    std::string message(256, 'x');
+    std::string frame;
+    append_publish_frame(frame, "bench", message.data(), message.size());
+    ReactorMetrics metrics;
+    for (auto _ : state) {
+        // 和服务器一样, 每条发布的帧拷贝一次
+        BlockPtr block = make_block(frame.size());
+        memcpy(block->data.get(), frame.data(), frame.size());
+        broker.publish("bench", Slice{std::move(block), 0, frame.size(), false}, metrics);
+        broker.flush([](BenchConn& conn) { conn.send_buf.consume(conn.send_buf.size()); }, [](BenchConn&) {});
+    }
+    state.counters["deliveries"] = benchmark::Counter(state.iterations() * subscribers, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_BrokerFanOut)->Arg(1)->Arg(16)->Arg(256);
+
+// 回环上的扇出: 发布者一次发一批消息, N个订阅者各自收完这一批
+// 参数: 后端, 订阅者数量
+void BM_PubSubFanOut(benchmark::State& state) {
+    Backend backend = static_cast<Backend>(state.range(0));
+    const size_t count = state.range(1);
+    const int batch = 16;
+    state.SetLabel(backend_name(backend));
+    LoopbackServer server;
+    if (!server.start(backend)) {
+        state.SkipWithError("failed to start server");
+        return;
+    }
+    std::vector<Socket> subscribers;
+    std::vector<RecvBuffer> buffers(count);
+    std::string reply;
+    for (size_t i = 0; i < count; i++) {
+        subscribers.push_back(server.connect());
+        std::string request;
+        append_frame(request, Opcode::kSubscribe, "bench", 5);
+        if (!send_all(subscribers.back().get(), request.data(), request.size())
+            || !recv_frame(subscribers.back().get(), buffers[i], reply)) {
+            state.SkipWithError("subscribe failed");
+            return;
+        }
+    }
+    Socket publisher = server.connect();
+    std::string message(256, 'x');
+    std::string data;
+    for (int i = 0; i < batch; i++) {
+        append_publish_frame(data, "bench", message.data(), message.size());
+    }
+    for (auto _ : state) {
+        if (!send_all(publisher.get(), data.data(), data.size())) {
+            state.SkipWithError("publish failed");
+            break;
+        }
+        for (size_t i = 0; i < count && !state.error_occurred(); i++) {
+            for (int j = 0; j < batch; j++) {
+                if (!recv_frame(subscribers[i].get(), buffers[i], reply)) {
+                    state.SkipWithError("subscriber closed");
+                    break;
+                }
+            }
+        }
+        if (state.error_occurred()) {
+            break;
+        }
+    }
+    state.counters["deliveries"] =
+        benchmark::Counter(state.iterations() * batch * count, benchmark::Counter::kIsRate);
+    subscribers.clear();
+    publisher.reset();
+    server.stop();
+}
+BENCHMARK(BM_PubSubFanOut)
+    ->ArgsProduct({{(int)Backend::kEpollLevel, (int)Backend::kEpollEdge}, {1, 16, 64}})
+    ->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,69 @@
+#include <benchmark/benchmark.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "load_generator.h"
+#include "socket.h"
+#include "udp_server.h"
+
+namespace {
+
+// 回环上的UDP回声: 每轮发一批数据报再全部收回来
+// 参数: 每批数据报数, 服务器和客户端是否用GSO, 服务器是否用GRO
+void BM_UdpEcho(benchmark::State& state) {
+    const int burst_count = state.range(0);
+    const bool gso = state.range(1) != 0;
+    const size_t size = 64;
+    shutdown_server = false;
+    init_drain_event();
+    udp_options.gso = gso;
+    udp_options.gro = state.range(2) != 0;
+    socket_options.address = "127.0.0.1";
+    socket_options.port = 0;
+    UdpReactor reactor;
+    reactor.fd = create_udp_fd(false);
+    if (reactor.fd == -1) {
+        state.SkipWithError("failed to start server");
+        return;
+    }
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(local_port(reactor.fd));
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::thread thread(run_udp_reactor, std::ref(reactor));
+
+    Socket client(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    connect(client.get(), (sockaddr*)&server, sizeof(server));
+    // 丢包时不要一直卡住
+    timeval timeout{1, 0};
+    setsockopt(client.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string burst(burst_count * size, 'x');
+    std::vector<char> reply(size);
+    for (auto _ : state) {
+        if (send_udp_burst(client.get(), burst, size, gso) != burst_count) {
+            state.SkipWithError("send failed");
+            break;
+        }
+        for (int i = 0; i < burst_count; i++) {
+            if (recv(client.get(), reply.data(), reply.size(), 0) != (ssize_t)size) {
+                state.SkipWithError("datagram lost");
+                break;
+            }
+        }
+        if (state.error_occurred()) {
+            break;
+        }
+    }
+    state.counters["datagrams"] = benchmark::Counter(state.iterations() * burst_count, benchmark::Counter::kIsRate);
+    request_drain();
+    thread.join();
+    udp_options = UdpOptions();
+}
+BENCHMARK(BM_UdpEcho)->ArgsProduct({{1, 32}, {0, 1}, {0, 1}})->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,232 @@
+#ifndef LINUX_SOCKET_BUFFER_H
+#define LINUX_SOCKET_BUFFER_H
+
+// 收发缓冲区
+// 接收和发送共用引用计数的Block, 回声时直接把接收缓冲区里的那一段挂到发送队列上, 不再拷贝
+// 发送队列是一串Slice, 每次可写时用一次sendmsg把所有待发的Slice发出去, 部分发送只移动偏移
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+
+// 一块定长内存, 不做零初始化
+struct Block {
+    explicit Block(size_t size) : data(new char[size]), capacity(size) {}
+
+    std::unique_ptr<char[]> data;
+    size_t capacity;
+};
+
+using BlockPtr = std::shared_ptr<Block>;
+
+inline BlockPtr make_block(size_t size) {
+    return std::make_shared<Block>(size);
+}
+
+// Block中的一段[offset, offset + len)
+struct Slice {
+    BlockPtr block;
+    size_t offset = 0;
+    size_t len = 0;
+    // 发送队列太长时可以整段丢掉, 比如推送给订阅者的消息; 回复不能丢
+    bool droppable = false;
+
+    const char* data() const { return block->data.get() + offset; }
+};
+
+// 接收缓冲区, [read_pos, write_pos)是已经收到但还没解析的数据
+// recv直接写到prepare返回的位置, 解析时原地取帧, 整个过程只有内核到用户态的那一次拷贝
+// 已经解析过的部分可能被发送队列引用着, 所以Block被共享时绝不改写write_pos之前的内容
+struct RecvBuffer {
+    BlockPtr block;
+    size_t read_pos = 0;
+    size_t write_pos = 0;
+
+    size_t capacity() const { return block ? block->capacity : 0; }
+    size_t readable() const { return write_pos - read_pos; }
+    size_t writable() const { return capacity() - write_pos; }
+    const char* peek() const { return block->data.get() + read_pos; }
+
+    // 保证尾部至少有min_size字节可写, 返回可写区域的起始地址
+    char* prepare(size_t min_size) {
+        bool shared = block && block.use_count() > 1;
+        if (!shared && read_pos == write_pos) {
+            // 全部解析完了也没人引用, 直接从头开始写
+            read_pos = write_pos = 0;
+        }
+        if (writable() < min_size) {
+            if (!shared && read_pos > 0 && capacity() - readable() >= min_size) {
+                // 把剩下的半帧挪到头部, 一般只有几个字节
+                memmove(block->data.get(), peek(), readable());
+            } else {
+                // 被发送队列引用着或者确实不够大, 换一块新的, 只搬剩下的半帧
+                size_t new_size = capacity() > readable() + min_size ? capacity() : readable() + min_size;
+                if (!shared && new_size < capacity() * 2) {
+                    new_size = capacity() * 2;
+                }
+                BlockPtr new_block = make_block(new_size);
+                if (readable() > 0) {
+                    memcpy(new_block->data.get(), peek(), readable());
+                }
+                block = std::move(new_block);
+            }
+            write_pos -= read_pos;
+            read_pos = 0;
+        }
+        return block->data.get() + write_pos;
+    }
+
+    void commit(size_t len) { write_pos += len; }
+
+    // 引用缓冲区里begin开始的len个字节, begin必须是peek()之前已经解析过的数据
+    Slice slice(const char* begin, size_t len) const {
+        return Slice{block, (size_t)(begin - block->data.get()), len};
+    }
+
+    // 缓冲区已经解析空了并且容量远大于平时需要时, 把多余的内存还回去
+    void shrink(size_t size) {
+        if (readable() != 0) {
+            return;
+        }
+        read_pos = write_pos = 0;
+        block = make_block(size);
+    }
+
+    // 连接关闭时清空, 没人引用并且不太大的Block留着给下一个连接用
+    void recycle(size_t max_keep) {
+        read_pos = write_pos = 0;
+        if (block && (block.use_count() > 1 || block->capacity > max_keep)) {
+            block.reset();
+        }
+    }
+};
+
+// 发送队列, 按顺序保存待发送的Slice
+class OutputBuffer {
+public:
+    bool empty() const { return bytes_ == 0; }
+    size_t size() const { return bytes_; }
+
+    // 和上一段在同一个Block里首尾相接时直接合并, 连续回声的多帧只占一个iovec
+    void append(Slice slice) {
+        if (slice.len == 0) {
+            return;
+        }
+        bytes_ += slice.len;
+        if (!slices_.empty() && !slice.droppable) {
+            Slice& last = slices_.back();
+            if (!last.droppable && last.block == slice.block && last.offset + last.len == slice.offset) {
+                last.len += slice.len;
+                return;
+            }
+        }
+        slices_.push_back(std::move(slice));
+    }
+
+    // 不属于任何接收缓冲区的数据(比如服务器自己生成的回复)拷贝进一块新的Block
+    void append(const char* data, size_t len) {
+        if (len == 0) {
+            return;
+        }
+        BlockPtr block = make_block(len);
+        memcpy(block->data.get(), data, len);
+        append(Slice{std::move(block), 0, len, false});
+    }
+
+    // 把队列前面最多max_count段填进iov, 返回填了多少段
+    int fill_iovec(iovec* iov, int max_count) const {
+        int iov_count = 0;
+        for (const Slice& slice : slices_) {
+            if (iov_count == max_count) {
+                break;
+            }
+            iov[iov_count].iov_base = const_cast<char*>(slice.data());
+            iov[iov_count].iov_len = slice.len;
+            iov_count++;
+        }
+        return iov_count;
+    }
+
+    // 把最多IOV_MAX段, 最多max_bytes字节的数据用一次sendmsg发出去, 返回值和sendmsg相同
+    // 发出去的部分已经从队列里去掉了; max_bytes不能是0
+    ssize_t write_to(int fd, size_t max_bytes = SIZE_MAX) {
+        iovec iov[IOV_MAX];
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = fill_iovec(iov, IOV_MAX);
+        if (max_bytes < bytes_) {
+            // 超出份额的部分截掉, 截断的那一段只发前面一部分
+            size_t total = 0;
+            for (size_t i = 0; i < msg.msg_iovlen; i++) {
+                if (total + iov[i].iov_len >= max_bytes) {
+                    iov[i].iov_len = max_bytes - total;
+                    msg.msg_iovlen = i + 1;
+                    break;
+                }
+                total += iov[i].iov_len;
+            }
+        }
+        ssize_t sent_len = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent_len > 0) {
+            consume(sent_len);
+        }
+        return sent_len;
+    }
+
+    // 丢掉前len个字节, 部分发送时只移动第一段的偏移
+    void consume(size_t len) {
+        bytes_ -= len;
+        while (len > 0) {
+            Slice& front = slices_.front();
+            if (len < front.len) {
+                front.offset += len;
+                front.len -= len;
+                front_started_ = true;
+                return;
+            }
+            len -= front.len;
+            slices_.pop_front();
+            front_started_ = false;
+        }
+    }
+
+    // 从最老的开始丢掉可以丢的整段, 直到队列不超过max_bytes或者没有可丢的了, 返回丢了几段
+    // 已经发出去一部分的第一段不能丢, 否则对面收到的帧就断了
+    size_t drop_oldest(size_t max_bytes) {
+        size_t dropped = 0;
+        auto it = slices_.begin();
+        if (front_started_ && it != slices_.end()) {
+            ++it;
+        }
+        while (bytes_ > max_bytes && it != slices_.end()) {
+            if (it->droppable) {
+                bytes_ -= it->len;
+                it = slices_.erase(it);
+                dropped++;
+            } else {
+                ++it;
+            }
+        }
+        return dropped;
+    }
+
+    void clear() {
+        slices_.clear();
+        bytes_ = 0;
+        front_started_ = false;
+    }
+
+private:
+    std::deque<Slice> slices_;
+    size_t bytes_ = 0;
+    // 第一段已经发出去了一部分
+    bool front_started_ = false;
+};
+
+#endif
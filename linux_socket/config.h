@@ -0,0 +1,230 @@
+#ifndef LINUX_SOCKET_CONFIG_H
+#define LINUX_SOCKET_CONFIG_H
+
+// 运行时配置
+// 每个程序把自己的参数注册到OptionParser上, 参数直接写进对应的变量里, 不用重新编译就能调参数
+// 同一套参数既可以写在命令行上(--name=value, 布尔参数可以只写--name), 也可以写进配置文件(name = value),
+// 配置文件用--config=FILE指定, 先读配置文件再应用命令行, 所以命令行上的参数优先
+// 要支持新的参数类型, 给它加一对parse_config_value和format_config_value的重载就行
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+inline bool parse_config_value(const char* text, std::string& value) {
+    value = text;
+    return true;
+}
+
+inline bool parse_config_value(const char* text, bool& value) {
+    if (strcmp(text, "1") == 0 || strcmp(text, "true") == 0 || strcmp(text, "on") == 0) {
+        value = true;
+    } else if (strcmp(text, "0") == 0 || strcmp(text, "false") == 0 || strcmp(text, "off") == 0) {
+        value = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool parse_config_value(const char* text, double& value) {
+    char* end = nullptr;
+    errno = 0;
+    double parsed = strtod(text, &end);
+    if (errno != 0 || end == text || *end != '\0') {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+// 各种整数统一按有符号的64位解析再检查范围, 解析失败时不改value
+template <typename T>
+bool parse_config_value(const char* text, T& value) {
+    char* end = nullptr;
+    errno = 0;
+    long long parsed = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0') {
+        return false;
+    }
+    if (parsed < 0 && static_cast<T>(-1) > 0) {
+        return false;
+    }
+    T result = static_cast<T>(parsed);
+    if (static_cast<long long>(result) != parsed) {
+        return false;
+    }
+    value = result;
+    return true;
+}
+
+// 在--help里显示默认值用
+inline std::string format_config_value(const std::string& value) {
+    return value.empty() ? "\"\"" : value;
+}
+
+inline std::string format_config_value(bool value) {
+    return value ? "true" : "false";
+}
+
+inline std::string format_config_value(double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%g", value);
+    return text;
+}
+
+template <typename T>
+std::string format_config_value(T value) {
+    return std::to_string(value);
+}
+
+class OptionParser {
+public:
+    explicit OptionParser(std::string usage) : usage_(std::move(usage)) {}
+
+    // 注册一个参数, 解析成功时写进target; target里原来的值就是默认值, 会显示在--help里
+    template <typename T>
+    void add(const char* name, T* target, const char* help) {
+        Option option;
+        option.name = name;
+        option.help = help;
+        option.is_flag = std::is_same<T, bool>::value;
+        option.default_value = format_config_value(*target);
+        option.set = [target](const char* text) { return parse_config_value(text, *target); };
+        options_.push_back(std::move(option));
+    }
+
+    // 不带--的参数交给handler处理, 不设置的话当作错误
+    void set_positional(std::function<bool(const char*)> handler) { positional_ = std::move(handler); }
+
+    // 先读--config指定的配置文件, 再按顺序应用其他命令行参数
+    // 参数有错或者带了--help时返回false, 出错的原因和用法都打到stderr
+    bool parse(int argc, char* argv[]) {
+        for (int i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "--config=", 9) == 0 && !load_file(argv[i] + 9)) {
+                return false;
+            }
+        }
+        for (int i = 1; i < argc; i++) {
+            const char* arg = argv[i];
+            if (strncmp(arg, "--config=", 9) == 0) {
+                continue;
+            }
+            if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+                print_usage();
+                return false;
+            }
+            if (strncmp(arg, "--", 2) != 0) {
+                if (!positional_ || !positional_(arg)) {
+                    fprintf(stderr, "Unknown argument: %s, see --help\n", arg);
+                    return false;
+                }
+                continue;
+            }
+            std::string name = arg + 2;
+            const char* value = nullptr;
+            size_t equal_pos = name.find('=');
+            if (equal_pos != std::string::npos) {
+                value = arg + 2 + equal_pos + 1;
+                name.resize(equal_pos);
+            }
+            if (!apply(name, value, "command line")) {
+                fprintf(stderr, "See --help for all options\n");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 一行一个name = value, #开头的是注释
+    bool load_file(const char* path) {
+        FILE* file = fopen(path, "r");
+        if (file == nullptr) {
+            fprintf(stderr, "Failed to open config file %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        char line[1024];
+        int line_num = 0;
+        bool ok = true;
+        while (ok && fgets(line, sizeof(line), file) != nullptr) {
+            line_num++;
+            std::string text = trim(line);
+            if (text.empty() || text[0] == '#') {
+                continue;
+            }
+            size_t equal_pos = text.find('=');
+            std::string where = std::string(path) + ":" + std::to_string(line_num);
+            if (equal_pos == std::string::npos) {
+                fprintf(stderr, "%s: expected name = value\n", where.c_str());
+                ok = false;
+                break;
+            }
+            std::string value = trim(text.substr(equal_pos + 1));
+            ok = apply(trim(text.substr(0, equal_pos)), value.c_str(), where.c_str());
+        }
+        fclose(file);
+        return ok;
+    }
+
+    void print_usage() const {
+        fprintf(stderr, "%s\n", usage_.c_str());
+        fprintf(stderr, "  --config=FILE                 read options from FILE, one \"name = value\" per line\n");
+        for (const Option& option : options_) {
+            std::string left = "  --" + option.name + (option.is_flag ? "" : "=VALUE");
+            fprintf(stderr, "%-32s%s (default: %s)\n", left.c_str(), option.help.c_str(), option.default_value.c_str());
+        }
+    }
+
+private:
+    struct Option {
+        std::string name;
+        std::string help;
+        std::string default_value;
+        bool is_flag = false;
+        std::function<bool(const char*)> set;
+    };
+
+    bool apply(const std::string& name, const char* value, const char* where) {
+        for (Option& option : options_) {
+            if (option.name != name) {
+                continue;
+            }
+            if (value == nullptr) {
+                // 布尔参数只写名字就是打开
+                if (!option.is_flag) {
+                    fprintf(stderr, "%s: option %s needs a value\n", where, name.c_str());
+                    return false;
+                }
+                value = "true";
+            }
+            if (!option.set(value)) {
+                fprintf(stderr, "%s: invalid value for %s: %s\n", where, name.c_str(), value);
+                return false;
+            }
+            return true;
+        }
+        fprintf(stderr, "%s: unknown option %s\n", where, name.c_str());
+        return false;
+    }
+
+    static std::string trim(const std::string& text) {
+        size_t begin = text.find_first_not_of(" \t\r\n");
+        if (begin == std::string::npos) {
+            return "";
+        }
+        size_t end = text.find_last_not_of(" \t\r\n");
+        return text.substr(begin, end - begin + 1);
+    }
+
+    std::string usage_;
+    std::vector<Option> options_;
+    std::function<bool(const char*)> positional_;
+};
+
+#endif
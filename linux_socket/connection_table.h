@@ -0,0 +1,101 @@
+#ifndef LINUX_SOCKET_CONNECTION_TABLE_H
+#define LINUX_SOCKET_CONNECTION_TABLE_H
+
+// 连接表
+// 连接对象从按块分配的对象池里取, 关闭后放回池子, 对象本身连同它的收发缓冲区都留给下一个连接用,
+// 频繁建连断连时不用反复malloc; 对象地址在整个生命周期里不变, 可以直接放进epoll_event.data.ptr
+// 另外维护一个按fd下标的数组, 只知道fd的时候(比如io_uring的user_data)直接下标访问, 不用哈希
+//
+// T需要有: 默认构造函数, int client_fd, reset(int fd)在分配给新连接时重置状态, release()在关闭时丢掉连接状态
+
+#include <memory>
+#include <vector>
+
+template <typename T>
+class ConnectionTable {
+public:
+    // 对象池每次扩容分配多少个对象
+    static constexpr size_t kChunkSize = 64;
+
+    ConnectionTable() = default;
+    ConnectionTable(const ConnectionTable&) = delete;
+    ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+    // 给fd分配一个连接对象
+    T* open(int fd) {
+        if (free_.empty()) {
+            grow();
+        }
+        T* conn = free_.back();
+        free_.pop_back();
+        conn->reset(fd);
+        if ((size_t)fd >= by_fd_.size()) {
+            by_fd_.resize(fd + 1, nullptr);
+        }
+        by_fd_[fd] = conn;
+        size_++;
+        return conn;
+    }
+
+    T* find(int fd) const {
+        if (fd < 0 || (size_t)fd >= by_fd_.size()) {
+            return nullptr;
+        }
+        return by_fd_[fd];
+    }
+
+    // 关闭连接, 调用者要先close(fd)或者保证之后不会再用这个fd找它
+    // 对象要等reclaim之后才会分给新连接, 所以同一批事件里后面指向它的事件能看到client_fd == -1并跳过
+    void close(T* conn) {
+        by_fd_[conn->client_fd] = nullptr;
+        conn->release();
+        closed_.push_back(conn);
+        size_--;
+    }
+
+    // 每轮事件处理完之后调用, 把这一轮关掉的对象放回池子
+    void reclaim() {
+        free_.insert(free_.end(), closed_.begin(), closed_.end());
+        closed_.clear();
+    }
+
+    size_t size() const { return size_; }
+
+    // 依次访问所有打开的连接, func里不能开关连接
+    template <typename Func>
+    void for_each(Func func) {
+        for (T* conn : by_fd_) {
+            if (conn != nullptr) {
+                func(*conn);
+            }
+        }
+    }
+
+    // 释放所有连接和对象池的内存
+    void clear() {
+        by_fd_.clear();
+        free_.clear();
+        closed_.clear();
+        chunks_.clear();
+        size_ = 0;
+    }
+
+private:
+    void grow() {
+        chunks_.emplace_back(new T[kChunkSize]);
+        T* chunk = chunks_.back().get();
+        // 倒着放进去, 先分出去的是块里靠前的对象
+        for (size_t i = kChunkSize; i > 0; i--) {
+            free_.push_back(&chunk[i - 1]);
+        }
+    }
+
+    std::vector<std::unique_ptr<T[]>> chunks_;
+    std::vector<T*> free_;
+    // 本轮关闭, 还没放回池子的对象
+    std::vector<T*> closed_;
+    std::vector<T*> by_fd_;
+    size_t size_ = 0;
+};
+
+#endif
@@ -0,0 +1,757 @@
+#ifndef LINUX_SOCKET_EPOLL_REACTOR_H
+#define LINUX_SOCKET_EPOLL_REACTOR_H
+
+// epoll后端的事件循环, 协议处理在server_common.h里, 和io_uring后端共用
+// 支持LT和ET两种模式, ET模式下每次唤醒一直读到EAGAIN, 但单个连接有读取上限, 读不完的下一轮接着读
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "config.h"
+#include "connection_table.h"
+#include "logger.h"
+#include "rate_limit.h"
+#include "server_common.h"
+
+// epoll后端的参数, 启动时设置好, 之后只读
+struct EpollOptions {
+    // 一次epoll_wait最多取多少个事件
+    int event_batch = 20;
+    // 每次listen_fd可读时最多accept多少个连接
+    int accept_batch = 64;
+    // 自适应读缓冲的范围, 以及ET模式下单个连接每次唤醒最多读多少, 防止一个大流量客户端饿死其他客户端
+    size_t min_read_chunk = 1024;
+    size_t max_read_chunk = 64 * 1024;
+    size_t max_read_per_wakeup = 128 * 1024;
+};
+
+inline EpollOptions epoll_options;
+
+inline void add_epoll_options(OptionParser& parser) {
+    parser.add("event-batch", &epoll_options.event_batch, "max events per epoll_wait");
+    parser.add("accept-batch", &epoll_options.accept_batch, "max accepts per wakeup");
+    parser.add("min-read-chunk", &epoll_options.min_read_chunk, "smallest recv size of the adaptive read buffer");
+    parser.add("max-read-chunk", &epoll_options.max_read_chunk, "largest recv size of the adaptive read buffer");
+    parser.add("max-read-per-wakeup", &epoll_options.max_read_per_wakeup, "max bytes read from one connection per wakeup in ET mode");
+}
+
+// 参数不合理时返回false
+inline bool check_epoll_options() {
+    return epoll_options.event_batch > 0 && epoll_options.accept_batch > 0 && epoll_options.min_read_chunk > 0
+        && epoll_options.max_read_chunk >= epoll_options.min_read_chunk;
+}
+
+struct ClientInfo : Connection {
+    void reset(int fd) {
+        Connection::reset(fd);
+        read_chunk = epoll_options.min_read_chunk;
+        want_read = true;
+        want_write = false;
+        read_pending = false;
+        throttled = false;
+        throttle_timer.owner = static_cast<Connection*>(this);
+        deficit = 0;
+        write_round = 0;
+        write_queued = false;
+    }
+
+    // 限速和背压都没有暂停读
+    bool can_read() const { return !read_paused && !throttled; }
+    // 有数据要发, 并且不是在write_queue里排队等下一轮, 这时才需要EPOLLOUT
+    bool wants_write() const { return !send_buf.empty() && !write_queued; }
+
+    // 下一次recv准备多大的空间, 收满了就翻倍, 收得很少就减半
+    size_t read_chunk = 0;
+    // 当前是否在epoll中注册了EPOLLIN和EPOLLOUT, 只有状态变化时才EPOLL_CTL_MOD
+    bool want_read = true;
+    bool want_write = false;
+    // ET模式下读到上限还没读完, 挂在reactor的pending_reads里等下一轮继续读
+    bool read_pending = false;
+    // 这个连接自己的限速, 任何一个桶透支了就摘掉EPOLLIN, throttle_timer到期时再打开
+    TokenBucket read_bytes;
+    TokenBucket read_messages;
+    TimerNode throttle_timer;
+    bool throttled = false;
+    // DRR调度: 这一轮还能发多少字节, write_round是哪一轮补的份额
+    size_t deficit = 0;
+    uint64_t write_round = 0;
+    // 份额用完了还有数据, 挂在reactor的write_queue里等下一轮接着发
+    bool write_queued = false;
+};
+
+// 一个reactor就是一个事件循环, 独占自己的listen_fd, epfd和clients表
+// 多个reactor之间只通过broker的收件箱转交发布的消息, 其他什么都不共享, 所以热路径上不需要加锁
+// 客户端的epoll_event.data.ptr直接指向连接对象, 处理事件时不用查表; listen_fd的data.ptr是nullptr,
+// drain_event_fd的data.ptr指向drain_event_fd这个全局变量
+struct Reactor {
+    int id = 0;
+    int listen_fd = -1;
+    int epfd = -1;
+    bool edge_triggered = false;
+    ConnectionTable<ClientInfo> clients;
+    std::vector<ClientInfo*> pending_reads;
+    // 这一轮发送份额用完的连接, 下一轮按排队的顺序轮流发, 大流量的连接不会一直占着事件循环
+    std::vector<ClientInfo*> write_queue;
+    // 全局限速里这个reactor的那一份, reactor_count是全局速率要平分给几个reactor
+    TokenBucket read_bytes;
+    TokenBucket read_messages;
+    int reactor_count = 1;
+    // 事件循环的轮次, 每次epoll_wait返回加一
+    uint64_t round = 0;
+    ReactorMetrics metrics;
+    TimingWheel timers;
+    // 这个reactor上的订阅者, 收件箱的eventfd挂在epfd上, data.ptr指向broker
+    Broker broker;
+    // 每轮epoll_wait返回后更新一次, 这一轮里都用它当现在的时间
+    uint64_t now_ms = 0;
+    // 开始优雅退出之后, 到drain_deadline_ms还没关的连接直接关掉
+    bool draining = false;
+    uint64_t drain_deadline_ms = 0;
+};
+
+// 初始化reactor的epfd并把listen_fd挂上去, 失败返回false
+// listen_fd不是-1时用这个从旧进程接过来的监听socket, 不再新建
+inline bool init_reactor(Reactor& reactor, bool reuse_port, int listen_fd = -1) {
+    reactor.listen_fd = listen_fd != -1 ? listen_fd : create_listen_fd(reuse_port, true);
+    if (reactor.listen_fd == -1) {
+        return false;
+    }
+    // 旧进程可能是io_uring后端, 监听socket是阻塞的; O_NONBLOCK只加不去, 旧进程的epoll也要靠它
+    int flags = listen_fd != -1 ? fcntl(listen_fd, F_GETFL, 0) : O_NONBLOCK;
+    if (flags == -1 || (!(flags & O_NONBLOCK) && fcntl(reactor.listen_fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+        LOG_ERROR("Failed to set listen socket nonblocking: %s", strerror(errno));
+        close(reactor.listen_fd);
+        return false;
+    }
+
+    reactor.epfd = epoll_create1(0);
+    if (reactor.epfd == -1) {
+        LOG_ERROR("Failed to create epfd: %s", strerror(errno));
+        close(reactor.listen_fd);
+        return false;
+    }
+
+    epoll_event ev;
+    ev.data.ptr = nullptr;
+    ev.events = EPOLLIN;
+
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.listen_fd, &ev) == -1) {
+        LOG_ERROR("Failed to add listen_fd to epoll ev: %s", strerror(errno));
+        close(reactor.listen_fd);
+        close(reactor.epfd);
+        return false;
+    }
+
+    ev.data.ptr = &reactor.broker;
+    if (!reactor.broker.init() || epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.broker.event_fd(), &ev) == -1) {
+        LOG_ERROR("Failed to set up pub/sub inbox: %s", strerror(errno));
+        close(reactor.listen_fd);
+        close(reactor.epfd);
+        return false;
+    }
+
+    ev.data.ptr = &drain_event_fd;
+    if (drain_event_fd != -1 && epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, drain_event_fd, &ev) == -1) {
+        LOG_ERROR("Failed to add drain event to epoll: %s", strerror(errno));
+        close(reactor.listen_fd);
+        close(reactor.epfd);
+        return false;
+    }
+    return true;
+}
+
+// 多reactor时每个broker都要知道其他所有broker, 发布的消息才能送到别的reactor上的订阅者
+// 在reactor线程启动之前调用
+inline void connect_brokers(std::vector<Reactor>& reactors) {
+    for (Reactor& reactor : reactors) {
+        std::vector<Broker*> peers;
+        for (Reactor& peer : reactors) {
+            if (&peer != &reactor) {
+                peers.push_back(&peer.broker);
+            }
+        }
+        reactor.broker.set_peers(std::move(peers));
+    }
+}
+
+inline uint32_t client_events(const Reactor& reactor, bool want_read, bool want_write) {
+    uint32_t events = 0;
+    if (want_read) {
+        events |= EPOLLIN;
+    }
+    if (want_write) {
+        events |= EPOLLOUT;
+    }
+    if (reactor.edge_triggered) {
+        events |= EPOLLET;
+    }
+    return events;
+}
+
+// 只在关注的事件真正变化时才去改epoll, 省掉每条消息一次的EPOLL_CTL_MOD
+// ET模式下重新打开EPOLLIN时EPOLL_CTL_MOD会重新检查一次可读, 暂停期间到达的数据不会丢掉通知
+inline bool set_interest(Reactor& reactor, ClientInfo& client, bool want_read, bool want_write) {
+    if (client.want_read == want_read && client.want_write == want_write) {
+        return true;
+    }
+    epoll_event ev;
+    ev.data.ptr = &client;
+    ev.events = client_events(reactor, want_read, want_write);
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_MOD, client.client_fd, &ev) == -1) {
+        return false;
+    }
+    client.want_read = want_read;
+    client.want_write = want_write;
+    return true;
+}
+
+inline void close_client(Reactor& reactor, ClientInfo& client) {
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, client.client_fd, nullptr);
+    close(client.client_fd);
+    reactor.timers.cancel(&client.timer);
+    reactor.timers.cancel(&client.throttle_timer);
+    reactor.broker.remove(client);
+    reactor.clients.close(&client);
+    reactor.metrics.active_connections.sub();
+    release_connection();
+}
+
+// 把accept4拿到的连接加进reactor, 失败时负责关掉client_fd
+inline void add_client(Reactor& reactor, int client_fd) {
+    if (!reserve_connection()) {
+        // 连接数满了, 接下来马上关掉, 免得它一直堵在backlog里
+        close(client_fd);
+        reactor.metrics.rejected_connections.add();
+        return;
+    }
+    ClientInfo* client = reactor.clients.open(client_fd);
+    epoll_event client_ev;
+    client_ev.data.ptr = client;
+    client_ev.events = client_events(reactor, true, false);
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, client_fd, &client_ev) == -1) {
+        int error = errno;
+        LOG_WARN("Failed to add client_fd to epoll, discard client");
+        close(client_fd);
+        reactor.clients.close(client);
+        release_connection();
+        if (error != EPERM && error != ENOENT && error != EEXIST) {
+            LOG_ERROR("Error, shuting down server: %s", strerror(error));
+            shutdown_server = true;
+        }
+        return;
+    }
+    reactor.metrics.accepts.add();
+    reactor.metrics.active_connections.add();
+    client->last_active_ms = reactor.now_ms;
+    init_bucket(client->read_bytes, rate_limit_options.conn_bytes, 1, reactor.now_ms);
+    init_bucket(client->read_messages, rate_limit_options.conn_messages, 1, reactor.now_ms);
+    update_connection_timer(reactor.timers, *client);
+}
+
+// 服务器fd发现有新的链接, 一次把backlog里排着的连接都取出来
+// accept4直接带上SOCK_NONBLOCK, 省掉每个连接两次fcntl; 每次唤醒最多取accept_batch个,
+// 剩下的listen_fd还是可读的, 下一轮接着取, 建连风暴时也不会饿着已有的连接
+inline void handle_accept(Reactor& reactor) {
+    for (int i = 0; i < epoll_options.accept_batch; i++) {
+        SocketAddress client_addr;
+        client_addr.len = sizeof(client_addr.storage);
+        // 不打新连接日志时连对端地址都不用内核填
+        sockaddr* addr = log_config.accept ? client_addr.get() : nullptr;
+        int client_fd = accept4(reactor.listen_fd, addr, addr != nullptr ? &client_addr.len : nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                // 对端在accept之前就断开了, 接着取下一个
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN("Failed to accept client: %s", strerror(errno));
+            }
+            // backlog取空了; 这个client连接不了但是其他已连接的client还要管的嘛
+            return;
+        }
+        if (log_config.accept) {
+            LOG_INFO("[reactor %d] %s connected", reactor.id, format_address(client_addr.get()).c_str());
+        }
+        add_client(reactor, client_fd);
+    }
+}
+
+// 把send_buf里的数据尽量发出去, 每轮一次sendmsg带上所有待发的消息
+// 每轮事件循环每个连接最多发write_quantum字节(DRR), 份额用完还有数据就排进write_queue, 下一轮再补一个份额接着发
+// 字节流可以在任意位置切开, 不会剩下发不出去的零头, 所以份额不用跨轮累积
+// 发送队列太长就暂停读, 返回false表示连接出错要关闭
+inline bool send_queued(Reactor& reactor, ClientInfo& client) {
+    bool progressed = false;
+    const size_t quantum = rate_limit_options.write_quantum;
+    if (quantum > 0 && client.write_round != reactor.round) {
+        client.write_round = reactor.round;
+        client.deficit = quantum;
+    }
+    // 只发出去一部分时可能是socket发送缓冲区满了, 也可能是超过了IOV_MAX段
+    // 前者再试一次会直接EAGAIN, 后者会接着发
+    while (!client.send_buf.empty()) {
+        if (quantum > 0 && client.deficit == 0) {
+            if (!client.write_queued) {
+                client.write_queued = true;
+                reactor.write_queue.push_back(&client);
+                reactor.metrics.write_yields.add();
+            }
+            break;
+        }
+        ssize_t sent_len = client.send_buf.write_to(client.client_fd, quantum > 0 ? client.deficit : SIZE_MAX);
+        if (sent_len == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                reactor.metrics.partial_sends.add();
+                break;
+            }
+            // 发生严重错误, 直接退出链接
+            LOG_WARN("Error occur when sending message, disconnect: %s", strerror(errno));
+            return false;
+        } else if (sent_len == 0) {
+            LOG_WARN("Error occur when sending message, disconnect");
+            return false;
+        }
+        reactor.metrics.bytes_out.add(sent_len);
+        progressed = true;
+        if (quantum > 0) {
+            client.deficit -= sent_len;
+        }
+    }
+    update_write_state(client, progressed, reactor.now_ms);
+    if (update_backpressure(client, reactor.metrics) && client.read_paused) {
+        // 暂停期间不再接着读, 恢复时重新打开EPOLLIN会再通知一次
+        client.read_pending = false;
+    }
+    update_connection_timer(reactor.timers, client);
+    return true;
+}
+
+// 推进连接上的零拷贝传输, 只关注卡住的那一边: bulk echo等socket可读或者可写, 发文件只等可写
+// 传完之后接着处理recv_buf里排在后面的帧, 又遇到传输就接着传; 返回false表示连接出错要关闭
+// 调用之前send_buf要已经发空, 传输的帧头在里面, 必须先发出去
+inline bool drive_transfer(Reactor& reactor, ClientInfo& client) {
+    Transfer& transfer = client.transfer;
+    while (true) {
+        TransferProgress progress;
+        bool ok = false;
+        if (transfer.kind == TransferKind::kBulkEcho) {
+            ok = transfer.pipe.open()
+                && splice_relay(client.client_fd, client.client_fd, transfer.pipe, transfer.remaining, SPLICE_F_NONBLOCK, progress);
+        } else {
+            ok = send_file_chunk(client.client_fd, transfer.file_fd, transfer.file_offset, transfer.remaining, progress);
+        }
+        reactor.metrics.bytes_in.add(progress.bytes_in);
+        reactor.metrics.bytes_out.add(progress.bytes_out);
+        reactor.metrics.zero_copy_bytes.add(progress.bytes_out);
+        if (!ok) {
+            LOG_WARN("Zero copy transfer on fd %d failed, disconnect: %s", client.client_fd, strerror(errno));
+            return false;
+        }
+        if (progress.bytes_in + progress.bytes_out > 0) {
+            client.last_active_ms = reactor.now_ms;
+        }
+        if (transfer.remaining > 0 || transfer.pipe.buffered > 0) {
+            if (progress.out_blocked) {
+                reactor.metrics.partial_sends.add();
+            }
+            update_connection_timer(reactor.timers, client);
+            // pipe里还有数据发不出去时只等EPOLLOUT: 往pipe里搬的EAGAIN可能是pipe的页用完了, 不是socket没数据,
+            // 这时关注EPOLLIN的话LT模式下socket里有数据就一直被唤醒, 又什么都搬不动; 能发出去之后会接着往pipe里搬
+            bool want_in = progress.in_blocked && !(progress.out_blocked && transfer.pipe.buffered > 0);
+            return set_interest(reactor, client, want_in, progress.out_blocked);
+        }
+
+        // 传输期间没有读socket, recv_buf里剩下的是传输开始之前就收到的后面的帧
+        transfer.finish();
+        if (!handle_frames(client, reactor.metrics, reactor.now_ms, true, &reactor.broker) || !send_queued(reactor, client)) {
+            return false;
+        }
+        if (!transfer.active()) {
+            if (reactor.edge_triggered && client.can_read() && !client.read_pending) {
+                // splice只取走了payload, 后面的帧可能已经在socket里了, ET模式下不会再通知, 下一轮主动读一次
+                client.read_pending = true;
+                reactor.pending_reads.push_back(&client);
+            }
+            return set_interest(reactor, client, client.can_read(), client.wants_write());
+        }
+        if (!client.send_buf.empty()) {
+            return set_interest(reactor, client, false, client.wants_write());
+        }
+    }
+}
+
+// 发送send_buf, 发不完就注册EPOLLOUT等下次可写
+// 有零拷贝传输时send_buf发空了就开始传输, 传输期间不读新数据, 免得把要splice的payload收进recv_buf
+// 返回false表示连接出错要关闭
+inline bool flush_send_buf(Reactor& reactor, ClientInfo& client) {
+    if (!send_queued(reactor, client)) {
+        return false;
+    }
+    if (client.transfer.active()) {
+        if (!client.send_buf.empty()) {
+            return set_interest(reactor, client, false, client.wants_write());
+        }
+        return drive_transfer(reactor, client);
+    }
+    return set_interest(reactor, client, client.can_read(), client.wants_write());
+}
+
+// 读之前检查限速, 返回还要等多少毫秒令牌才能补回来, 0表示可以读
+inline uint64_t read_wait_ms(Reactor& reactor, ClientInfo& client) {
+    if (!rate_limit_enabled()) {
+        return 0;
+    }
+    uint64_t wait = 0;
+    for (TokenBucket* bucket : {&client.read_bytes, &client.read_messages, &reactor.read_bytes, &reactor.read_messages}) {
+        bucket->refill(reactor.now_ms);
+        wait = std::max(wait, bucket->wait_ms());
+    }
+    return wait;
+}
+
+// 令牌透支了, 摘掉EPOLLIN直到令牌补回来, 对面再发就被TCP的接收窗口挡住; 返回false表示连接出错要关闭
+inline bool throttle_client(Reactor& reactor, ClientInfo& client, uint64_t wait_ms) {
+    client.throttled = true;
+    client.read_pending = false;
+    reactor.metrics.throttled.add();
+    reactor.timers.schedule(&client.throttle_timer, reactor.now_ms + wait_ms);
+    return set_interest(reactor, client, false, client.wants_write());
+}
+
+// throttle_timer到期, 重新打开EPOLLIN; 全局的桶可能又被别的连接用完了, 读之前还会再检查一次
+// 零拷贝传输的关注事件由drive_transfer管; 返回false表示连接出错要关闭
+inline bool resume_client(Reactor& reactor, ClientInfo& client) {
+    client.throttled = false;
+    if (client.transfer.active()) {
+        return true;
+    }
+    return set_interest(reactor, client, client.can_read(), client.wants_write());
+}
+
+// 优雅退出时已经shutdown(SHUT_WR)的连接, 读掉对面发来的数据, 对面关了连接返回false
+inline bool discard_input(ClientInfo& client) {
+    char buf[4096];
+    while (true) {
+        ssize_t recv_len = recv(client.client_fd, buf, sizeof(buf), 0);
+        if (recv_len > 0) {
+            continue;
+        }
+        if (recv_len == -1 && errno == EINTR) {
+            continue;
+        }
+        return recv_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+// 读取信息部分, 直接收进这个client的recv_buf尾部
+// LT模式下一次事件只recv一次; ET模式下一直读到EAGAIN, 但单次唤醒最多读max_read_per_wakeup字节
+// 返回false表示要关闭连接
+inline bool handle_read(Reactor& reactor, ClientInfo& client) {
+    client.read_pending = false;
+    if (client.write_shut) {
+        return discard_input(client);
+    }
+    if (client.transfer.active()) {
+        // bulk echo在等payload, 数据留在socket里给splice
+        return flush_send_buf(reactor, client);
+    }
+    uint64_t wait = read_wait_ms(reactor, client);
+    if (wait > 0) {
+        return throttle_client(reactor, client, wait);
+    }
+    size_t read_total = 0;
+    bool peer_closed = false;
+    while (true) {
+        char* buf = client.recv_buf.prepare(client.read_chunk);
+        size_t buf_len = client.recv_buf.writable();
+        ssize_t recv_len = recv(client.client_fd, buf, buf_len, 0);
+        if (recv_len == -1) {
+            if (errno == EINTR) {
+                // 如果有中断导致什么都没读, 那就立即重读
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 读干净了
+                break;
+            }
+            LOG_WARN("Failed to receive message, disconnect: %s", strerror(errno));
+            return false;
+        } else if (recv_len == 0) {
+            // 对面关了连接, 不过已经收到的帧还是要处理完
+            peer_closed = true;
+            break;
+        }
+        client.recv_buf.commit(recv_len);
+        read_total += recv_len;
+        reactor.metrics.bytes_in.add(recv_len);
+
+        // 收满了说明流量大, 下次准备更大的空间; 收得很少就缩回去
+        if ((size_t)recv_len == buf_len && client.read_chunk < epoll_options.max_read_chunk) {
+            client.read_chunk *= 2;
+        } else if ((size_t)recv_len < buf_len / 4 && client.read_chunk > epoll_options.min_read_chunk) {
+            client.read_chunk /= 2;
+        }
+
+        if (!reactor.edge_triggered || (size_t)recv_len < buf_len) {
+            // LT模式没读完epoll下次还会报; ET模式下没收满说明内核缓冲区已经空了, 新数据到了会再触发
+            break;
+        }
+        if (read_total >= epoll_options.max_read_per_wakeup) {
+            // 读够了先让给别的客户端, 下一轮循环再接着读
+            client.read_pending = true;
+            reactor.pending_reads.push_back(&client);
+            break;
+        }
+    }
+
+    // messages_in只有这个reactor线程在加, 前后一减就是这次处理了几个帧
+    uint64_t messages_before = reactor.metrics.messages_in.get();
+    if (!handle_frames(client, reactor.metrics, reactor.now_ms, true, &reactor.broker) || peer_closed) {
+        return false;
+    }
+    if (client.recv_buf.readable() == 0 && client.recv_buf.capacity() > 2 * client.read_chunk) {
+        // 突发流量过去了, 把多出来的内存还回去
+        client.recv_buf.shrink(client.read_chunk);
+    }
+    uint64_t messages = reactor.metrics.messages_in.get() - messages_before;
+    client.read_bytes.consume(read_total);
+    client.read_messages.consume(messages);
+    reactor.read_bytes.consume(read_total);
+    reactor.read_messages.consume(messages);
+    // 能直接发就直接发, 发不完才注册EPOLLOUT
+    if (!flush_send_buf(reactor, client)) {
+        return false;
+    }
+    // 这次读透支了就马上暂停, LT模式下不用再被唤醒一次才发现
+    wait = read_wait_ms(reactor, client);
+    if (wait > 0 && client.can_read() && !client.transfer.active()) {
+        return throttle_client(reactor, client, wait);
+    }
+    return true;
+}
+
+// 开始优雅退出: 停止accept, 所有连接不再读新请求, 也不再收发布的消息
+inline void start_drain(Reactor& reactor) {
+    reactor.draining = true;
+    reactor.drain_deadline_ms = reactor.now_ms + server_limits.drain_timeout_ms;
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, drain_event_fd, nullptr);
+    // 交接给新进程时它还开着同一个监听socket, 这里关掉不影响排队的连接
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, reactor.listen_fd, nullptr);
+    close(reactor.listen_fd);
+    reactor.listen_fd = -1;
+    std::vector<ClientInfo*> failed;
+    reactor.clients.for_each([&reactor, &failed](ClientInfo& client) {
+        client.draining = true;
+        client.read_paused = true;
+        client.read_pending = false;
+        reactor.broker.remove(client);
+        // 零拷贝传输还要从socket里读payload, 它的关注事件由drive_transfer管, 传完之后就不再读了
+        if (!client.transfer.active() && !set_interest(reactor, client, false, client.want_write)) {
+            failed.push_back(&client);
+        }
+    });
+    for (ClientInfo* client : failed) {
+        close_client(reactor, *client);
+    }
+    LOG_INFO("[reactor %d] draining %zu connections", reactor.id, reactor.clients.size());
+}
+
+// 优雅退出期间每轮调用一次: 回复发完的连接shutdown写端, 到了截止时间就全部关掉
+// 所有连接都关了返回true
+inline bool drain_step(Reactor& reactor) {
+    bool expired = reactor.now_ms >= reactor.drain_deadline_ms;
+    std::vector<ClientInfo*> to_close;
+    reactor.clients.for_each([&](ClientInfo& client) {
+        if (expired) {
+            to_close.push_back(&client);
+        } else if (shut_drained_connection(client)) {
+            // 之后只是读掉对面的数据, 不再限速
+            client.throttled = false;
+            reactor.timers.cancel(&client.throttle_timer);
+            if (!set_interest(reactor, client, true, false)) {
+                to_close.push_back(&client);
+            }
+        }
+    });
+    for (ClientInfo* client : to_close) {
+        close_client(reactor, *client);
+    }
+    return reactor.clients.size() == 0;
+}
+
+// 每轮在处理新事件之前调用: 上一轮份额用完的连接按排队顺序各补一个份额接着发, 这一轮又用完的重新排到队尾
+// 这样每个连接每轮都只发一份; batch是复用的临时数组
+// 上一轮挂进来之后又被关掉的连接client_fd是-1, 这时还没accept过新连接, 对象不会被复用
+inline void flush_write_queue(Reactor& reactor, std::vector<ClientInfo*>& batch) {
+    batch.swap(reactor.write_queue);
+    for (ClientInfo* client : batch) {
+        if (client->client_fd == -1 || !client->write_queued) {
+            continue;
+        }
+        client->write_queued = false;
+        if (!flush_send_buf(reactor, *client)) {
+            close_client(reactor, *client);
+        }
+    }
+    batch.clear();
+}
+
+inline void run_reactor(Reactor& reactor) {
+    const int epfd = reactor.epfd;
+    ReactorMetrics& metrics = reactor.metrics;
+    std::vector<epoll_event> events(epoll_options.event_batch);
+    std::vector<ClientInfo*> pending_reads;
+    std::vector<ClientInfo*> write_queue;
+    reactor.now_ms = now_ns() / 1000000;
+    reactor.timers.init(reactor.now_ms);
+    init_bucket(reactor.read_bytes, rate_limit_options.global_bytes, reactor.reactor_count, reactor.now_ms);
+    init_bucket(reactor.read_messages, rate_limit_options.global_messages, reactor.reactor_count, reactor.now_ms);
+
+    while (!shutdown_server.load(std::memory_order_relaxed)) {
+        // 有读了一半或者发了一半的连接时不能阻塞, 处理完新事件马上回来接着读写; 否则最多睡到下一个定时器到期
+        int timeout = 5000;
+        int timer_timeout = reactor.timers.next_timeout(reactor.now_ms);
+        if (!reactor.pending_reads.empty() || !reactor.write_queue.empty()) {
+            timeout = 0;
+        } else if (timer_timeout >= 0 && timer_timeout < timeout) {
+            timeout = timer_timeout;
+        }
+        if (reactor.draining) {
+            uint64_t drain_left = reactor.drain_deadline_ms > reactor.now_ms ? reactor.drain_deadline_ms - reactor.now_ms : 0;
+            if (drain_left < (uint64_t)timeout) {
+                timeout = (int)drain_left;
+            }
+        }
+        int num_of_fds = epoll_wait(epfd, events.data(), (int)events.size(), timeout);
+        uint64_t loop_start = now_ns();
+        reactor.now_ms = loop_start / 1000000;
+        if (num_of_fds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Failed to wait epoll events: %s", strerror(errno));
+            shutdown_server = true;
+            break;
+        }
+        metrics.loop_iterations.add();
+        metrics.events_per_wakeup.record(num_of_fds);
+        reactor.round++;
+
+        // 先接着读上一轮因为公平上限没读完的连接, 再读本轮的新事件
+        // 上一轮挂进来之后又被关掉的连接client_fd是-1, 这时还没accept过新连接, 对象不会被复用
+        pending_reads.swap(reactor.pending_reads);
+        for (ClientInfo* client : pending_reads) {
+            if (client->client_fd == -1 || !client->read_pending) {
+                continue;
+            }
+            if (!handle_read(reactor, *client)) {
+                close_client(reactor, *client);
+            }
+        }
+        pending_reads.clear();
+        flush_write_queue(reactor, write_queue);
+
+        for (int i = 0; i < num_of_fds; i++) {
+            if (events[i].data.ptr == nullptr) {
+                handle_accept(reactor);
+                continue;
+            }
+            if (events[i].data.ptr == &reactor.broker) {
+                reactor.broker.drain_inbox(metrics);
+                continue;
+            }
+            if (events[i].data.ptr == &drain_event_fd) {
+                // 下面统一检查drain_server
+                continue;
+            }
+
+            ClientInfo& client = *static_cast<ClientInfo*>(events[i].data.ptr);
+            const uint32_t revents = events[i].events;
+            // 这一批里前面的事件已经把它关了
+            if (client.client_fd == -1) {
+                continue;
+            }
+
+            if ((revents & (EPOLLERR | EPOLLHUP)) && !(revents & EPOLLIN)) {
+                close_client(reactor, client);
+                continue;
+            }
+            // 已经排进下一轮pending_reads的连接这一轮就不再读了, 保证每轮每个连接最多读一次上限
+            // 暂停读的连接可能还有这一批里暂停之前的EPOLLIN, 也不读; 但零拷贝传输还在等payload,
+            // 优雅退出时暂停读也要让它传完, handle_read会直接交给drive_transfer
+            if ((revents & EPOLLIN) && !client.read_pending && (client.can_read() || client.transfer.active())
+                && !handle_read(reactor, client)) {
+                close_client(reactor, client);
+                continue;
+            }
+            // 条件保证client是可写的, 并且还有没发完的数据
+            if ((revents & EPOLLOUT) && client.want_write && !flush_send_buf(reactor, client)) {
+                close_client(reactor, client);
+                continue;
+            }
+        }
+        // 这一轮发布给订阅者的消息攒到这里一起发, 一个订阅者不管收到几条都只调一次sendmsg
+        // 关掉的连接对象要到reclaim才会复用, 这里看client_fd就知道它是不是已经关了
+        reactor.broker.flush(
+            [&reactor](Connection& conn) {
+                ClientInfo& client = static_cast<ClientInfo&>(conn);
+                if (client.client_fd != -1 && !flush_send_buf(reactor, client)) {
+                    close_client(reactor, client);
+                }
+            },
+            [&reactor](Connection& conn) {
+                ClientInfo& client = static_cast<ClientInfo&>(conn);
+                if (client.client_fd != -1) {
+                    LOG_INFO("[reactor %d] fd %d subscriber too slow, disconnect", reactor.id, client.client_fd);
+                    reactor.metrics.evictions.add();
+                    close_client(reactor, client);
+                }
+            });
+        // 超时的连接在这里关掉, 限速到期的连接在这里恢复读
+        reactor.timers.advance(reactor.now_ms, [&reactor](TimerNode* timer) {
+            ClientInfo& client = *static_cast<ClientInfo*>(static_cast<Connection*>(timer->owner));
+            if (timer == &client.throttle_timer) {
+                if (!resume_client(reactor, client)) {
+                    close_client(reactor, client);
+                }
+                return;
+            }
+            const char* reason = check_connection_timeout(reactor.timers, client, reactor.now_ms);
+            if (reason != nullptr) {
+                LOG_INFO("[reactor %d] fd %d %s timeout, disconnect", reactor.id, client.client_fd, reason);
+                reactor.metrics.timeouts.add();
+                close_client(reactor, client);
+            }
+        });
+        if (drain_server.load(std::memory_order_relaxed) && !reactor.draining) {
+            start_drain(reactor);
+        }
+        bool drained = reactor.draining && drain_step(reactor);
+        // 这一批事件都处理完了, 关掉的连接对象才能分给新连接
+        reactor.clients.reclaim();
+        metrics.loop_time_ns.record(now_ns() - loop_start);
+        if (drained) {
+            LOG_INFO("[reactor %d] drained", reactor.id);
+            break;
+        }
+    }
+
+    reactor.clients.for_each([](ClientInfo& client) {
+        close(client.client_fd);
+    });
+    reactor.clients.clear();
+    if (reactor.listen_fd != -1) {
+        close(reactor.listen_fd);
+    }
+    close(epfd);
+}
+
+#endif
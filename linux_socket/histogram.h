@@ -0,0 +1,119 @@
+#ifndef LINUX_SOCKET_HISTOGRAM_H
+#define LINUX_SOCKET_HISTOGRAM_H
+
+// HDR风格的对数-线性直方图, 用来统计延迟(纳秒)这种跨好几个数量级的数据
+// 小于256的值每个值一个桶; 更大的值按最高位分组, 每组再线性分128个桶, 相对误差不超过1/128
+// 记录一个值只要几条指令, 不分配内存, 多个线程各记各的最后merge
+
+#include <time.h>
+
+#include <cstdint>
+#include <vector>
+
+// 单调时钟的纳秒数, 延迟都用它来算
+inline uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class Histogram {
+public:
+    static constexpr int kSubBits = 8;
+    static constexpr uint64_t kSubCount = 1ULL << kSubBits;
+    static constexpr uint64_t kHalfSubCount = kSubCount / 2;
+    static constexpr size_t kBucketCount = kSubCount + (64 - kSubBits) * kHalfSubCount;
+
+    Histogram() : counts_(kBucketCount, 0) {}
+
+    void record(uint64_t value, uint64_t count = 1) {
+        if (count == 0) {
+            return;
+        }
+        counts_[index_of(value)] += count;
+        total_ += count;
+        sum_ += value * count;
+        if (value > max_) {
+            max_ = value;
+        }
+        if (value < min_) {
+            min_ = value;
+        }
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < kBucketCount; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        if (other.max_ > max_) {
+            max_ = other.max_;
+        }
+        if (other.min_ < min_) {
+            min_ = other.min_;
+        }
+    }
+
+    void reset() {
+        counts_.assign(kBucketCount, 0);
+        total_ = 0;
+        sum_ = 0;
+        max_ = 0;
+        min_ = UINT64_MAX;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+    uint64_t min() const { return total_ == 0 ? 0 : min_; }
+    double mean() const { return total_ == 0 ? 0 : (double)sum_ / total_; }
+
+    // 第percentile(0~100)百分位的值, 返回所在桶能表示的最大值, 但不会超过真实的最大值
+    uint64_t percentile(double percentile) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)(percentile / 100.0 * total_ + 0.5);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += counts_[i];
+            if (seen >= target) {
+                uint64_t value = highest_value_of(i);
+                return value < max_ ? value : max_;
+            }
+        }
+        return max_;
+    }
+
+    static size_t index_of(uint64_t value) {
+        if (value < kSubCount) {
+            return value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - (kSubBits - 1);
+        // value >> shift落在[kHalfSubCount, kSubCount)
+        return kSubCount + (shift - 1) * kHalfSubCount + ((value >> shift) - kHalfSubCount);
+    }
+
+    static uint64_t highest_value_of(size_t index) {
+        if (index < kSubCount) {
+            return index;
+        }
+        size_t offset = index - kSubCount;
+        int shift = offset / kHalfSubCount + 1;
+        uint64_t sub = offset % kHalfSubCount + kHalfSubCount;
+        return ((sub + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+    uint64_t min_ = UINT64_MAX;
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef LINUX_SOCKET_HOT_RESTART_H
+#define LINUX_SOCKET_HOT_RESTART_H
+
+// 热重启: 新进程启动时连上旧进程的交接socket, 用SCM_RIGHTS接过它所有的监听socket
+// 监听socket从头到尾都开着, 内核里排队的连接由新进程接着accept, 部署期间不会出现connection refused
+// 交接流程:
+//   1. 新进程连上handoff路径, 旧进程发来一个uint32的数量和对应个数的监听socket
+//   2. 新进程用这些socket初始化好reactor, 在同一路径上建自己的交接socket, 然后回一个字节确认
+//   3. 旧进程收到确认后开始优雅退出, 把已有连接上的回复发完再关
+// 新进程中途失败时不回确认, 旧进程继续正常服务
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "logger.h"
+#include "server_common.h"
+
+// 一条消息最多能带的fd数量, 和内核的SCM_MAX_FD一样
+constexpr size_t kMaxHandoffFds = 253;
+// 旧进程发出监听socket之后最多等新进程多久确认
+constexpr int kHandoffAckTimeoutMs = 30000;
+
+inline bool make_unix_address(const char* path, sockaddr_un& addr) {
+    addr = sockaddr_un{};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Handoff socket path is too long: %s", path);
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+// 把一组fd和它们的数量一起发出去, 失败返回false
+inline bool send_listen_fds(int sock, const std::vector<int>& fds) {
+    if (fds.empty() || fds.size() > kMaxHandoffFds) {
+        return false;
+    }
+    uint32_t count = fds.size();
+    iovec iov{&count, sizeof(count)};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    ssize_t len;
+    while ((len = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    return len == sizeof(count);
+}
+
+// 收send_listen_fds发来的fd, 收到的fd都带着CLOEXEC; 失败返回false, 已经收到的fd会关掉
+inline bool recv_listen_fds(int sock, std::vector<int>& fds) {
+    uint32_t count = 0;
+    iovec iov{&count, sizeof(count)};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * kMaxHandoffFds));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t len;
+    while ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    fds.clear();
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t old_size = fds.size();
+            fds.resize(old_size + received);
+            memcpy(fds.data() + old_size, CMSG_DATA(cmsg), sizeof(int) * received);
+        }
+    }
+    if (len != sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || count == 0 || fds.size() != count) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        fds.clear();
+        return false;
+    }
+    return true;
+}
+
+// 新进程启动时调用: path上有旧进程就接过它的监听socket, peer_fd是之后回确认用的连接
+// 没有旧进程返回true, fds为空, peer_fd为-1; 连上了但交接失败返回false
+inline bool take_over_listen_fds(const char* path, std::vector<int>& fds, int& peer_fd) {
+    fds.clear();
+    peer_fd = -1;
+    sockaddr_un addr;
+    if (!make_unix_address(path, addr)) {
+        return false;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        LOG_ERROR("Failed to create handoff socket: %s", strerror(errno));
+        return false;
+    }
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        int error = errno;
+        close(sock);
+        if (error == ENOENT || error == ECONNREFUSED) {
+            return true;
+        }
+        LOG_ERROR("Failed to connect handoff socket %s: %s", path, strerror(error));
+        return false;
+    }
+    if (!recv_listen_fds(sock, fds)) {
+        LOG_ERROR("Failed to receive listen sockets from %s", path);
+        close(sock);
+        return false;
+    }
+    peer_fd = sock;
+    return true;
+}
+
+// 新进程准备好之后告诉旧进程可以退出了
+inline bool send_handoff_ack(int peer_fd) {
+    const char ack = 1;
+    bool ok = send(peer_fd, &ack, 1, MSG_NOSIGNAL) == 1;
+    close(peer_fd);
+    return ok;
+}
+
+// 在path上建交接socket, 旧进程留下的socket文件先删掉
+inline int create_handoff_fd(const char* path) {
+    sockaddr_un addr;
+    if (!make_unix_address(path, addr)) {
+        return -1;
+    }
+    int handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_fd == -1) {
+        LOG_ERROR("Failed to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(handoff_fd, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(handoff_fd, 4) == -1) {
+        LOG_ERROR("Failed to listen handoff socket %s: %s", path, strerror(errno));
+        close(handoff_fd);
+        return -1;
+    }
+    return handoff_fd;
+}
+
+// 等新进程回确认, 期间服务器自己要退出了就不等了
+inline bool wait_handoff_ack(int sock) {
+    for (int waited = 0; waited < kHandoffAckTimeoutMs && !shutdown_server.load(); waited += 200) {
+        pollfd ack_poll{sock, POLLIN, 0};
+        if (poll(&ack_poll, 1, 200) <= 0) {
+            continue;
+        }
+        char ack = 0;
+        return recv(sock, &ack, 1, 0) == 1 && ack == 1;
+    }
+    return false;
+}
+
+// 交接线程, listen_fds是监听socket的dup, 线程退出时关掉
+// 交接成功后handed_off置位并开始优雅退出; 服务器自己开始退出之后不再交接
+inline void run_handoff_server(int handoff_fd, std::vector<int> listen_fds, std::atomic<bool>& handed_off) {
+    while (!shutdown_server.load(std::memory_order_relaxed) && !drain_server.load(std::memory_order_relaxed)) {
+        pollfd listen_poll{handoff_fd, POLLIN, 0};
+        if (poll(&listen_poll, 1, 200) <= 0) {
+            continue;
+        }
+        int client_fd = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            continue;
+        }
+        if (!send_listen_fds(client_fd, listen_fds)) {
+            LOG_WARN("Failed to send listen sockets: %s", strerror(errno));
+        } else if (wait_handoff_ack(client_fd)) {
+            LOG_INFO("listen sockets handed off, draining connections");
+            handed_off = true;
+            request_drain();
+        } else {
+            LOG_WARN("New process did not confirm the handoff, keep serving");
+        }
+        close(client_fd);
+    }
+    for (int fd : listen_fds) {
+        close(fd);
+    }
+}
+
+#endif
@@ -0,0 +1,794 @@
+#ifndef LINUX_SOCKET_LOAD_GENERATOR_H
+#define LINUX_SOCKET_LOAD_GENERATOR_H
+
+// 压测客户端
+// 每个线程一个epoll循环驱动若干连接, 连接上按帧协议发回声消息, 用直方图统计往返延迟
+// 闭环模式: 每个连接保持pipeline条请求在飞, 回来一条补一条, 测的是最大吞吐
+// 开环模式: 按固定速率发送, 延迟从"本该发出的时间"算起, 服务器卡顿时后面排队的消息也会算上等待时间,
+//          不会因为客户端自己也被卡住少发消息而把尾延迟藏起来(coordinated omission)
+// 重连风暴模式: 每个连接只发一条消息, 收到回复就发exit让服务器先关, 然后马上重连,
+//          测的是服务器每秒能建多少个新连接, 延迟是从开始connect到收到回复
+// UDP模式: 压服务器的--udp回声, 每个"连接"是一个connect过的UDP socket, 一批数据报用一次sendmmsg
+//          (或者--gso时一次UDP_SEGMENT发送)发出去, 回复用recvmmsg成批收; 数据报开头8字节是发送时间,
+//          接着4字节是这个socket的轮次, 丢包和乱序都不影响延迟统计, 超过200ms没有任何回复时在飞的数据报算作丢失,
+//          轮次加一, 之后才回来的上一轮的回复只算迟到, 不当作这一轮的回复
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "socket_address.h"
+
+struct LoadGenOptions {
+    std::string host = "127.0.0.1";
+    uint16_t port = 7070;
+    int connections = 10;
+    int threads = 1;
+    size_t message_size = 64;
+    // 闭环模式下每个连接同时在飞的请求数
+    int pipeline = 1;
+    double duration = 10;
+    // 所有连接加起来每秒发多少条, 0表示闭环模式
+    double rate = 0;
+    // 重连风暴模式
+    bool reconnect = false;
+    // 发kBulkEcho帧, 服务器用splice回送, 用来对比大payload时零拷贝和普通回声的吞吐
+    bool bulk = false;
+    // UDP模式, pipeline是每个socket同时在飞的数据报数
+    bool udp = false;
+    bool gso = false;
+};
+
+inline void add_load_gen_options(OptionParser& parser, LoadGenOptions& options) {
+    parser.add("host", &options.host, "server address, IPv4, IPv6 or host name");
+    parser.add("port", &options.port, "server port");
+    parser.add("conns", &options.connections, "connections of all threads");
+    parser.add("threads", &options.threads, "load generator threads");
+    parser.add("size", &options.message_size, "payload bytes per message");
+    parser.add("pipeline", &options.pipeline, "requests in flight per connection in closed loop mode");
+    parser.add("duration", &options.duration, "seconds to run");
+    parser.add("rate", &options.rate, "messages per second of all connections, 0 for closed loop mode");
+    parser.add("reconnect", &options.reconnect, "reconnect storm mode, reconnect after every reply");
+    parser.add("bulk", &options.bulk, "send bulk echo frames that the server relays with splice");
+    parser.add("udp", &options.udp, "udp datagram mode against a --udp server, pipeline is datagrams in flight per socket");
+    parser.add("gso", &options.gso, "udp mode: send each burst as one UDP_SEGMENT send");
+}
+
+struct LoadConn {
+    int fd = -1;
+    RecvBuffer recv_buf;
+    std::string send_buf;
+    size_t send_pos = 0;
+    // 在飞请求的(计划)发送时间, 服务器按顺序回声, 所以先进先出就能对上
+    std::deque<uint64_t> start_times;
+    // 开环模式下这个连接下一条消息的计划发送时间
+    uint64_t next_send_time = 0;
+    bool want_write = false;
+};
+
+struct LoadStats {
+    Histogram latency;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t bytes_received = 0;
+    uint64_t errors = 0;
+    // UDP模式下超时没回来的数据报, 之后又回来的会减掉
+    uint64_t lost = 0;
+    // 算作丢失之后又回来的数据报
+    uint64_t late = 0;
+};
+
+inline int connect_to(const LoadGenOptions& options) {
+    SocketAddress server_addr;
+    if (!resolve_address(options.host, options.port, server_addr)) {
+        return -1;
+    }
+    int fd = socket(server_addr.family(), SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, server_addr.get(), server_addr.len) == -1) {
+        close(fd);
+        return -1;
+    }
+    // 小消息不能等Nagle攒包, 否则测出来的全是40ms
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return fd;
+}
+
+// 尽量把send_buf发出去, 发不完就等EPOLLOUT, 返回false表示连接出错
+inline bool flush_load_conn(int epfd, LoadConn& conn) {
+    while (conn.send_pos < conn.send_buf.size()) {
+        ssize_t sent_len = send(conn.fd, conn.send_buf.data() + conn.send_pos, conn.send_buf.size() - conn.send_pos, MSG_NOSIGNAL);
+        if (sent_len == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        conn.send_pos += sent_len;
+    }
+    if (conn.send_pos == conn.send_buf.size()) {
+        conn.send_buf.clear();
+        conn.send_pos = 0;
+    } else if (conn.send_pos > conn.send_buf.size() / 2) {
+        conn.send_buf.erase(0, conn.send_pos);
+        conn.send_pos = 0;
+    }
+    bool want_write = !conn.send_buf.empty();
+    if (want_write != conn.want_write) {
+        epoll_event ev;
+        ev.data.ptr = &conn;
+        ev.events = EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0u);
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.want_write = want_write;
+    }
+    return true;
+}
+
+// 把收到的回声帧全部取出来并记录延迟, 返回这次收到了多少条
+inline int read_load_conn(LoadConn& conn, LoadStats& stats, bool& failed) {
+    int replies = 0;
+    while (true) {
+        char* buf = conn.recv_buf.prepare(64 * 1024);
+        ssize_t recv_len = recv(conn.fd, buf, conn.recv_buf.writable(), 0);
+        if (recv_len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = errno != EAGAIN && errno != EWOULDBLOCK;
+            break;
+        } else if (recv_len == 0) {
+            failed = true;
+            break;
+        }
+        conn.recv_buf.commit(recv_len);
+        stats.bytes_received += recv_len;
+    }
+
+    uint64_t now = now_ns();
+    Frame frame;
+    ParseResult result;
+    while ((result = parse_frame(conn.recv_buf, frame)) == ParseResult::kFrame) {
+        if (conn.start_times.empty()) {
+            failed = true;
+            break;
+        }
+        stats.latency.record(now - conn.start_times.front());
+        conn.start_times.pop_front();
+        stats.received++;
+        replies++;
+    }
+    if (result == ParseResult::kError) {
+        failed = true;
+    }
+    return replies;
+}
+
+inline void run_load_thread(const LoadGenOptions& options, int conn_count, uint64_t start_time, uint64_t end_time, LoadStats& stats) {
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        stats.errors++;
+        return;
+    }
+    std::string frame;
+    std::string payload(options.message_size, 'x');
+    append_frame(frame, options.bulk ? Opcode::kBulkEcho : Opcode::kEcho, payload.data(), payload.size());
+
+    bool open_loop = options.rate > 0;
+    // 开环模式下每个连接两条消息之间的间隔, 各连接错开起点免得同时发
+    uint64_t interval = open_loop ? (uint64_t)(1e9 * options.connections / options.rate) : 0;
+
+    std::vector<LoadConn> conns(conn_count);
+    for (int i = 0; i < conn_count; i++) {
+        LoadConn& conn = conns[i];
+        conn.fd = connect_to(options);
+        if (conn.fd == -1) {
+            stats.errors++;
+            continue;
+        }
+        epoll_event ev;
+        ev.data.ptr = &conn;
+        ev.events = EPOLLIN;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+        conn.next_send_time = start_time + interval * i / conn_count;
+    }
+
+    while (now_ns() < start_time) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    if (!open_loop) {
+        uint64_t now = now_ns();
+        for (LoadConn& conn : conns) {
+            if (conn.fd == -1) {
+                continue;
+            }
+            for (int i = 0; i < options.pipeline; i++) {
+                conn.send_buf += frame;
+                conn.start_times.push_back(now);
+                stats.sent++;
+            }
+            flush_load_conn(epfd, conn);
+        }
+    }
+
+    std::vector<epoll_event> events(conn_count > 0 ? conn_count : 1);
+    uint64_t now = now_ns();
+    while (now < end_time) {
+        int timeout = (end_time - now) / 1000000 + 1;
+        if (open_loop) {
+            // 等到最早的一个连接该发消息为止
+            uint64_t next = end_time;
+            for (const LoadConn& conn : conns) {
+                if (conn.fd != -1 && conn.next_send_time < next) {
+                    next = conn.next_send_time;
+                }
+            }
+            timeout = next > now ? (next - now) / 1000000 : 0;
+        } else if (timeout > 100) {
+            timeout = 100;
+        }
+
+        int num_of_fds = epoll_wait(epfd, events.data(), events.size(), timeout);
+        for (int i = 0; i < num_of_fds; i++) {
+            LoadConn& conn = *static_cast<LoadConn*>(events[i].data.ptr);
+            if (conn.fd == -1) {
+                continue;
+            }
+            bool failed = false;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                int replies = read_load_conn(conn, stats, failed);
+                if (!open_loop) {
+                    // 闭环: 回来几条就补几条, 保持pipeline条在飞
+                    uint64_t send_time = now_ns();
+                    for (int j = 0; j < replies; j++) {
+                        conn.send_buf += frame;
+                        conn.start_times.push_back(send_time);
+                        stats.sent++;
+                    }
+                }
+            }
+            if (!failed && !flush_load_conn(epfd, conn)) {
+                failed = true;
+            }
+            if (failed) {
+                stats.errors++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                close(conn.fd);
+                conn.fd = -1;
+            }
+        }
+
+        now = now_ns();
+        if (open_loop) {
+            for (LoadConn& conn : conns) {
+                if (conn.fd == -1 || conn.next_send_time > now) {
+                    continue;
+                }
+                // 落后了就把欠下的消息一次补上, 延迟仍然从各自的计划时间算
+                while (conn.next_send_time <= now && conn.next_send_time < end_time) {
+                    conn.send_buf += frame;
+                    conn.start_times.push_back(conn.next_send_time);
+                    conn.next_send_time += interval;
+                    stats.sent++;
+                }
+                if (!flush_load_conn(epfd, conn)) {
+                    stats.errors++;
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                    close(conn.fd);
+                    conn.fd = -1;
+                }
+            }
+        }
+    }
+
+    for (LoadConn& conn : conns) {
+        if (conn.fd != -1) {
+            close(conn.fd);
+        }
+    }
+    close(epfd);
+}
+
+// 重连风暴模式下的一个连接槽位, 连接关掉之后马上在同一个槽位上重连
+struct StormConn {
+    int fd = -1;
+    uint64_t start_time = 0;
+    bool connected = false;
+    bool replied = false;
+    RecvBuffer recv_buf;
+};
+
+// 发起一个非阻塞connect, 完成时会报EPOLLOUT
+inline bool start_storm_conn(int epfd, const SocketAddress& server_addr, StormConn& conn) {
+    conn.fd = socket(server_addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd == -1) {
+        return false;
+    }
+    int nodelay = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    conn.start_time = now_ns();
+    conn.connected = false;
+    conn.replied = false;
+    conn.recv_buf.read_pos = conn.recv_buf.write_pos = 0;
+    if (connect(conn.fd, server_addr.get(), server_addr.len) == -1 && errno != EINPROGRESS) {
+        close(conn.fd);
+        conn.fd = -1;
+        return false;
+    }
+    epoll_event ev;
+    ev.data.ptr = &conn;
+    ev.events = EPOLLOUT;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+    return true;
+}
+
+inline void close_storm_conn(int epfd, StormConn& conn) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    conn.fd = -1;
+}
+
+// 处理一个连接上的事件, 返回false表示这个连接出错了
+inline bool handle_storm_event(int epfd, StormConn& conn, uint32_t events, const std::string& request,
+                               const std::string& exit_frame, LoadStats& stats) {
+    if (!conn.connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+            return false;
+        }
+        conn.connected = true;
+        // 请求只有几十个字节, 新连接的发送缓冲区一定放得下
+        if (send(conn.fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+            return false;
+        }
+        stats.sent++;
+        epoll_event ev;
+        ev.data.ptr = &conn;
+        ev.events = EPOLLIN;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+        return true;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        return true;
+    }
+    while (true) {
+        char* buf = conn.recv_buf.prepare(1024);
+        ssize_t recv_len = recv(conn.fd, buf, conn.recv_buf.writable(), 0);
+        if (recv_len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        } else if (recv_len == 0) {
+            // 服务器收到exit先关了连接, 这一轮才算完成
+            if (!conn.replied) {
+                return false;
+            }
+            close_storm_conn(epfd, conn);
+            return true;
+        }
+        conn.recv_buf.commit(recv_len);
+        stats.bytes_received += recv_len;
+        Frame frame;
+        if (!conn.replied && parse_frame(conn.recv_buf, frame) == ParseResult::kFrame) {
+            conn.replied = true;
+            stats.latency.record(now_ns() - conn.start_time);
+            stats.received++;
+            if (send(conn.fd, exit_frame.data(), exit_frame.size(), MSG_NOSIGNAL) != (ssize_t)exit_frame.size()) {
+                return false;
+            }
+        }
+    }
+}
+
+inline void run_reconnect_thread(const LoadGenOptions& options, int conn_count, uint64_t start_time, uint64_t end_time, LoadStats& stats) {
+    SocketAddress server_addr;
+    int epfd = epoll_create1(0);
+    if (epfd == -1 || !resolve_address(options.host, options.port, server_addr)) {
+        stats.errors++;
+        if (epfd != -1) {
+            close(epfd);
+        }
+        return;
+    }
+    std::string request;
+    std::string payload(options.message_size, 'x');
+    append_frame(request, options.bulk ? Opcode::kBulkEcho : Opcode::kEcho, payload.data(), payload.size());
+    std::string exit_frame;
+    append_frame(exit_frame, Opcode::kExit, "", 0);
+
+    while (now_ns() < start_time) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    std::vector<StormConn> conns(conn_count);
+    for (StormConn& conn : conns) {
+        if (!start_storm_conn(epfd, server_addr, conn)) {
+            stats.errors++;
+        }
+    }
+
+    std::vector<epoll_event> events(conn_count > 0 ? conn_count : 1);
+    while (now_ns() < end_time) {
+        int num_of_fds = epoll_wait(epfd, events.data(), events.size(), 100);
+        for (int i = 0; i < num_of_fds; i++) {
+            StormConn& conn = *static_cast<StormConn*>(events[i].data.ptr);
+            if (conn.fd == -1) {
+                continue;
+            }
+            if (!handle_storm_event(epfd, conn, events[i].events, request, exit_frame, stats)) {
+                stats.errors++;
+                close_storm_conn(epfd, conn);
+            }
+        }
+        // 关掉的槽位马上重连
+        if (now_ns() < end_time) {
+            for (StormConn& conn : conns) {
+                if (conn.fd == -1 && !start_storm_conn(epfd, server_addr, conn)) {
+                    stats.errors++;
+                }
+            }
+        }
+    }
+
+    for (StormConn& conn : conns) {
+        if (conn.fd != -1) {
+            close(conn.fd);
+        }
+    }
+    close(epfd);
+}
+
+// UDP模式下的一个socket
+struct UdpLoadConn {
+    int fd = -1;
+    int in_flight = 0;
+    // 最后一次收到回复的时间, 在飞的数据报太久没有回复就算丢了
+    uint64_t last_progress = 0;
+    // 开环模式下下一个数据报的计划发送时间
+    uint64_t next_send_time = 0;
+    // 每次有数据报超时算作丢失就加一, 发出去的数据报都带着当时的轮次
+    uint32_t epoch = 0;
+};
+
+// 数据报开头是8字节的发送时间和4字节的轮次
+constexpr size_t kUdpHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+constexpr uint64_t kUdpLossTimeoutNs = 200000000ULL;
+constexpr int kUdpRecvBatch = 64;
+// 和服务器一样, 一次GSO发送最多64段
+constexpr int kUdpMaxGsoSegments = 64;
+
+inline int connect_udp(const LoadGenOptions& options) {
+    SocketAddress server_addr;
+    if (!resolve_address(options.host, options.port, server_addr)) {
+        return -1;
+    }
+    int fd = socket(server_addr.family(), SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, server_addr.get(), server_addr.len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 发出burst里按size切好的数据报, 返回发出去了几个; 发送缓冲区满了就少发, socket出错返回-1
+inline int send_udp_burst(int fd, const std::string& burst, size_t size, bool gso) {
+    int count = burst.size() / size;
+    int sent = 0;
+    std::vector<iovec> iovs(count);
+    std::vector<mmsghdr> msgs(count);
+    // 所有项的段长都一样, 共用一份UDP_SEGMENT控制消息
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+    cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(control);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment = size;
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    int entries = 0;
+    for (int i = 0; i < count; entries++) {
+        int segments = gso ? count - i : 1;
+        if (segments > kUdpMaxGsoSegments) {
+            segments = kUdpMaxGsoSegments;
+        }
+        if (segments * size > 65507) {
+            segments = 65507 / size;
+        }
+        iovs[entries].iov_base = const_cast<char*>(burst.data()) + i * size;
+        iovs[entries].iov_len = segments * size;
+        msgs[entries].msg_hdr = msghdr{};
+        msgs[entries].msg_hdr.msg_iov = &iovs[entries];
+        msgs[entries].msg_hdr.msg_iovlen = 1;
+        if (segments > 1) {
+            msgs[entries].msg_hdr.msg_control = control;
+            msgs[entries].msg_hdr.msg_controllen = sizeof(control);
+        }
+        i += segments;
+    }
+    int done = 0;
+    while (done < entries) {
+        int n = sendmmsg(fd, &msgs[done], entries - done, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ? sent : -1;
+        }
+        for (int i = done; i < done + n; i++) {
+            sent += msgs[i].msg_len / size;
+        }
+        done += n;
+    }
+    return sent;
+}
+
+// 收回所有到了的回复并记录延迟, 返回收到了几个, socket出错返回-1
+inline int read_udp_conn(UdpLoadConn& conn, size_t size, std::vector<char>& buffer, LoadStats& stats) {
+    mmsghdr msgs[kUdpRecvBatch];
+    iovec iovs[kUdpRecvBatch];
+    int replies = 0;
+    while (true) {
+        for (int i = 0; i < kUdpRecvBatch; i++) {
+            iovs[i].iov_base = buffer.data() + i * size;
+            iovs[i].iov_len = size;
+            msgs[i].msg_hdr = msghdr{};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int received = recvmmsg(conn.fd, msgs, kUdpRecvBatch, MSG_DONTWAIT, nullptr);
+        if (received == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? replies : -1;
+        }
+        uint64_t now = now_ns();
+        for (int i = 0; i < received; i++) {
+            if (msgs[i].msg_len < kUdpHeaderSize) {
+                continue;
+            }
+            const char* data = static_cast<const char*>(iovs[i].iov_base);
+            uint64_t send_time;
+            uint32_t epoch;
+            memcpy(&send_time, data, sizeof(send_time));
+            memcpy(&epoch, data + sizeof(send_time), sizeof(epoch));
+            if (epoch != conn.epoch) {
+                // 已经算作丢失的数据报又回来了, 在飞的是新一轮发出去的, 不能拿它抵
+                stats.late++;
+                if (stats.lost > 0) {
+                    stats.lost--;
+                }
+                continue;
+            }
+            stats.latency.record(now - send_time);
+            stats.received++;
+            stats.bytes_received += msgs[i].msg_len;
+            if (conn.in_flight > 0) {
+                conn.in_flight--;
+                replies++;
+            }
+        }
+        conn.last_progress = now;
+        if (received < kUdpRecvBatch) {
+            return replies;
+        }
+    }
+}
+
+inline void run_udp_thread(const LoadGenOptions& options, int conn_count, uint64_t start_time, uint64_t end_time, LoadStats& stats) {
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        stats.errors++;
+        return;
+    }
+    const size_t size = options.message_size;
+    bool open_loop = options.rate > 0;
+    uint64_t interval = open_loop ? (uint64_t)(1e9 * options.connections / options.rate) : 0;
+    std::vector<UdpLoadConn> conns(conn_count);
+    for (int i = 0; i < conn_count; i++) {
+        UdpLoadConn& conn = conns[i];
+        conn.fd = connect_udp(options);
+        if (conn.fd == -1) {
+            stats.errors++;
+            continue;
+        }
+        epoll_event ev;
+        ev.data.ptr = &conn;
+        ev.events = EPOLLIN;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+        conn.next_send_time = start_time + interval * i / conn_count;
+    }
+    std::string payload(size, 'x');
+    std::string burst;
+    std::vector<char> recv_buffer(kUdpRecvBatch * size);
+    // 把count个带着发送时间和轮次的数据报发出去, 出错的socket关掉
+    auto send_burst = [&](UdpLoadConn& conn, int count, uint64_t send_time, uint64_t step) {
+        burst.clear();
+        memcpy(&payload[sizeof(uint64_t)], &conn.epoch, sizeof(conn.epoch));
+        for (int i = 0; i < count; i++) {
+            uint64_t time = send_time + step * i;
+            memcpy(&payload[0], &time, sizeof(time));
+            burst += payload;
+        }
+        int sent = send_udp_burst(conn.fd, burst, size, options.gso);
+        if (sent == -1) {
+            stats.errors++;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+            close(conn.fd);
+            conn.fd = -1;
+            return;
+        }
+        stats.sent += sent;
+        conn.in_flight += sent;
+    };
+
+    while (now_ns() < start_time) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    uint64_t now = now_ns();
+    for (UdpLoadConn& conn : conns) {
+        conn.last_progress = now;
+        if (conn.fd != -1 && !open_loop) {
+            send_burst(conn, options.pipeline, now, 0);
+        }
+    }
+
+    std::vector<epoll_event> events(conn_count > 0 ? conn_count : 1);
+    while (now < end_time) {
+        int timeout = 10;
+        if (open_loop) {
+            uint64_t next = end_time;
+            for (const UdpLoadConn& conn : conns) {
+                if (conn.fd != -1 && conn.next_send_time < next) {
+                    next = conn.next_send_time;
+                }
+            }
+            timeout = next > now ? (next - now) / 1000000 : 0;
+        }
+        int num_of_fds = epoll_wait(epfd, events.data(), events.size(), timeout);
+        for (int i = 0; i < num_of_fds; i++) {
+            UdpLoadConn& conn = *static_cast<UdpLoadConn*>(events[i].data.ptr);
+            if (conn.fd == -1) {
+                continue;
+            }
+            int replies = read_udp_conn(conn, size, recv_buffer, stats);
+            if (replies == -1) {
+                stats.errors++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                close(conn.fd);
+                conn.fd = -1;
+            } else if (!open_loop && replies > 0) {
+                // 闭环: 回来几个补几个
+                send_burst(conn, replies, now_ns(), 0);
+            }
+        }
+
+        now = now_ns();
+        for (UdpLoadConn& conn : conns) {
+            if (conn.fd == -1) {
+                continue;
+            }
+            if (conn.in_flight > 0 && now - conn.last_progress > kUdpLossTimeoutNs) {
+                stats.lost += conn.in_flight;
+                conn.in_flight = 0;
+                conn.epoch++;
+                conn.last_progress = now;
+                if (!open_loop) {
+                    send_burst(conn, options.pipeline, now, 0);
+                }
+            }
+            if (open_loop && conn.next_send_time <= now) {
+                // 落后了就把欠下的一次补上, 延迟仍然从各自的计划时间算
+                int count = 0;
+                uint64_t first = conn.next_send_time;
+                while (conn.next_send_time <= now && conn.next_send_time < end_time) {
+                    conn.next_send_time += interval;
+                    count++;
+                }
+                if (count > 0) {
+                    if (conn.in_flight == 0) {
+                        conn.last_progress = now;
+                    }
+                    send_burst(conn, count, first, interval);
+                }
+            }
+        }
+    }
+
+    for (UdpLoadConn& conn : conns) {
+        if (conn.fd != -1) {
+            close(conn.fd);
+        }
+    }
+    close(epfd);
+}
+
+inline int run_load_generator(const LoadGenOptions& options) {
+    if (options.connections <= 0 || options.threads <= 0 || options.pipeline <= 0 || options.duration <= 0
+        || (options.udp && (options.message_size < kUdpHeaderSize || options.message_size > 65507))) {
+        std::cout << "Invalid load generator options" << std::endl;
+        return 1;
+    }
+    int thread_num = options.threads < options.connections ? options.threads : options.connections;
+    std::cout << "Load generator: " << options.host << ":" << options.port << ", " << options.connections << " connections, "
+              << thread_num << " threads, " << options.message_size << " bytes, ";
+    if (options.udp) {
+        std::cout << "udp" << (options.gso ? " with gso" : "") << ", ";
+    }
+    if (options.reconnect) {
+        std::cout << "reconnect storm";
+    } else if (options.rate > 0) {
+        std::cout << "open loop at " << options.rate << " msg/s";
+    } else {
+        std::cout << "closed loop, pipeline " << options.pipeline;
+    }
+    std::cout << ", " << options.duration << "s" << std::endl;
+
+    // 留点时间给所有线程建连接, 然后一起开始
+    uint64_t start_time = now_ns() + 200000000ULL + options.connections * 100000ULL;
+    uint64_t end_time = start_time + (uint64_t)(options.duration * 1e9);
+    std::vector<LoadStats> stats(thread_num);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num; i++) {
+        int conn_count = options.connections / thread_num + (i < options.connections % thread_num ? 1 : 0);
+        auto run = options.reconnect ? run_reconnect_thread : options.udp ? run_udp_thread : run_load_thread;
+        threads.emplace_back(run, std::cref(options), conn_count, start_time, end_time, std::ref(stats[i]));
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    LoadStats total;
+    for (const LoadStats& s : stats) {
+        total.latency.merge(s.latency);
+        total.sent += s.sent;
+        total.received += s.received;
+        total.bytes_received += s.bytes_received;
+        total.errors += s.errors;
+        total.lost += s.lost;
+        total.late += s.late;
+    }
+    const Histogram& latency = total.latency;
+    printf("sent %lu, received %lu, errors %lu\n", (unsigned long)total.sent, (unsigned long)total.received, (unsigned long)total.errors);
+    if (options.udp) {
+        printf("lost %lu (%.3f%%), late %lu\n", (unsigned long)total.lost, total.sent > 0 ? 100.0 * total.lost / total.sent : 0.0,
+               (unsigned long)total.late);
+        printf("throughput: %.0f pkt/s, %.2f MB/s\n", total.received / options.duration, total.bytes_received / options.duration / 1e6);
+    } else if (options.reconnect) {
+        printf("throughput: %.0f connections/s\n", total.received / options.duration);
+    } else {
+        printf("throughput: %.0f msg/s, %.2f MB/s\n", total.received / options.duration, total.bytes_received / options.duration / 1e6);
+    }
+    printf("latency(us): min %.1f, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           latency.min() / 1e3, latency.mean() / 1e3, latency.percentile(50) / 1e3, latency.percentile(90) / 1e3,
+           latency.percentile(99) / 1e3, latency.percentile(99.9) / 1e3, latency.max() / 1e3);
+    return total.errors == 0 ? 0 : 1;
+}
+
+#endif
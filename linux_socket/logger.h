@@ -0,0 +1,244 @@
+#ifndef LINUX_SOCKET_LOGGER_H
+#define LINUX_SOCKET_LOGGER_H
+
+// 异步日志
+// 每个线程第一次写日志时分到一个自己的单生产者单消费者环形缓冲区, 写日志只是格式化进环里的一个槽位,
+// 不加锁也不做系统调用; 后台线程把所有环里的记录攒成一批, 用一次write写出去
+// 环满了直接丢弃并计数, 绝不阻塞事件循环, 丢了多少条会由后台线程补一条日志说明
+
+#include <unistd.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class LogLevel : uint8_t {
+    kDebug = 0,
+    kInfo = 1,
+    kWarn = 2,
+    kError = 3,
+};
+
+// 日志开关, 启动时设置好, 之后事件循环里只读
+struct LogConfig {
+    LogLevel level = LogLevel::kInfo;
+    // 每个新连接打一条日志, 建连风暴时格式化地址和写日志会成为瓶颈, 默认关掉
+    bool accept = false;
+    // 每条收到的消息打一条日志, 压测和生产环境应该关掉
+    bool message = false;
+};
+
+inline LogConfig log_config;
+
+constexpr size_t kLogRecordSize = 256;
+constexpr size_t kLogRingSize = 1024;
+
+struct LogRecord {
+    uint64_t time_ns;
+    LogLevel level;
+    uint16_t len;
+    char text[kLogRecordSize - 16];
+};
+
+// 单生产者(写日志的线程)单消费者(后台线程)的环
+class LogRing {
+public:
+    LogRing() : records_(new LogRecord[kLogRingSize]) {}
+
+    // 拿一个空槽位, 满了返回nullptr并记一次丢弃
+    LogRecord* try_reserve() {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) >= kLogRingSize) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &records_[tail % kLogRingSize];
+    }
+
+    void publish() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // 后台线程调用, 把已发布的记录交给func处理, 返回处理了多少条
+    template <typename Func>
+    size_t drain(Func func) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        uint64_t tail = tail_.load(std::memory_order_acquire);
+        for (uint64_t i = head; i < tail; i++) {
+            func(records_[i % kLogRingSize]);
+        }
+        head_.store(tail, std::memory_order_release);
+        return tail - head;
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    // 生产者和消费者各自改的计数放在不同的缓存行, 避免来回抢
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::unique_ptr<LogRecord[]> records_;
+};
+
+class Logger {
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    // 当前线程的环, 第一次调用时注册, 只有这一步需要加锁
+    LogRing& local_ring() {
+        thread_local LogRing* ring = nullptr;
+        if (ring == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings_.emplace_back(new LogRing());
+            ring = rings_.back().get();
+        }
+        return *ring;
+    }
+
+    void vlog(LogLevel level, const char* fmt, va_list args) {
+        LogRing& ring = local_ring();
+        LogRecord* record = ring.try_reserve();
+        if (record == nullptr) {
+            return;
+        }
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        record->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        record->level = level;
+        int len = vsnprintf(record->text, sizeof(record->text), fmt, args);
+        if (len < 0) {
+            len = 0;
+        } else if ((size_t)len >= sizeof(record->text)) {
+            // 太长的日志截断
+            len = sizeof(record->text) - 1;
+        }
+        record->len = len;
+        ring.publish();
+    }
+
+    void start(int fd) {
+        if (running_.exchange(true)) {
+            return;
+        }
+        fd_ = fd;
+        writer_ = std::thread(&Logger::run, this);
+    }
+
+    // 停下后台线程, 停之前把所有环都写干净
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        writer_.join();
+    }
+
+private:
+    Logger() = default;
+
+    void run() {
+        std::string batch;
+        uint64_t reported_dropped = 0;
+        while (true) {
+            bool running = running_.load(std::memory_order_acquire);
+            size_t count = drain_all(batch, reported_dropped);
+            if (!batch.empty()) {
+                write_all(batch);
+                batch.clear();
+            }
+            if (!running) {
+                break;
+            }
+            if (count == 0) {
+                // 没有日志时睡一会, 顺便让下一批多攒一点
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    size_t drain_all(std::string& batch, uint64_t& reported_dropped) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t count = 0;
+        uint64_t dropped = 0;
+        for (std::unique_ptr<LogRing>& ring : rings_) {
+            count += ring->drain([&batch](const LogRecord& record) {
+                format_record(record, batch);
+            });
+            dropped += ring->dropped();
+        }
+        if (dropped > reported_dropped) {
+            char buf[96];
+            int len = snprintf(buf, sizeof(buf), "[W] logger dropped %lu messages because the ring buffer was full\n",
+                               (unsigned long)(dropped - reported_dropped));
+            batch.append(buf, len);
+            reported_dropped = dropped;
+        }
+        return count;
+    }
+
+    static void format_record(const LogRecord& record, std::string& batch) {
+        static const char kLevelChar[] = {'D', 'I', 'W', 'E'};
+        time_t seconds = record.time_ns / 1000000000ULL;
+        tm local_time;
+        localtime_r(&seconds, &local_time);
+        char prefix[48];
+        int len = snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%06lu [%c] ", local_time.tm_hour, local_time.tm_min,
+                           local_time.tm_sec, (unsigned long)(record.time_ns % 1000000000ULL / 1000),
+                           kLevelChar[static_cast<int>(record.level)]);
+        batch.append(prefix, len);
+        batch.append(record.text, record.len);
+        batch.push_back('\n');
+    }
+
+    void write_all(const std::string& batch) {
+        size_t written = 0;
+        while (written < batch.size()) {
+            ssize_t len = write(fd_, batch.data() + written, batch.size() - written);
+            if (len == -1 && errno == EINTR) {
+                continue;
+            } else if (len <= 0) {
+                return;
+            }
+            written += len;
+        }
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<LogRing>> rings_;
+    std::atomic<bool> running_{false};
+    std::thread writer_;
+    int fd_ = STDOUT_FILENO;
+};
+
+inline void log_write(LogLevel level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+inline void log_write(LogLevel level, const char* fmt, ...) {
+    if (level < log_config.level) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    Logger::instance().vlog(level, fmt, args);
+    va_end(args);
+}
+
+#define LOG_DEBUG(...) log_write(LogLevel::kDebug, __VA_ARGS__)
+#define LOG_INFO(...) log_write(LogLevel::kInfo, __VA_ARGS__)
+#define LOG_WARN(...) log_write(LogLevel::kWarn, __VA_ARGS__)
+#define LOG_ERROR(...) log_write(LogLevel::kError, __VA_ARGS__)
+
+// main里放一个, 作用域结束时把剩下的日志写完再退出
+struct ScopedLogger {
+    explicit ScopedLogger(int fd = STDOUT_FILENO) { Logger::instance().start(fd); }
+    ~ScopedLogger() { Logger::instance().stop(); }
+};
+
+#endif
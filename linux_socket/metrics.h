@@ -0,0 +1,256 @@
+#ifndef LINUX_SOCKET_METRICS_H
+#define LINUX_SOCKET_METRICS_H
+
+// 服务器运行指标
+// 每个reactor一份计数器和直方图, 只有reactor自己的线程写, 所以更新时不用原子加, 普通的读-改-写就够了,
+// 用relaxed原子变量只是为了让管理线程随时能读到一个完整的值
+// 管理线程在一个Unix域socket上监听, 有人连上来就把所有reactor的指标按Prometheus文本格式写回去:
+//     nc -U /tmp/socket_server.sock
+//     curl --unix-socket /tmp/socket_server.sock http://localhost/metrics
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "logger.h"
+
+// 单写者计数器
+class Counter {
+public:
+    void add(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void sub(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) - n, std::memory_order_relaxed); }
+    uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// 单写者直方图, 分桶方式和Histogram一样, 读的时候拷成一个Histogram再算百分位
+// 读到的各个桶不是同一时刻的, 对监控来说足够了
+class ConcurrentHistogram {
+public:
+    ConcurrentHistogram() : counts_(new std::atomic<uint64_t>[Histogram::kBucketCount]) {
+        for (size_t i = 0; i < Histogram::kBucketCount; i++) {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t value) {
+        std::atomic<uint64_t>& count = counts_[Histogram::index_of(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum_.add(value);
+    }
+
+    // 每个值按所在桶的上界算, 所以百分位和实际最多差1/128
+    Histogram snapshot() const {
+        Histogram histogram;
+        for (size_t i = 0; i < Histogram::kBucketCount; i++) {
+            histogram.record(Histogram::highest_value_of(i), counts_[i].load(std::memory_order_relaxed));
+        }
+        return histogram;
+    }
+
+    uint64_t sum() const { return sum_.get(); }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    Counter sum_;
+};
+
+// 对齐到缓存行, 不同reactor的指标不会挤在同一行里互相干扰
+struct alignas(64) ReactorMetrics {
+    Counter accepts;
+    Counter active_connections;
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter messages_in;
+    // 发送缓冲区满(EAGAIN)或者只发出去一部分的次数, 涨得快说明客户端收得慢或者网络饱和了
+    Counter partial_sends;
+    // 用splice或者sendfile发出去的字节, 也算在bytes_out里
+    Counter zero_copy_bytes;
+    Counter loop_iterations;
+    // 超过最大连接数被拒绝的连接
+    Counter rejected_connections;
+    // 因为空闲, 读或者写超时被断开的连接
+    Counter timeouts;
+    // 发送队列超过高水位暂停读的次数
+    Counter read_pauses;
+    // 推给订阅者的消息数, 一条消息有几个订阅者就算几次
+    Counter deliveries;
+    // 订阅者收得太慢被丢掉的消息
+    Counter dropped_messages;
+    // 订阅者收得太慢被断开的连接
+    Counter evictions;
+    // UDP后端: 太长被截断, 或者发送缓冲区满了没发出去的数据报
+    Counter dropped_datagrams;
+    // epoll后端: 令牌桶透支暂停读的次数, 发送份额用完排到下一轮的次数
+    Counter throttled;
+    Counter write_yields;
+    // 一次epoll_wait/io_uring_enter返回多少个事件, UDP后端是一次recvmmsg收到多少个数据报
+    ConcurrentHistogram events_per_wakeup;
+    // 一轮循环处理事件用了多少纳秒, 不含等待时间
+    ConcurrentHistogram loop_time_ns;
+};
+
+inline void append_metric(std::string& out, const char* name, const char* type, const char* help,
+                          const std::vector<const ReactorMetrics*>& metrics, const Counter ReactorMetrics::*field) {
+    char line[160];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    out += line;
+    for (size_t i = 0; i < metrics.size(); i++) {
+        snprintf(line, sizeof(line), "%s{reactor=\"%zu\"} %lu\n", name, i, (unsigned long)(metrics[i]->*field).get());
+        out += line;
+    }
+}
+
+inline void append_summary(std::string& out, const char* name, const char* help,
+                           const std::vector<const ReactorMetrics*>& metrics, const ConcurrentHistogram ReactorMetrics::*field) {
+    static const double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+    char line[160];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    out += line;
+    for (size_t i = 0; i < metrics.size(); i++) {
+        const ConcurrentHistogram& histogram = metrics[i]->*field;
+        Histogram snapshot = histogram.snapshot();
+        for (double quantile : kQuantiles) {
+            snprintf(line, sizeof(line), "%s{reactor=\"%zu\",quantile=\"%g\"} %lu\n", name, i, quantile,
+                     (unsigned long)snapshot.percentile(quantile * 100));
+            out += line;
+        }
+        snprintf(line, sizeof(line), "%s_sum{reactor=\"%zu\"} %lu\n%s_count{reactor=\"%zu\"} %lu\n", name, i,
+                 (unsigned long)histogram.sum(), name, i, (unsigned long)snapshot.count());
+        out += line;
+    }
+}
+
+// 按Prometheus文本格式输出所有reactor的指标
+inline std::string format_metrics(const std::vector<const ReactorMetrics*>& metrics) {
+    std::string out;
+    append_metric(out, "socket_server_accepts_total", "counter", "Accepted connections.", metrics, &ReactorMetrics::accepts);
+    append_metric(out, "socket_server_active_connections", "gauge", "Currently open connections.", metrics,
+                  &ReactorMetrics::active_connections);
+    append_metric(out, "socket_server_received_bytes_total", "counter", "Bytes received from clients.", metrics,
+                  &ReactorMetrics::bytes_in);
+    append_metric(out, "socket_server_sent_bytes_total", "counter", "Bytes sent to clients.", metrics, &ReactorMetrics::bytes_out);
+    append_metric(out, "socket_server_messages_total", "counter", "Frames received from clients.", metrics,
+                  &ReactorMetrics::messages_in);
+    append_metric(out, "socket_server_partial_sends_total", "counter", "Sends that hit EAGAIN or were only partially written.",
+                  metrics, &ReactorMetrics::partial_sends);
+    append_metric(out, "socket_server_zero_copy_bytes_total", "counter", "Bytes sent with splice or sendfile.", metrics,
+                  &ReactorMetrics::zero_copy_bytes);
+    append_metric(out, "socket_server_loop_iterations_total", "counter", "Event loop iterations.", metrics,
+                  &ReactorMetrics::loop_iterations);
+    append_metric(out, "socket_server_rejected_connections_total", "counter", "Connections closed because of max connections.",
+                  metrics, &ReactorMetrics::rejected_connections);
+    append_metric(out, "socket_server_timeouts_total", "counter", "Connections closed by idle, read or write timeouts.", metrics,
+                  &ReactorMetrics::timeouts);
+    append_metric(out, "socket_server_read_pauses_total", "counter", "Times reading was paused because the send queue was full.",
+                  metrics, &ReactorMetrics::read_pauses);
+    append_metric(out, "socket_server_pubsub_deliveries_total", "counter", "Published messages queued to subscribers.", metrics,
+                  &ReactorMetrics::deliveries);
+    append_metric(out, "socket_server_pubsub_dropped_total", "counter", "Published messages dropped for slow subscribers.", metrics,
+                  &ReactorMetrics::dropped_messages);
+    append_metric(out, "socket_server_pubsub_evictions_total", "counter", "Slow subscribers disconnected.", metrics,
+                  &ReactorMetrics::evictions);
+    append_metric(out, "socket_server_udp_dropped_total", "counter", "Datagrams dropped because they were truncated or could not be sent.",
+                  metrics, &ReactorMetrics::dropped_datagrams);
+    append_metric(out, "socket_server_throttled_total", "counter", "Times reading was paused by rate limits.", metrics,
+                  &ReactorMetrics::throttled);
+    append_metric(out, "socket_server_write_yields_total", "counter", "Sends stopped at the per iteration quantum and continued later.",
+                  metrics, &ReactorMetrics::write_yields);
+    append_summary(out, "socket_server_events_per_wakeup", "Events returned by one epoll_wait or io_uring_enter, or datagrams by one recvmmsg.", metrics,
+                   &ReactorMetrics::events_per_wakeup);
+    append_summary(out, "socket_server_loop_time_ns", "Time spent handling events in one loop iteration.", metrics,
+                   &ReactorMetrics::loop_time_ns);
+    return out;
+}
+
+// 创建管理用的Unix域socket, 路径上已经有旧的socket文件就先删掉
+inline int create_admin_fd(const char* path) {
+    sockaddr_un addr{};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Admin socket path is too long: %s", path);
+        return -1;
+    }
+    int admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd == -1) {
+        LOG_ERROR("Failed to create admin socket: %s", strerror(errno));
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(admin_fd, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(admin_fd, 16) == -1) {
+        LOG_ERROR("Failed to listen admin socket %s: %s", path, strerror(errno));
+        close(admin_fd);
+        return -1;
+    }
+    return admin_fd;
+}
+
+// path是nullptr时不删socket文件, 热重启之后这个路径已经归新进程了
+inline void close_admin_fd(int admin_fd, const char* path) {
+    if (admin_fd != -1) {
+        close(admin_fd);
+        if (path != nullptr) {
+            unlink(path);
+        }
+    }
+}
+
+// 把整段数据写完, 对面不收了就算了
+inline void write_admin_reply(int fd, const std::string& reply) {
+    size_t written = 0;
+    while (written < reply.size()) {
+        ssize_t len = send(fd, reply.data() + written, reply.size() - written, MSG_NOSIGNAL);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            return;
+        }
+        written += len;
+    }
+}
+
+// 管理线程, 直到shutdown_flag置位才退出
+// 连上来的客户端如果在100ms内发了HTTP请求就回HTTP响应, 什么都不发就直接回文本
+inline void run_admin_server(int admin_fd, std::vector<const ReactorMetrics*> metrics, const std::atomic<bool>& shutdown_flag) {
+    while (!shutdown_flag.load(std::memory_order_relaxed)) {
+        pollfd listen_poll{admin_fd, POLLIN, 0};
+        if (poll(&listen_poll, 1, 500) <= 0) {
+            continue;
+        }
+        int client_fd = accept4(admin_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            continue;
+        }
+        char request[1024];
+        ssize_t request_len = 0;
+        pollfd client_poll{client_fd, POLLIN, 0};
+        if (poll(&client_poll, 1, 100) > 0) {
+            request_len = recv(client_fd, request, sizeof(request), MSG_DONTWAIT);
+        }
+
+        std::string body = format_metrics(metrics);
+        if (request_len >= 4 && memcmp(request, "GET ", 4) == 0) {
+            std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                              + std::to_string(body.size()) + "\r\n\r\n";
+            write_admin_reply(client_fd, reply + body);
+        } else {
+            write_admin_reply(client_fd, body);
+        }
+        close(client_fd);
+    }
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef LINUX_SOCKET_PROTOCOL_H
+#define LINUX_SOCKET_PROTOCOL_H
+
+// 服务器和客户端共用的二进制分帧协议
+// TCP是字节流, 一次recv可能收到半个消息也可能收到好几个消息, 所以每个消息前面都加一个定长的头:
+// | payload长度(4字节, 网络字节序) | opcode(1字节) | payload(长度由头部指定) |
+
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "buffer.h"
+
+enum class Opcode : uint8_t {
+    kEcho = 1,      // 服务器把payload原样回送
+    kExit = 2,      // 客户端断开连接
+    kShutdown = 3,  // 关闭服务器
+    kBulkEcho = 4,  // 和kEcho一样回送, 但payload不进用户态, 服务器用splice直接从socket搬回socket, 不受kMaxPayloadSize限制
+    kServeFile = 5, // payload是文件路径, 服务器用sendfile回一个同样opcode的帧, payload是文件内容
+    kError = 6,     // 服务器告诉客户端请求处理不了, payload是原因
+    kSubscribe = 7,    // 订阅payload这个topic, 成功时服务器原样回一个同样的帧
+    kUnsubscribe = 8,  // 退订payload这个topic, 服务器原样回一个同样的帧
+    kPublish = 9,      // payload是| topic长度(1字节) | topic | 消息 |, 服务器把这一帧原样推给这个topic的所有订阅者, 不回复发布者
+    kRequest = 10,     // payload是| 请求id(4字节, 网络字节序) | 请求内容 |, 服务器回一个带同样id的帧, 客户端按id对上回复
+};
+
+constexpr size_t kFrameHeaderSize = 5;
+// 超过这个长度的帧直接当协议错误处理, 防止对面一个头部就让我们分配一大块内存
+constexpr uint32_t kMaxPayloadSize = 16 * 1024 * 1024;
+
+inline bool is_valid_opcode(uint8_t opcode) {
+    return opcode >= static_cast<uint8_t>(Opcode::kEcho) && opcode <= static_cast<uint8_t>(Opcode::kRequest);
+}
+
+// 往dst写入kFrameHeaderSize字节的帧头
+inline void encode_frame_header(char* dst, Opcode opcode, uint32_t payload_len) {
+    uint32_t net_len = htonl(payload_len);
+    memcpy(dst, &net_len, sizeof(net_len));
+    dst[4] = static_cast<char>(opcode);
+}
+
+// 把一整帧追加到out后面
+inline void append_frame(std::string& out, Opcode opcode, const char* payload, uint32_t payload_len) {
+    size_t old_size = out.size();
+    out.resize(old_size + kFrameHeaderSize + payload_len);
+    encode_frame_header(&out[old_size], opcode, payload_len);
+    if (payload_len > 0) {
+        memcpy(&out[old_size + kFrameHeaderSize], payload, payload_len);
+    }
+}
+
+constexpr size_t kMaxTopicSize = 255;
+
+// 追加一个kPublish帧, topic不能为空, 最长kMaxTopicSize
+inline void append_publish_frame(std::string& out, const std::string& topic, const char* message, uint32_t message_len) {
+    std::string payload;
+    payload.reserve(1 + topic.size() + message_len);
+    payload.push_back(static_cast<char>(topic.size()));
+    payload += topic;
+    payload.append(message, message_len);
+    append_frame(out, Opcode::kPublish, payload.data(), payload.size());
+}
+
+// 从kPublish的payload里取出topic, 格式不对返回false
+inline bool parse_publish(const char* payload, uint32_t payload_len, std::string& topic) {
+    if (payload_len < 1) {
+        return false;
+    }
+    size_t topic_len = static_cast<uint8_t>(payload[0]);
+    if (topic_len == 0 || 1 + topic_len > payload_len) {
+        return false;
+    }
+    topic.assign(payload + 1, topic_len);
+    return true;
+}
+
+constexpr size_t kRequestIdSize = 4;
+
+// 追加一个kRequest帧
+inline void append_request_frame(std::string& out, uint32_t request_id, const char* body, uint32_t body_len) {
+    size_t old_size = out.size();
+    out.resize(old_size + kFrameHeaderSize + kRequestIdSize + body_len);
+    encode_frame_header(&out[old_size], Opcode::kRequest, kRequestIdSize + body_len);
+    uint32_t net_id = htonl(request_id);
+    memcpy(&out[old_size + kFrameHeaderSize], &net_id, sizeof(net_id));
+    if (body_len > 0) {
+        memcpy(&out[old_size + kFrameHeaderSize + kRequestIdSize], body, body_len);
+    }
+}
+
+// 从kRequest的payload里取出请求id, payload短于id返回false
+inline bool parse_request_id(const char* payload, uint32_t payload_len, uint32_t& request_id) {
+    if (payload_len < kRequestIdSize) {
+        return false;
+    }
+    uint32_t net_id = 0;
+    memcpy(&net_id, payload, sizeof(net_id));
+    request_id = ntohl(net_id);
+    return true;
+}
+
+// 解析出来的一帧, payload直接指向接收缓冲区内部, 不再拷贝一次
+// 在下一次对缓冲区prepare之前有效
+struct Frame {
+    Opcode opcode;
+    const char* payload;
+    uint32_t payload_len;
+};
+
+enum class ParseResult {
+    kFrame,     // 取到了一帧
+    kNeedMore,  // 剩下的数据还不够一帧
+    kError,     // 协议错误, 应该断开连接
+};
+
+// 只看下一帧的帧头, 不取走数据也不检查长度, 用来在payload收全之前决定怎么处理这一帧
+// 返回kFrame时只有opcode和payload_len有效
+inline ParseResult peek_frame_header(const RecvBuffer& buf, Frame& frame) {
+    if (buf.readable() < kFrameHeaderSize) {
+        return ParseResult::kNeedMore;
+    }
+    const char* header = buf.peek();
+    uint32_t net_len = 0;
+    memcpy(&net_len, header, sizeof(net_len));
+    uint8_t opcode = static_cast<uint8_t>(header[4]);
+    if (!is_valid_opcode(opcode)) {
+        return ParseResult::kError;
+    }
+    frame.opcode = static_cast<Opcode>(opcode);
+    frame.payload = nullptr;
+    frame.payload_len = ntohl(net_len);
+    return ParseResult::kFrame;
+}
+
+// 从缓冲区中取下一帧, 一次recv收到多帧时循环调用直到返回kNeedMore
+inline ParseResult parse_frame(RecvBuffer& buf, Frame& frame) {
+    ParseResult result = peek_frame_header(buf, frame);
+    if (result != ParseResult::kFrame) {
+        return result;
+    }
+    if (frame.payload_len > kMaxPayloadSize) {
+        return ParseResult::kError;
+    }
+    if (buf.readable() < kFrameHeaderSize + frame.payload_len) {
+        return ParseResult::kNeedMore;
+    }
+    frame.payload = buf.peek() + kFrameHeaderSize;
+    buf.read_pos += kFrameHeaderSize + frame.payload_len;
+    return ParseResult::kFrame;
+}
+
+#endif
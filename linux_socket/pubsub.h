@@ -0,0 +1,275 @@
+#ifndef LINUX_SOCKET_PUBSUB_H
+#define LINUX_SOCKET_PUBSUB_H
+
+// 按topic的发布订阅
+// 发布的帧收到时拷贝一次, 放进一块之后不再修改的Block里, 每个订阅者的发送队列只挂一个引用, 扇出给多少个订阅者都不再拷贝
+// 每个reactor一个broker, 只管自己reactor上的连接; 多reactor时发布者所在的reactor把帧的引用投进其他reactor的收件箱,
+// 再用eventfd叫醒它们, 各reactor在自己的线程里扇出, 所以连接状态始终只有一个线程访问
+// 订阅者收得太慢时按pubsub_options.slow_policy丢掉最老的消息或者断开, 每个订阅者占的内存有上限
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "config.h"
+#include "metrics.h"
+
+enum class SlowPolicy {
+    kDropOldest,  // 丢掉发送队列里最老的还没开始发的消息
+    kDisconnect,  // 直接断开
+};
+
+inline bool parse_config_value(const char* text, SlowPolicy& policy) {
+    if (strcmp(text, "drop-oldest") == 0) {
+        policy = SlowPolicy::kDropOldest;
+    } else if (strcmp(text, "disconnect") == 0) {
+        policy = SlowPolicy::kDisconnect;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline std::string format_config_value(SlowPolicy policy) {
+    return policy == SlowPolicy::kDropOldest ? "drop-oldest" : "disconnect";
+}
+
+// 启动时设置好, 之后只读
+struct PubSubOptions {
+    // 订阅者的发送队列超过这么多字节就算收得太慢
+    size_t max_queued = 1024 * 1024;
+    SlowPolicy slow_policy = SlowPolicy::kDropOldest;
+    // 一个连接最多订阅多少个topic
+    size_t max_subscriptions = 64;
+};
+
+inline PubSubOptions pubsub_options;
+
+inline void add_pubsub_options(OptionParser& parser) {
+    parser.add("sub-max-queued", &pubsub_options.max_queued, "send queue bytes after which a subscriber is slow");
+    parser.add("sub-slow-policy", &pubsub_options.slow_policy, "drop-oldest or disconnect slow subscribers");
+    parser.add("sub-max-topics", &pubsub_options.max_subscriptions, "max topics one connection can subscribe");
+}
+
+// 连接上和订阅有关的状态, 能订阅的连接类型里要有一个叫subscriber的这个成员
+struct SubscriberState {
+    void reset() {
+        topics.clear();
+        flush_pending = false;
+        evicted = false;
+    }
+
+    // 订阅了哪些topic, 连接关闭时按这个退订
+    std::vector<std::string> topics;
+    // 已经排进broker的待发送列表
+    bool flush_pending = false;
+    // 收得太慢, 要被断开
+    bool evicted = false;
+};
+
+// 一个reactor的topic表和收件箱
+// Conn需要有: OutputBuffer send_buf, SubscriberState subscriber, 以及can_enqueue()表示现在能不能往send_buf里插消息
+template <typename Conn>
+class TopicBroker {
+public:
+    TopicBroker() = default;
+    TopicBroker(const TopicBroker&) = delete;
+    TopicBroker& operator=(const TopicBroker&) = delete;
+    ~TopicBroker() {
+        if (event_fd_ != -1) {
+            close(event_fd_);
+        }
+    }
+
+    // 创建收件箱的eventfd, 失败返回false
+    bool init() {
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return event_fd_ != -1;
+    }
+
+    // 收件箱有消息时可读, 挂到reactor的事件循环上
+    int event_fd() const { return event_fd_; }
+
+    // 其他reactor的broker, 在reactor线程启动之前设置好
+    void set_peers(std::vector<TopicBroker*> peers) { peers_ = std::move(peers); }
+
+    // 已经订阅过也算成功, 超过max_subscriptions返回false
+    bool subscribe(Conn& conn, const std::string& topic) {
+        std::vector<std::string>& topics = conn.subscriber.topics;
+        if (std::find(topics.begin(), topics.end(), topic) != topics.end()) {
+            return true;
+        }
+        if (topics.size() >= pubsub_options.max_subscriptions) {
+            return false;
+        }
+        topics.push_back(topic);
+        topics_[topic].push_back(&conn);
+        return true;
+    }
+
+    void unsubscribe(Conn& conn, const std::string& topic) {
+        std::vector<std::string>& topics = conn.subscriber.topics;
+        auto it = std::find(topics.begin(), topics.end(), topic);
+        if (it == topics.end()) {
+            return;
+        }
+        topics.erase(it);
+        remove_subscriber(topic, &conn);
+    }
+
+    // 连接关闭时调用
+    void remove(Conn& conn) {
+        for (const std::string& topic : conn.subscriber.topics) {
+            remove_subscriber(topic, &conn);
+        }
+        conn.subscriber.topics.clear();
+    }
+
+    // 发布一帧, frame是整个kPublish帧, 订阅者收到的就是这一帧
+    // 本reactor的订阅者直接排进发送队列, 其他reactor投递到它们的收件箱
+    void publish(const std::string& topic, const Slice& frame, ReactorMetrics& metrics) {
+        deliver(topic, frame, metrics);
+        for (TopicBroker* peer : peers_) {
+            peer->post(topic, frame);
+        }
+    }
+
+    // event_fd可读时调用, 把其他reactor投递过来的消息扇出给本reactor的订阅者
+    void drain_inbox(ReactorMetrics& metrics) {
+        // 先清eventfd再取消息, 取完之后新投递的消息会再叫醒一次
+        uint64_t count;
+        while (read(event_fd_, &count, sizeof(count)) == -1 && errno == EINTR) {
+        }
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex_);
+            inbox_.swap(draining_);
+        }
+        for (const auto& message : draining_) {
+            deliver(message.first, message.second, metrics);
+        }
+        draining_.clear();
+    }
+
+    // 每轮事件处理完之后调用, 这一轮收到消息的订阅者每个只发送一次
+    // flush负责发送, evict负责断开收得太慢的订阅者; 已经关闭的连接由调用者自己跳过
+    template <typename Flush, typename Evict>
+    void flush(Flush flush, Evict evict) {
+        pending_.swap(flushing_);
+        for (Conn* conn : flushing_) {
+            conn->subscriber.flush_pending = false;
+            if (conn->subscriber.evicted) {
+                evict(*conn);
+            } else {
+                flush(*conn);
+            }
+        }
+        flushing_.clear();
+    }
+
+    size_t topic_count() const { return topics_.size(); }
+
+private:
+    void post(const std::string& topic, const Slice& frame) {
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex_);
+            was_empty = inbox_.empty();
+            inbox_.emplace_back(topic, frame);
+        }
+        // 收件箱原来不是空的说明已经叫过了, 对方还没来得及取
+        if (was_empty) {
+            uint64_t one = 1;
+            while (write(event_fd_, &one, sizeof(one)) == -1 && errno == EINTR) {
+            }
+        }
+    }
+
+    void deliver(const std::string& topic, const Slice& frame, ReactorMetrics& metrics) {
+        auto it = topics_.find(topic);
+        if (it == topics_.end()) {
+            return;
+        }
+        for (Conn* conn : it->second) {
+            enqueue(*conn, frame, metrics);
+        }
+    }
+
+    void enqueue(Conn& conn, const Slice& frame, ReactorMetrics& metrics) {
+        SubscriberState& subscriber = conn.subscriber;
+        if (subscriber.evicted) {
+            return;
+        }
+        // 零拷贝传输进行中, 发送队列后面紧跟着的是传输的数据, 这期间的消息只能丢掉
+        if (!conn.can_enqueue()) {
+            metrics.dropped_messages.add();
+            return;
+        }
+        size_t limit = pubsub_options.max_queued;
+        if (conn.send_buf.size() + frame.len > limit) {
+            if (pubsub_options.slow_policy == SlowPolicy::kDisconnect) {
+                subscriber.evicted = true;
+                mark_pending(conn);
+                return;
+            }
+            size_t room = limit > frame.len ? limit - frame.len : 0;
+            metrics.dropped_messages.add(conn.send_buf.drop_oldest(room));
+            if (conn.send_buf.size() > room) {
+                // 剩下的都是不能丢的回复或者已经发了一半的消息, 丢掉新来的这条
+                metrics.dropped_messages.add();
+                return;
+            }
+        }
+        // 整块Block只有这一帧, 不会和别的Slice合并, 可以整段丢掉
+        Slice ref = frame;
+        ref.droppable = true;
+        conn.send_buf.append(std::move(ref));
+        metrics.deliveries.add();
+        mark_pending(conn);
+    }
+
+    void mark_pending(Conn& conn) {
+        if (!conn.subscriber.flush_pending) {
+            conn.subscriber.flush_pending = true;
+            pending_.push_back(&conn);
+        }
+    }
+
+    void remove_subscriber(const std::string& topic, Conn* conn) {
+        auto it = topics_.find(topic);
+        if (it == topics_.end()) {
+            return;
+        }
+        std::vector<Conn*>& subscribers = it->second;
+        auto pos = std::find(subscribers.begin(), subscribers.end(), conn);
+        if (pos != subscribers.end()) {
+            // 订阅者之间没有顺序, 和最后一个交换之后删掉
+            *pos = subscribers.back();
+            subscribers.pop_back();
+        }
+        if (subscribers.empty()) {
+            topics_.erase(it);
+        }
+    }
+
+    std::unordered_map<std::string, std::vector<Conn*>> topics_;
+    // 这一轮收到消息还没发送的订阅者, 和flush时正在处理的那一批
+    std::vector<Conn*> pending_;
+    std::vector<Conn*> flushing_;
+    std::vector<TopicBroker*> peers_;
+    int event_fd_ = -1;
+    std::mutex inbox_mutex_;
+    std::vector<std::pair<std::string, Slice>> inbox_;
+    std::vector<std::pair<std::string, Slice>> draining_;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef LINUX_SOCKET_RATE_LIMIT_H
+#define LINUX_SOCKET_RATE_LIMIT_H
+
+// 按连接和全局的令牌桶限速, epoll后端用
+// 令牌桶按rate每秒往桶里加令牌, 最多攒到burst; 允许透支, 一次读上来的数据不管多少都照收,
+// 桶变成负数之后这个连接暂停读, 等令牌补回正数再读, 平均速率还是rate, 对面被TCP的流量控制挡住
+
+#include <cstdint>
+
+#include "config.h"
+
+class TokenBucket {
+public:
+    // rate是每秒多少令牌, 0表示不限速; burst是桶的容量, 也是一开始有多少令牌
+    void init(uint64_t rate, uint64_t burst, uint64_t now_ms) {
+        rate_ = rate;
+        burst_ = burst > 0 ? burst : 1;
+        tokens_ = burst_;
+        last_ms_ = now_ms;
+    }
+
+    bool enabled() const { return rate_ > 0; }
+    double tokens() const { return tokens_; }
+
+    void refill(uint64_t now_ms) {
+        if (now_ms <= last_ms_) {
+            return;
+        }
+        tokens_ += (double)(now_ms - last_ms_) * rate_ / 1000;
+        if (tokens_ > burst_) {
+            tokens_ = burst_;
+        }
+        last_ms_ = now_ms;
+    }
+
+    void consume(uint64_t n) {
+        if (rate_ > 0) {
+            tokens_ -= n;
+        }
+    }
+
+    // 令牌用完之后还要等多少毫秒才能回到正数, 没用完返回0
+    uint64_t wait_ms() const {
+        if (rate_ == 0 || tokens_ > 0) {
+            return 0;
+        }
+        return (uint64_t)(-tokens_ * 1000 / rate_) + 1;
+    }
+
+private:
+    uint64_t rate_ = 0;
+    double burst_ = 1;
+    double tokens_ = 0;
+    uint64_t last_ms_ = 0;
+};
+
+// 限速和公平调度的参数, 启动时设置好, 之后只读; 速率填0表示不限制
+struct RateLimitOptions {
+    // 每个连接每秒最多读多少字节, 处理多少个帧
+    uint64_t conn_bytes = 0;
+    uint64_t conn_messages = 0;
+    // 所有连接加起来的上限, 按reactor数平分, 每个reactor只管自己那一份, 不用跨线程同步
+    uint64_t global_bytes = 0;
+    uint64_t global_messages = 0;
+    // 桶的容量是多少毫秒的速率, 决定了空闲之后能突发多少
+    uint64_t burst_ms = 100;
+    // 发送时的DRR份额: 每轮事件循环每个连接最多发这么多字节, 没发完的排到下一轮, 0表示发到EAGAIN为止
+    size_t write_quantum = 64 * 1024;
+};
+
+inline RateLimitOptions rate_limit_options;
+
+inline void add_rate_limit_options(OptionParser& parser) {
+    parser.add("conn-rate-bytes", &rate_limit_options.conn_bytes, "bytes per second read from one connection, 0 to disable");
+    parser.add("conn-rate-msgs", &rate_limit_options.conn_messages, "frames per second handled for one connection, 0 to disable");
+    parser.add("global-rate-bytes", &rate_limit_options.global_bytes, "bytes per second read from all connections, 0 to disable");
+    parser.add("global-rate-msgs", &rate_limit_options.global_messages, "frames per second handled for all connections, 0 to disable");
+    parser.add("rate-burst", &rate_limit_options.burst_ms, "token bucket capacity in ms of the rate");
+    parser.add("write-quantum", &rate_limit_options.write_quantum, "max bytes sent to one connection per loop iteration, 0 to disable");
+}
+
+inline bool check_rate_limit_options() {
+    return rate_limit_options.burst_ms > 0;
+}
+
+inline bool rate_limit_enabled() {
+    return rate_limit_options.conn_bytes > 0 || rate_limit_options.conn_messages > 0 || rate_limit_options.global_bytes > 0
+        || rate_limit_options.global_messages > 0;
+}
+
+// 按rate_limit_options的容量初始化一个桶, share是速率要平分给几份
+inline void init_bucket(TokenBucket& bucket, uint64_t rate, int share, uint64_t now_ms) {
+    if (rate > 0 && share > 1) {
+        rate = (rate + share - 1) / share;
+    }
+    bucket.init(rate, rate * rate_limit_options.burst_ms / 1000, now_ms);
+}
+
+#endif
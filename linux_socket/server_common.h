@@ -0,0 +1,565 @@
+#ifndef LINUX_SOCKET_SERVER_COMMON_H
+#define LINUX_SOCKET_SERVER_COMMON_H
+
+// epoll和io_uring两种后端共用的部分: 监听socket的创建, 连接状态和协议处理
+// 后端只负责把数据收进recv_buf、把send_buf发出去, 收到的帧怎么处理全在这里, 方便两种后端对比
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "buffer.h"
+#include "config.h"
+#include "logger.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "socket_address.h"
+#include "timing_wheel.h"
+#include "zero_copy.h"
+
+// 任意一个reactor出现严重错误时置位, 让所有reactor马上一起退出
+inline std::atomic<bool> shutdown_server{false};
+
+// 优雅退出: 收到SIGTERM/SIGINT, shutdown帧, 或者监听socket交给了新进程之后置位
+// 各reactor停止accept, 不再读新请求, 把发送队列里的回复发完再关连接, 超过drain_timeout还没发完的直接关
+inline std::atomic<bool> drain_server{false};
+// 写一下就能把所有reactor从等待里叫醒; 从来不读, 它会一直可读, 所以各reactor开始排空时把它从自己的epoll里摘掉
+inline int drain_event_fd = -1;
+
+// 创建drain_event_fd, 已经有了就清掉上次的状态, 在reactor初始化之前调用
+inline bool init_drain_event() {
+    drain_server = false;
+    if (drain_event_fd == -1) {
+        drain_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return drain_event_fd != -1;
+    }
+    uint64_t count;
+    while (read(drain_event_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+    return true;
+}
+
+// 开始优雅退出, 只用到原子变量和write, 可以在信号处理函数里调用
+inline void request_drain() {
+    drain_server = true;
+    if (drain_event_fd != -1) {
+        uint64_t one = 1;
+        ssize_t written = write(drain_event_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+// SIGTERM和SIGINT开始优雅退出, 排空过程中再收到一次就直接停
+inline void handle_stop_signal(int) {
+    if (drain_server.load()) {
+        shutdown_server = true;
+    } else {
+        request_drain();
+    }
+}
+
+// 在init_drain_event之后调用
+inline void install_stop_signals() {
+    struct sigaction action{};
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+}
+
+// 连接数, 超时和背压的限制, 启动时设置好, 之后只读; 超时填0表示不限制
+struct ServerLimits {
+    // 所有reactor加起来最多同时有多少个连接, 超过的连接accept之后马上关掉
+    size_t max_connections = 10000;
+    // 既没收到也没发出任何数据多久之后断开
+    uint64_t idle_timeout_ms = 60000;
+    // 收到半个帧之后多久还没收完就断开, 防止slowloris式的慢速发送占着连接
+    uint64_t read_timeout_ms = 10000;
+    // 有数据要发但一直发不出去多久之后断开, 对付只发不收的客户端
+    uint64_t write_timeout_ms = 30000;
+    // 发送队列超过高水位就暂停读这个连接, 降到低水位以下再恢复, 这样每个连接占的内存有上限
+    // 低水位填0表示取高水位的四分之一
+    size_t high_water = 4 * 1024 * 1024;
+    size_t low_water = 0;
+    // 优雅退出时最多等多久把回复发完, 到时间还没关的连接直接关掉, 填0表示不等
+    uint64_t drain_timeout_ms = 5000;
+};
+
+inline ServerLimits server_limits;
+
+// 所有reactor当前的连接总数, 只在建连和断连时改, 不在热路径上
+inline std::atomic<size_t> connection_count{0};
+
+// 占一个连接名额, 超过上限返回false
+inline bool reserve_connection() {
+    if (connection_count.fetch_add(1, std::memory_order_relaxed) >= server_limits.max_connections) {
+        connection_count.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+inline void release_connection() {
+    connection_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// 监听socket的地址和选项, 启动时设置好, 之后只读; 填0表示用系统默认值
+struct SocketOptions {
+    // 监听哪个地址, 填::就是IPv6, 默认同时也收IPv4的连接
+    std::string address = "0.0.0.0";
+    uint16_t port = 7070;
+    // IPv6监听socket只收IPv6的连接
+    bool v6only = false;
+    int backlog = SOMAXCONN;
+    // 设在监听socket上, Linux上accept出来的连接会继承, 不用每个连接再调一次setsockopt
+    bool tcp_nodelay = true;
+    // 连接建好之后等客户端发来数据才让accept返回, 最多等多少秒
+    int defer_accept_seconds = 0;
+    // TCP Fast Open的队列长度, 客户端可以在SYN里带上第一个请求
+    int fastopen_queue = 0;
+    // 收发缓冲区大小, 在listen之前设置才能影响窗口扩大选项, 也会被accept出来的连接继承
+    int rcvbuf = 0;
+    int sndbuf = 0;
+};
+
+inline SocketOptions socket_options;
+
+// 按socket_options设置监听socket, 失败返回false
+inline bool apply_listen_options(int listen_fd) {
+    int on = 1;
+    if (socket_options.tcp_nodelay && setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        LOG_ERROR("Failed to set TCP_NODELAY: %s", strerror(errno));
+        return false;
+    }
+    if (socket_options.defer_accept_seconds > 0
+        && setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &socket_options.defer_accept_seconds, sizeof(int)) == -1) {
+        LOG_ERROR("Failed to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+        return false;
+    }
+    if (socket_options.fastopen_queue > 0
+        && setsockopt(listen_fd, IPPROTO_TCP, TCP_FASTOPEN, &socket_options.fastopen_queue, sizeof(int)) == -1) {
+        LOG_ERROR("Failed to set TCP_FASTOPEN: %s", strerror(errno));
+        return false;
+    }
+    if (socket_options.rcvbuf > 0 && setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &socket_options.rcvbuf, sizeof(int)) == -1) {
+        LOG_ERROR("Failed to set SO_RCVBUF: %s", strerror(errno));
+        return false;
+    }
+    if (socket_options.sndbuf > 0 && setsockopt(listen_fd, SOL_SOCKET, SO_SNDBUF, &socket_options.sndbuf, sizeof(int)) == -1) {
+        LOG_ERROR("Failed to set SO_SNDBUF: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// 创建监听socket, 多reactor模式下打开SO_REUSEPORT让内核把新连接分散到各个listen_fd上
+inline int create_listen_fd(bool reuse_port, bool nonblock) {
+    SocketAddress server_addr;
+    if (!resolve_address(socket_options.address, socket_options.port, server_addr)) {
+        LOG_ERROR("Invalid listen address: %s", socket_options.address.c_str());
+        return -1;
+    }
+    int listen_fd = socket(server_addr.family(), SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (listen_fd == -1) {
+        LOG_ERROR("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int reuse = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
+        LOG_ERROR("Failed to set socket: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    if (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        LOG_ERROR("Failed to set SO_REUSEPORT: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    int v6only = socket_options.v6only ? 1 : 0;
+    if (server_addr.family() == AF_INET6 && setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1) {
+        LOG_ERROR("Failed to set IPV6_V6ONLY: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    if (!apply_listen_options(listen_fd)) {
+        close(listen_fd);
+        return -1;
+    }
+
+    if (bind(listen_fd, server_addr.get(), server_addr.len) == -1) {
+        LOG_ERROR("Failed to bind socket with address %s: %s", format_address(server_addr.get()).c_str(), strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, socket_options.backlog) == -1) {
+        LOG_ERROR("Failed to listen address: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+inline bool parse_config_value(const char* text, LogLevel& level) {
+    static const char* const kNames[] = {"debug", "info", "warn", "error"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(text, kNames[i]) == 0) {
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline std::string format_config_value(LogLevel level) {
+    static const char* const kNames[] = {"debug", "info", "warn", "error"};
+    return kNames[static_cast<int>(level)];
+}
+
+// 三个服务器共用的参数: 监听地址和选项, 连接限制, 日志开关
+inline void add_server_options(OptionParser& parser) {
+    parser.add("address", &socket_options.address, "listen address, :: for IPv6");
+    parser.add("port", &socket_options.port, "listen port");
+    parser.add("v6only", &socket_options.v6only, "IPv6 listen socket does not accept IPv4 clients");
+    parser.add("backlog", &socket_options.backlog, "listen backlog");
+    parser.add("tcp-nodelay", &socket_options.tcp_nodelay, "set TCP_NODELAY on the listen socket");
+    parser.add("defer-accept", &socket_options.defer_accept_seconds, "TCP_DEFER_ACCEPT seconds, 0 to disable");
+    parser.add("fastopen", &socket_options.fastopen_queue, "TCP_FASTOPEN queue length, 0 to disable");
+    parser.add("rcvbuf", &socket_options.rcvbuf, "SO_RCVBUF bytes, 0 for system default");
+    parser.add("sndbuf", &socket_options.sndbuf, "SO_SNDBUF bytes, 0 for system default");
+    parser.add("max-conns", &server_limits.max_connections, "max connections of all reactors");
+    parser.add("idle-timeout", &server_limits.idle_timeout_ms, "idle timeout in ms, 0 to disable");
+    parser.add("read-timeout", &server_limits.read_timeout_ms, "partial frame timeout in ms, 0 to disable");
+    parser.add("write-timeout", &server_limits.write_timeout_ms, "stalled send timeout in ms, 0 to disable");
+    parser.add("high-water", &server_limits.high_water, "pause reading when the send queue exceeds this many bytes, 0 to disable");
+    parser.add("low-water", &server_limits.low_water, "resume reading below this many bytes, 0 for high-water / 4");
+    parser.add("drain-timeout", &server_limits.drain_timeout_ms, "ms to flush replies on graceful shutdown before closing connections");
+    parser.add("file-root", &transfer_options.file_root, "directory served by the serve-file opcode, empty to disable");
+    parser.add("pipe-size", &transfer_options.pipe_size, "pipe capacity in bytes used by splice");
+    parser.add("log-message", &log_config.message, "log every message");
+    parser.add("log-accept", &log_config.accept, "log every connection");
+    parser.add("log-level", &log_config.level, "debug, info, warn or error");
+}
+
+// 参数都解析完之后调用, 算出没填的默认值并检查参数是否合理, 不合理返回false
+inline bool finish_server_options() {
+    if (server_limits.low_water == 0) {
+        server_limits.low_water = server_limits.high_water / 4;
+    }
+    if (server_limits.high_water > 0 && server_limits.low_water >= server_limits.high_water) {
+        fprintf(stderr, "low-water must be less than high-water\n");
+        return false;
+    }
+    return true;
+}
+
+// 连接关闭后最多留多大的接收缓冲区给下一个连接
+constexpr size_t kMaxRecycledBuffer = 64 * 1024;
+
+// 一个客户端连接的协议状态, 各后端在此基础上加自己的字段
+// 连接对象由ConnectionTable重复使用, 分给新连接时调reset, 关闭时调release
+struct Connection {
+    Connection() : client_fd(-1) {}
+    Connection(int fd) : client_fd(fd) {}
+
+    void reset(int fd) {
+        client_fd = fd;
+        last_active_ms = 0;
+        partial_since_ms = 0;
+        write_stalled_since_ms = 0;
+        read_paused = false;
+        draining = false;
+        write_shut = false;
+        timer.owner = this;
+        subscriber.reset();
+    }
+
+    // 先清发送队列, 它引用着接收缓冲区的Block, 清掉之后Block才能留下来复用
+    // pipe里可能还留着没发完的数据, 不能给下一个连接用
+    void release() {
+        client_fd = -1;
+        send_buf.clear();
+        recv_buf.recycle(kMaxRecycledBuffer);
+        transfer.finish();
+        transfer.pipe.close();
+    }
+
+    int client_fd;
+    RecvBuffer recv_buf;
+    OutputBuffer send_buf;
+
+    // 超时检查只用一个定时器, 挂在几个超时时间里最早的那个上
+    TimerNode timer;
+    // 最近一次收到或者发出数据的时间
+    uint64_t last_active_ms = 0;
+    // recv_buf里那半个帧是从什么时候开始等的, 0表示没有半帧
+    uint64_t partial_since_ms = 0;
+    // 发送队列从什么时候开始一直发不出去, 0表示发送队列是空的
+    uint64_t write_stalled_since_ms = 0;
+    // 发送队列超过高水位, 暂停读
+    bool read_paused = false;
+    // 服务器在优雅退出, 不再读新请求, read_paused一直保持
+    bool draining = false;
+    // 优雅退出时回复都发完了, 已经shutdown(SHUT_WR), 之后只读掉对面发来的数据等它关连接
+    bool write_shut = false;
+    // 正在进行的零拷贝传输, 要等send_buf里排在它前面的回复都发完才能开始
+    Transfer transfer;
+    SubscriberState subscriber;
+
+    // 零拷贝传输的帧头已经在send_buf里了, 传完之前不能再插别的数据
+    bool can_enqueue() const { return !transfer.active(); }
+};
+
+// 每个reactor一个, 不支持发布订阅的后端没有
+using Broker = TopicBroker<Connection>;
+
+// 连接几个超时时间里最早的一个, 0表示没有要检查的超时; reason不为空时返回是哪种超时
+inline uint64_t connection_deadline(const Connection& conn, const char** reason = nullptr) {
+    uint64_t deadline = 0;
+    const char* deadline_reason = nullptr;
+    auto consider = [&](uint64_t since_ms, uint64_t timeout_ms, const char* name) {
+        if (since_ms == 0 || timeout_ms == 0) {
+            return;
+        }
+        uint64_t time = since_ms + timeout_ms;
+        if (deadline == 0 || time < deadline) {
+            deadline = time;
+            deadline_reason = name;
+        }
+    };
+    consider(conn.last_active_ms, server_limits.idle_timeout_ms, "idle");
+    consider(conn.partial_since_ms, server_limits.read_timeout_ms, "read");
+    consider(conn.write_stalled_since_ms, server_limits.write_timeout_ms, "write");
+    if (reason != nullptr) {
+        *reason = deadline_reason;
+    }
+    return deadline;
+}
+
+// 收发之后调用, 超时时间提前了才重新挂定时器; 推后了不用管, 定时器到期时会按最新的时间重新挂
+// 这样正常收发时几乎不用碰时间轮
+inline void update_connection_timer(TimingWheel& timers, Connection& conn) {
+    uint64_t deadline = connection_deadline(conn);
+    if (deadline == 0) {
+        timers.cancel(&conn.timer);
+    } else if (!conn.timer.linked() || deadline < conn.timer.expire_ms) {
+        timers.schedule(&conn.timer, deadline);
+    }
+}
+
+// 定时器到期时调用, 真的超时了返回超时的种类, 要关闭连接; 还没到就按新的超时时间重新挂上, 返回nullptr
+inline const char* check_connection_timeout(TimingWheel& timers, Connection& conn, uint64_t now_ms) {
+    const char* reason = nullptr;
+    uint64_t deadline = connection_deadline(conn, &reason);
+    if (deadline == 0) {
+        return nullptr;
+    }
+    if (deadline <= now_ms) {
+        return reason;
+    }
+    timers.schedule(&conn.timer, deadline);
+    return nullptr;
+}
+
+// 每次尝试发送之后调用, 记录发送队列卡住的时间
+inline void update_write_state(Connection& conn, bool progressed, uint64_t now_ms) {
+    if (progressed) {
+        conn.last_active_ms = now_ms;
+    }
+    if (conn.send_buf.empty()) {
+        conn.write_stalled_since_ms = 0;
+    } else if (progressed || conn.write_stalled_since_ms == 0) {
+        conn.write_stalled_since_ms = now_ms;
+    }
+}
+
+// 按发送队列的长度决定要不要暂停读, read_paused有变化时返回true
+inline bool update_backpressure(Connection& conn, ReactorMetrics& metrics) {
+    size_t queued = conn.send_buf.size();
+    if (!conn.read_paused && server_limits.high_water > 0 && queued >= server_limits.high_water) {
+        conn.read_paused = true;
+        metrics.read_pauses.add();
+        return true;
+    }
+    if (conn.read_paused && !conn.draining && queued <= server_limits.low_water) {
+        conn.read_paused = false;
+        return true;
+    }
+    return false;
+}
+
+// 优雅退出时调用: 回复都发完了就shutdown(SHUT_WR)让对面收到EOF, 之后接着读掉对面的数据直到它关连接
+// 直接close的话对面没读完的数据会让内核回RST, 对面可能连已经收到的回复都读不到
+// 返回true表示这次刚刚shutdown, 后端要重新开始读
+inline bool shut_drained_connection(Connection& conn) {
+    if (conn.write_shut || !conn.send_buf.empty() || conn.transfer.active()) {
+        return false;
+    }
+    shutdown(conn.client_fd, SHUT_WR);
+    conn.write_shut = true;
+    conn.read_paused = false;
+    return true;
+}
+
+// 回一个kError帧
+inline void append_error(Connection& conn, const char* error) {
+    std::string reply;
+    append_frame(reply, Opcode::kError, error, strlen(error));
+    conn.send_buf.append(reply.data(), reply.size());
+}
+
+// 开始把一个还没收全的kBulkEcho帧splice回去
+// 已经收进recv_buf的帧头和开头一段payload照常挂到发送队列上, 剩下的payload留在socket里由后端splice
+inline void start_bulk_echo(Connection& conn, uint32_t payload_len) {
+    size_t buffered = conn.recv_buf.readable();
+    conn.send_buf.append(conn.recv_buf.slice(conn.recv_buf.peek(), buffered));
+    conn.recv_buf.read_pos = conn.recv_buf.write_pos;
+    conn.transfer.kind = TransferKind::kBulkEcho;
+    conn.transfer.remaining = kFrameHeaderSize + payload_len - buffered;
+}
+
+// 处理kServeFile请求, 能打开文件就把帧头放进发送队列, 文件内容由后端sendfile; 打不开就回一个kError帧
+// 返回true表示开始了一次传输
+inline bool start_serve_file(Connection& conn, const Frame& frame) {
+    std::string path(frame.payload, frame.payload_len);
+    std::string error;
+    uint64_t size = 0;
+    int file_fd = open_served_file(path, size, error);
+    if (file_fd == -1) {
+        LOG_WARN("Cannot serve file %s to fd %d: %s", path.c_str(), conn.client_fd, error.c_str());
+        append_error(conn, error.c_str());
+        return false;
+    }
+    char header[kFrameHeaderSize];
+    encode_frame_header(header, Opcode::kServeFile, size);
+    conn.send_buf.append(header, kFrameHeaderSize);
+    conn.transfer.kind = TransferKind::kFile;
+    conn.transfer.remaining = size;
+    conn.transfer.file_fd = file_fd;
+    conn.transfer.file_offset = 0;
+    return true;
+}
+
+// 处理订阅, 退订和发布, broker是nullptr表示后端不支持
+inline void handle_pubsub_frame(Connection& conn, const Frame& frame, Broker* broker, ReactorMetrics& metrics) {
+    if (broker == nullptr) {
+        append_error(conn, "pub/sub is not supported by this backend");
+        return;
+    }
+    const char* frame_begin = frame.payload - kFrameHeaderSize;
+    size_t frame_len = kFrameHeaderSize + frame.payload_len;
+    std::string topic;
+    if (frame.opcode == Opcode::kPublish) {
+        if (!parse_publish(frame.payload, frame.payload_len, topic)) {
+            append_error(conn, "invalid publish frame");
+            return;
+        }
+        // 拷进一块单独的Block, 不直接引用接收缓冲区: 慢订阅者会让发布者整块接收缓冲区一直不能复用
+        BlockPtr block = make_block(frame_len);
+        memcpy(block->data.get(), frame_begin, frame_len);
+        broker->publish(topic, Slice{std::move(block), 0, frame_len, false}, metrics);
+        return;
+    }
+    topic.assign(frame.payload, frame.payload_len);
+    if (topic.empty() || topic.size() > kMaxTopicSize) {
+        append_error(conn, "invalid topic");
+        return;
+    }
+    if (frame.opcode == Opcode::kSubscribe) {
+        if (!broker->subscribe(conn, topic)) {
+            append_error(conn, "too many subscriptions");
+            return;
+        }
+    } else {
+        broker->unsubscribe(conn, topic);
+    }
+    conn.send_buf.append(conn.recv_buf.slice(frame_begin, frame_len));
+}
+
+// 处理recv_buf里所有完整的帧, 回复都追加到send_buf里, 由后端负责发送
+// zero_copy表示后端支持零拷贝传输: 遇到kBulkEcho和kServeFile时开始一次传输并停下, 由后端传完之后再调用
+// 不支持的后端把kBulkEcho当kEcho处理, 对kServeFile回kError; broker是nullptr时对发布订阅的帧回kError
+// 返回false表示要关闭连接
+inline bool handle_frames(Connection& conn, ReactorMetrics& metrics, uint64_t now_ms, bool zero_copy = false,
+                          Broker* broker = nullptr) {
+    Frame frame;
+    ParseResult result = ParseResult::kNeedMore;
+    bool parsed = false;
+    conn.last_active_ms = now_ms;
+    while (!conn.transfer.active() && !conn.draining) {
+        // 大的kBulkEcho帧不等payload收全, 收到帧头就开始splice
+        if (zero_copy && peek_frame_header(conn.recv_buf, frame) == ParseResult::kFrame && frame.opcode == Opcode::kBulkEcho
+            && conn.recv_buf.readable() < kFrameHeaderSize + frame.payload_len) {
+            parsed = true;
+            metrics.messages_in.add();
+            start_bulk_echo(conn, frame.payload_len);
+            break;
+        }
+        if ((result = parse_frame(conn.recv_buf, frame)) != ParseResult::kFrame) {
+            break;
+        }
+        parsed = true;
+        metrics.messages_in.add();
+        if (frame.opcode == Opcode::kEcho || frame.opcode == Opcode::kBulkEcho) {
+            if (log_config.message) {
+                LOG_INFO("received message: %.*s", (int)frame.payload_len, frame.payload);
+            }
+            // 回声帧和收到的帧一模一样, 直接把接收缓冲区里的这一段挂到发送队列上
+            conn.send_buf.append(conn.recv_buf.slice(frame.payload - kFrameHeaderSize, kFrameHeaderSize + frame.payload_len));
+        } else if (frame.opcode == Opcode::kRequest) {
+            // 回复和请求一模一样, 请求id也原样带回去
+            if (frame.payload_len < kRequestIdSize) {
+                result = ParseResult::kError;
+                break;
+            }
+            conn.send_buf.append(conn.recv_buf.slice(frame.payload - kFrameHeaderSize, kFrameHeaderSize + frame.payload_len));
+        } else if (frame.opcode == Opcode::kServeFile) {
+            if (!zero_copy) {
+                append_error(conn, "serve file is not supported by this backend");
+            } else {
+                start_serve_file(conn, frame);
+            }
+        } else if (frame.opcode == Opcode::kSubscribe || frame.opcode == Opcode::kUnsubscribe || frame.opcode == Opcode::kPublish) {
+            handle_pubsub_frame(conn, frame, broker, metrics);
+        } else if (frame.opcode == Opcode::kExit) {
+            return false;
+        } else if (frame.opcode == Opcode::kShutdown) {
+            // 这个连接和其他连接一样排空: 前面的回复发完再关, 后面的帧不再处理
+            LOG_INFO("received shutdown, draining connections");
+            request_drain();
+            conn.draining = true;
+            conn.read_paused = true;
+            break;
+        } else {
+            // kError只有服务器发
+            result = ParseResult::kError;
+            break;
+        }
+    }
+    if (result == ParseResult::kError) {
+        LOG_WARN("Invalid frame from fd %d, disconnect", conn.client_fd);
+        return false;
+    }
+    // 读超时从剩下这半个帧开始等的时候算, 只要这次解析出了完整的帧就重新计时
+    // 传输进行中recv_buf里剩下的是后面完整或者不完整的帧, 传完之后才处理, 不算读超时
+    if (conn.recv_buf.readable() == 0 || conn.transfer.active()) {
+        conn.partial_since_ms = 0;
+    } else if (parsed || conn.partial_since_ms == 0) {
+        conn.partial_since_ms = now_ms;
+    }
+    return true;
+}
+
+#endif
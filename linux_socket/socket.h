@@ -0,0 +1,88 @@
+#ifndef LINUX_SOCKET_SOCKET_H
+#define LINUX_SOCKET_SOCKET_H
+
+// socket fd的RAII包装, 以及阻塞socket上的收发辅助函数
+// 事件循环里的连接由ConnectionTable管理, 不用这个类; 它给主线程, 客户端和测试里那些用完就关的fd用,
+// 出错提前返回时不会漏掉close
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+
+#include "socket_address.h"
+
+class Socket {
+public:
+    Socket() = default;
+    explicit Socket(int fd) : fd_(fd) {}
+    ~Socket() { reset(); }
+
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+    Socket(Socket&& other) noexcept : fd_(other.release()) {}
+    Socket& operator=(Socket&& other) noexcept {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+
+    int get() const { return fd_; }
+    bool valid() const { return fd_ != -1; }
+
+    // 交出fd的所有权, 之后由调用者负责close
+    int release() {
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+
+    // 关掉当前的fd, 换成新的
+    void reset(int fd = -1) {
+        if (fd_ != -1) {
+            close(fd_);
+        }
+        fd_ = fd;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// 阻塞地连接到address, 失败返回无效的Socket, errno是失败的原因
+inline Socket connect_socket(const SocketAddress& address) {
+    Socket sock(socket(address.family(), SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!sock.valid()) {
+        return sock;
+    }
+    while (connect(sock.get(), address.get(), address.len) == -1) {
+        if (errno != EINTR) {
+            int error = errno;
+            sock.reset();
+            errno = error;
+            break;
+        }
+    }
+    return sock;
+}
+
+// 在阻塞socket上把整段数据发完, 被信号打断就接着发
+// 对面关了连接不会收到SIGPIPE, 返回false, errno是失败的原因
+inline bool send_all(int fd, const char* data, size_t len) {
+    size_t sent_len = 0;
+    while (sent_len < len) {
+        ssize_t n = send(fd, data + sent_len, len - sent_len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent_len += n;
+    }
+    return true;
+}
+
+#endif
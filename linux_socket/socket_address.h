@@ -0,0 +1,102 @@
+#ifndef LINUX_SOCKET_SOCKET_ADDRESS_H
+#define LINUX_SOCKET_SOCKET_ADDRESS_H
+
+// IPv4和IPv6通用的地址, 服务器和客户端都用它解析配置里的地址和打印对端地址
+// 地址族由地址本身决定: 0.0.0.0, 127.0.0.1这种是IPv4, ::, ::1这种是IPv6, 其他的当作主机名查一次
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+struct SocketAddress {
+    sockaddr_storage storage{};
+    socklen_t len = 0;
+
+    int family() const { return storage.ss_family; }
+    sockaddr* get() { return (sockaddr*)&storage; }
+    const sockaddr* get() const { return (const sockaddr*)&storage; }
+};
+
+// 把host和port转成地址, 失败返回false
+inline bool resolve_address(const std::string& host, uint16_t port, SocketAddress& address) {
+    address = SocketAddress{};
+    sockaddr_in* v4 = (sockaddr_in*)&address.storage;
+    sockaddr_in6* v6 = (sockaddr_in6*)&address.storage;
+    if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        address.len = sizeof(sockaddr_in);
+        return true;
+    }
+    if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        address.len = sizeof(sockaddr_in6);
+        return true;
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr) {
+        return false;
+    }
+    memcpy(&address.storage, result->ai_addr, result->ai_addrlen);
+    address.len = result->ai_addrlen;
+    freeaddrinfo(result);
+    if (address.family() == AF_INET) {
+        v4->sin_port = htons(port);
+    } else {
+        v6->sin6_port = htons(port);
+    }
+    return true;
+}
+
+// 打印成ip:port, IPv6地址加上方括号
+inline std::string format_address(const sockaddr* addr) {
+    char ip[INET6_ADDRSTRLEN] = "";
+    char text[INET6_ADDRSTRLEN + 16];
+    if (addr->sa_family == AF_INET) {
+        const sockaddr_in* v4 = (const sockaddr_in*)addr;
+        inet_ntop(AF_INET, &v4->sin_addr, ip, sizeof(ip));
+        snprintf(text, sizeof(text), "%s:%u", ip, ntohs(v4->sin_port));
+    } else if (addr->sa_family == AF_INET6) {
+        const sockaddr_in6* v6 = (const sockaddr_in6*)addr;
+        inet_ntop(AF_INET6, &v6->sin6_addr, ip, sizeof(ip));
+        snprintf(text, sizeof(text), "[%s]:%u", ip, ntohs(v6->sin6_port));
+    } else {
+        return "unknown";
+    }
+    return text;
+}
+
+// 已连接socket的对端地址, 查不到返回unknown
+inline std::string peer_address(int fd) {
+    SocketAddress address;
+    address.len = sizeof(address.storage);
+    if (getpeername(fd, address.get(), &address.len) == -1) {
+        return "unknown";
+    }
+    return format_address(address.get());
+}
+
+// socket实际绑定的端口, 监听端口填0让系统挑一个空闲端口时用它查, 查不到返回0
+inline uint16_t local_port(int fd) {
+    SocketAddress address;
+    address.len = sizeof(address.storage);
+    if (getsockname(fd, address.get(), &address.len) == -1) {
+        return 0;
+    }
+    if (address.family() == AF_INET6) {
+        return ntohs(((sockaddr_in6*)&address.storage)->sin6_port);
+    }
+    return ntohs(((sockaddr_in*)&address.storage)->sin_port);
+}
+
+#endif
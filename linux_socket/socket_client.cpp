@@ -5,112 +5,135 @@
 #include <iostream>
 #include <cstring>
 #include <thread>
+#include <string>
+
+#include "load_generator.h"
+#include "protocol.h"
+#include "socket.h"
 
 using std::cout;
 using std::endl;
 
-constexpr uint16_t kPort = 7070;
-constexpr size_t kBufSize = 1024;
-
-bool send_message(const int send_to_fd, const char* message, const char* to_ip, const uint16_t to_port) {
-    ssize_t str_len = strlen(message);
-    ssize_t sent_len = 0;
-    while (sent_len < str_len) {
-        ssize_t tmp_sent_len = send(send_to_fd, message + sent_len, str_len - sent_len, 0);
-        if (tmp_sent_len == -1) {
-            if (errno == EINTR) {
-                // 被系统打断, 啥也没发那就重发
-                continue;
-            } else if (errno == ECONNRESET || errno == EPIPE) {
-                // 没发关闭语句对面就关链接了
-                cout << "Connection closed before sending exit message" << endl;
-                break;
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // 系统资源问题, 稍候尝试重发
-                cout << "Can't send message now, sleep for a while" << endl;
-                std::this_thread::sleep_for(std::chrono::milliseconds(5));
-                continue;
-            } else {
-                // 这是真出错
-                cout << "Failed to send exit message to " << to_ip << ": " << to_port << endl;
-                break;
-            }
-        } else if (tmp_sent_len == 0) {
-            cout << "Sent 0 bytes, should be error occured, stop sending" << endl;
-            break;
-        } else {
-            //剩下的情况就是n > 0了
-            sent_len += tmp_sent_len;
-            continue;
-        }
+// 每次recv最少准备多少字节, 交互模式下回声都很短
+constexpr size_t kRecvChunk = 1024;
+
+int main(int argc, char* argv[]) {
+    // 用法: ./socket_client.out [--host=127.0.0.1] [--port=7070] [--config=FILE]
+    //       ./socket_client.out --bench [--conns=10] [--threads=1] [--size=64] [--pipeline=1] [--duration=10] [--rate=0] [--reconnect]
+    // 不带--bench是交互模式, 一行输入发一条消息, "file 路径"下载服务器--file-root下的文件; 带--bench是压测模式, 参数见--help
+    // --rate大于0时是开环模式, 表示所有连接加起来每秒发多少条
+    // --reconnect是重连风暴模式, 每个连接发一条消息就断开重连, 结果是每秒建立的连接数
+    LoadGenOptions options;
+    bool bench = false;
+    OptionParser parser("Usage: socket_client.out [--bench] [options]");
+    parser.add("bench", &bench, "run the load generator instead of the interactive client");
+    add_load_gen_options(parser, options);
+    if (!parser.parse(argc, argv)) {
+        return 1;
+    }
+    if (bench) {
+        return run_load_generator(options);
     }
-    return sent_len == str_len;
-}
 
-int main() {
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd == -1) {
-        cout << "Failed to create socket" << endl;
+    SocketAddress server_addr;
+    if (!resolve_address(options.host, options.port, server_addr)) {
+        cout << "Invalid address: " << options.host << endl;
         return 1;
     }
-    sockaddr_in server_addr;
-    server_addr.sin_port = htons(kPort);
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr("192.168.121.4");   //测试环境中本机ip就是这个
-
-    if (connect(socket_fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        cout << "Failed to connect to address" << endl;
-        close(socket_fd);
+    std::string peer = format_address(server_addr.get());
+    Socket sock = connect_socket(server_addr);
+    if (!sock.valid()) {
+        cout << "Failed to connect to " << peer << ": " << strerror(errno) << endl;
         return 1;
     }
+    const int socket_fd = sock.get();
 
     bool disconnect = false;
-    char send_buf[kBufSize] = "";
-    char receive_buf[kBufSize] = "";
+    std::string line;
+    std::string frame_buf;
+    RecvBuffer receive_buf;
     while (!disconnect) {
-        memset(send_buf, 0, kBufSize);
-        memset(receive_buf, 0, kBufSize);
         cout << "Message to be sent: ";
-        std::cin.getline(send_buf, sizeof(send_buf));
+        if (!std::getline(std::cin, line)) {
+            // 输入结束了就当作exit
+            line = "exit";
+        }
+
+        // 输入exit和shutdown时发对应的控制帧, "file 路径"向服务器要一个文件, 其他的都当作回声消息
+        Opcode opcode = Opcode::kEcho;
+        std::string payload = line;
+        if (line == "exit") {
+            opcode = Opcode::kExit;
+            payload.clear();
+        } else if (line == "shutdown") {
+            opcode = Opcode::kShutdown;
+            payload.clear();
+        } else if (line.compare(0, 5, "file ") == 0) {
+            opcode = Opcode::kServeFile;
+            payload = line.substr(5);
+        }
+        frame_buf.clear();
+        append_frame(frame_buf, opcode, payload.data(), payload.size());
 
-        if (send_message(socket_fd, send_buf, "192.168.121.4", kPort) == false) {
+        if (!send_all(socket_fd, frame_buf.data(), frame_buf.size())) {
+            cout << "Failed to send message to " << peer << ": " << strerror(errno) << endl;
             disconnect = true;
             break;
         }
 
-        if (strcmp(send_buf, "exit") == 0 || strcmp(send_buf, "shutdown") == 0) {
+        if (opcode == Opcode::kExit || opcode == Opcode::kShutdown) {
             disconnect = true;
             break;
         }
-        
+
+        // 一直收到凑够一整帧为止, TCP可能把回复拆成好几段
+        Frame reply;
+        ParseResult result = ParseResult::kNeedMore;
         ssize_t receive_len = 0;
-        do {
-            receive_len = recv(socket_fd, receive_buf, kBufSize, 0);
-            if (receive_len == -1 && (errno == EINTR || errno == EWOULDBLOCK)) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        while ((result = parse_frame(receive_buf, reply)) == ParseResult::kNeedMore) {
+            // 文件可能很大, 知道帧长之后一次准备好整帧的空间
+            size_t chunk = kRecvChunk;
+            if (peek_frame_header(receive_buf, reply) == ParseResult::kFrame
+                && kFrameHeaderSize + reply.payload_len - receive_buf.readable() > chunk) {
+                chunk = kFrameHeaderSize + reply.payload_len - receive_buf.readable();
             }
-        } while(!disconnect && receive_len == -1 && (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK));
-        
-        if (receive_len == -1 && (errno == EPIPE || errno == ECONNRESET)) {
-            cout << "Disconnected before receiving anything" << endl;
-        } else if (receive_len == 0) {
-            cout << "received nothing, maybe error occured, disconnect" << endl;
-        } else if (receive_len == -1) {
-            cout << "Other error occured" << endl;
-        }
+            char* buf = receive_buf.prepare(chunk);
+            do {
+                receive_len = recv(socket_fd, buf, receive_buf.writable(), 0);
+            } while (receive_len == -1 && errno == EINTR);
 
-        if (receive_len <= 0) {
-            disconnect = true;
+            if (receive_len == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+                cout << "Disconnected before receiving anything" << endl;
+            } else if (receive_len == 0) {
+                cout << "received nothing, maybe error occured, disconnect" << endl;
+            } else if (receive_len == -1) {
+                cout << "Other error occured" << endl;
+            }
+
+            if (receive_len <= 0) {
+                disconnect = true;
+                break;
+            }
+            receive_buf.commit(receive_len);
         }
 
         if (disconnect) {
             break;
         }
-        
-        cout << "Received reply: " << receive_buf << endl;
+        if (result == ParseResult::kError) {
+            cout << "Received invalid frame, disconnect" << endl;
+            break;
+        }
+
+        if (reply.opcode == Opcode::kError) {
+            cout << "Server error: " << std::string(reply.payload, reply.payload_len) << endl;
+        } else if (reply.opcode == Opcode::kServeFile) {
+            cout << "Received file: " << reply.payload_len << " bytes" << endl;
+        } else {
+            cout << "Received reply: " << std::string(reply.payload, reply.payload_len) << endl;
+        }
     }
 
     cout << "closing client" << endl;
-    close(socket_fd);
     return 0;
 }
\ No newline at end of file
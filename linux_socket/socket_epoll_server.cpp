@@ -1,228 +1,291 @@
 #include <sys/socket.h>
-#include <sys/epoll.h>
-#include <unistd.h>
-#include <arpa/inet.h>
 #include <fcntl.h>
+#include <unistd.h>
 
-#include <iostream>
 #include <string>
-#include <unordered_map>
-#include <queue>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 
-using std::unordered_map;
-using std::queue;
-using std::string;
-using std::cout;
-using std::endl;
+#include "config.h"
+#include "epoll_reactor.h"
+#include "hot_restart.h"
+#include "logger.h"
+#include "server_common.h"
+#include "udp_server.h"
+#include "uring_reactor.h"
 
-constexpr uint16_t kPort = 7070;
-constexpr size_t kBufSize = 1024;
+using std::string;
+using std::vector;
 
-struct ClientInfo {
-    ClientInfo() : client_fd(-1), recv_buf("") {}
-    ClientInfo(int fd) : client_fd(fd), recv_buf("") {}
+// 多个reactor线程跑同一个事件循环, 只有一个时直接在主线程跑
+// admin_fd不是-1时另开一个管理线程, 在上面回答指标查询
+template <typename ReactorType>
+void run_reactors(vector<ReactorType>& reactors, void (*run)(ReactorType&), int admin_fd) {
+    std::thread admin_thread;
+    if (admin_fd != -1) {
+        vector<const ReactorMetrics*> metrics;
+        for (const ReactorType& reactor : reactors) {
+            metrics.push_back(&reactor.metrics);
+        }
+        admin_thread = std::thread(run_admin_server, admin_fd, std::move(metrics), std::cref(shutdown_server));
+    }
+    if (reactors.size() == 1) {
+        run(reactors[0]);
+    } else {
+        vector<std::thread> threads;
+        for (ReactorType& reactor : reactors) {
+            threads.emplace_back(run, std::ref(reactor));
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+    // 所有reactor都排空退出了, 让管理线程和交接线程也退出
+    shutdown_server = true;
+    if (admin_thread.joinable()) {
+        admin_thread.join();
+    }
+}
 
-    int client_fd;
-    string recv_buf;
-    queue<string> send_buf;
+// 热重启用到的状态, 两种后端共用
+struct Handoff {
+    std::string path;
+    // 从旧进程接过来的监听socket, 按顺序分给各个reactor
+    vector<int> inherited_fds;
+    // 连着旧进程, 准备好之后回确认
+    int peer_fd = -1;
+    int handoff_fd = -1;
+    std::atomic<bool> handed_off{false};
+    std::thread thread;
 };
 
-unordered_map<int, ClientInfo> clients;
-
-int main() {
-    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (listen_fd == -1) {
-        cout << "Failed to create socket" << endl;
-        return 1;
+// 初始化reactor失败时关掉还没分出去的监听socket和旧进程的连接, 旧进程收不到确认会继续服务
+void abort_handoff(Handoff& handoff, size_t used) {
+    for (size_t i = used; i < handoff.inherited_fds.size(); i++) {
+        close(handoff.inherited_fds[i]);
+    }
+    if (handoff.peer_fd != -1) {
+        close(handoff.peer_fd);
     }
+}
 
-    int reuse = 1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
-        cout << "Failed to set socket" << endl;
-        return 1;
+// reactor都初始化好之后调用: 在handoff路径上建自己的交接socket, 告诉旧进程可以退出了, 再开交接线程等下一次部署
+template <typename ReactorType>
+bool start_handoff(Handoff& handoff, const vector<ReactorType>& reactors) {
+    if (handoff.path.empty()) {
+        return true;
     }
+    handoff.handoff_fd = create_handoff_fd(handoff.path.c_str());
+    if (handoff.handoff_fd == -1) {
+        abort_handoff(handoff, handoff.inherited_fds.size());
+        return false;
+    }
+    if (handoff.peer_fd != -1 && !send_handoff_ack(handoff.peer_fd)) {
+        LOG_WARN("Failed to confirm the handoff, the old process keeps its connections");
+    }
+    vector<int> listen_fds;
+    for (const ReactorType& reactor : reactors) {
+        listen_fds.push_back(fcntl(reactor.listen_fd, F_DUPFD_CLOEXEC, 0));
+    }
+    handoff.thread = std::thread(run_handoff_server, handoff.handoff_fd, std::move(listen_fds), std::ref(handoff.handed_off));
+    LOG_INFO("Hot restart available on unix socket %s", handoff.path.c_str());
+    return true;
+}
 
-    sockaddr_in server_addr{};
-    server_addr.sin_port = htons(kPort);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_family = AF_INET;
+// 交接出去之后socket文件已经归新进程, 不能删
+void finish_handoff(Handoff& handoff) {
+    if (handoff.thread.joinable()) {
+        handoff.thread.join();
+    }
+    if (handoff.handoff_fd != -1) {
+        close(handoff.handoff_fd);
+        if (!handoff.handed_off) {
+            unlink(handoff.path.c_str());
+        }
+    }
+}
 
-    if (bind(listen_fd, (sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        cout << "Failed to bind socket with address" << endl;
+int main(int argc, char* argv[]) {
+    // 用法: ./socket_epoll_server.out [reactor数量] [--config=FILE] [--name=value ...], 所有参数见--help
+    // 不传reactor数量就是原来的单线程模式, 传0表示按CPU核数开; --et表示用边缘触发模式
+    // --uring表示用io_uring后端代替epoll, 两者的协议处理完全一样, 方便在同样的负载下对比
+    // --admin=PATH在这个Unix域socket上提供Prometheus格式的运行指标
+    // --udp表示改成UDP回声服务器, 每个reactor一个SO_REUSEPORT的UDP socket, 用recvmmsg/sendmmsg成批收发
+    // --handoff=PATH开启热重启: 新进程用同样的参数启动, 从PATH上的旧进程接过监听socket, 旧进程排空后退出
+    // --conn-rate-bytes等参数给每个连接和整个服务器限速, 只有epoll后端支持; --write-quantum让各连接轮流发送
+    // SIGTERM/SIGINT或者shutdown帧让服务器停止accept, 把已有连接上的回复发完再退出, 最多等--drain-timeout
+    int reactor_num = 1;
+    bool edge_triggered = false;
+    bool use_uring = false;
+    bool use_udp = false;
+    std::string admin_option;
+    Handoff handoff;
+    OptionParser parser("Usage: socket_epoll_server.out [reactor num] [options]");
+    parser.set_positional([&reactor_num](const char* arg) { return parse_config_value(arg, reactor_num); });
+    parser.add("reactors", &reactor_num, "reactor threads, 0 for one per CPU");
+    parser.add("et", &edge_triggered, "use edge triggered epoll");
+    parser.add("uring", &use_uring, "use the io_uring backend instead of epoll");
+    parser.add("udp", &use_udp, "serve udp datagram echo instead of tcp");
+    parser.add("admin", &admin_option, "serve metrics on this unix socket");
+    parser.add("handoff", &handoff.path, "hot restart: take over and later hand over listen sockets through this unix socket");
+    add_epoll_options(parser);
+    add_rate_limit_options(parser);
+    add_uring_options(parser);
+    add_udp_options(parser);
+    add_server_options(parser);
+    add_pubsub_options(parser);
+    if (!parser.parse(argc, argv) || !finish_server_options()) {
         return 1;
     }
-
-    listen(listen_fd, SOMAXCONN);
-    cout << "Listening" << endl;
-
-    int epfd = epoll_create1(0);
-    if (epfd == -1) {
-        cout << "Failed to create epfd" << endl;
+    // 对面关了连接时splice和sendfile会触发SIGPIPE, 它们不能像send一样带MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+    if (!check_epoll_options()) {
+        fprintf(stderr, "Invalid epoll options\n");
         return 1;
     }
-
-    epoll_event ev, events[20];
-    ev.data.fd = listen_fd;
-    ev.events = EPOLLIN;
-
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
-        cout << "Failed to add listen_fd to epoll ev" << endl;
-        close (listen_fd);
-        close(epfd);
+    if (!check_rate_limit_options()) {
+        fprintf(stderr, "Invalid rate limit options\n");
         return 1;
     }
+    if ((use_uring || use_udp) && rate_limit_enabled()) {
+        // 限速靠摘掉EPOLLIN暂停读, 只有epoll后端实现了
+        fprintf(stderr, "Rate limits are only supported by the epoll backend\n");
+        return 1;
+    }
+    if (!check_udp_options()) {
+        fprintf(stderr, "Invalid udp options\n");
+        return 1;
+    }
+    if (use_udp && !handoff.path.empty()) {
+        // 交接协议传的是TCP监听socket
+        fprintf(stderr, "Hot restart is not supported in udp mode\n");
+        return 1;
+    }
+    if (!init_drain_event()) {
+        fprintf(stderr, "Failed to create drain event: %s\n", strerror(errno));
+        return 1;
+    }
+    install_stop_signals();
+    if (reactor_num <= 0) {
+        reactor_num = std::thread::hardware_concurrency();
+    }
+    if (reactor_num <= 0) {
+        reactor_num = 1;
+    }
+    const char* admin_path = admin_option.c_str();
 
-    bool shutdown = false;
+    // 作用域结束时把没写完的日志写完
+    ScopedLogger logger;
 
-    cout << "Epoll fd created" << endl;
-    while (!shutdown) {
-        int num_of_fds = epoll_wait(epfd, events, 20, 5000);
-        if (num_of_fds == -1) {
-            perror("Failed to wait epoll events");
-            close(epfd);
-            close(listen_fd);
+    // 有旧进程就用它的监听socket, 它的reactor数量决定了这边的数量
+    if (!handoff.path.empty()) {
+        if (!take_over_listen_fds(handoff.path.c_str(), handoff.inherited_fds, handoff.peer_fd)) {
             return 1;
-        } else if (num_of_fds == 0) {
-            cout << "";
-        } else {
-            for (int i = 0; i < num_of_fds; i++) {
-                if (events[i].data.fd == listen_fd) {
-                    // 服务器fd发现有新的链接
-                    sockaddr_in client_addr;
-                    socklen_t len = sizeof(client_addr);
-                    int client_fd = accept(listen_fd, (sockaddr*)&client_addr, &len);
-                    if (client_fd == -1) {
-                        cout << "Failed to accept client" << endl;
-                        // 这个client连接不了但是其他已连接的client还要管的嘛
-                        continue;
-                    } else {
-                        int flags = fcntl(client_fd, F_GETFL, 0);
-                        if (flags == -1) {
-                            cout << "Failed to get fd flags, discard client" << endl;
-                            close(client_fd);
-                            continue;
-                        }
-                        if (fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-                            cout << "Failed to set non block, discard client" << endl;
-                            close (client_fd);
-                            continue;
-                        }
+        }
+        if (!handoff.inherited_fds.empty()) {
+            LOG_INFO("Taking over %zu listen sockets from %s", handoff.inherited_fds.size(), handoff.path.c_str());
+            reactor_num = handoff.inherited_fds.size();
+        }
+    }
 
-                        char client_ip[INET_ADDRSTRLEN] = "";
-                        inet_ntop(AF_INET, &client_addr.sin_addr.s_addr, client_ip, INET_ADDRSTRLEN);
-                        cout << client_ip << ": " << ntohs(client_addr.sin_port) << " connected" << endl;
-                        epoll_event client_ev;
-                        client_ev.data.fd = client_fd;
-                        client_ev.events = EPOLLIN;
-                        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &client_ev) == -1) {
-                            cout << "Failed to add client_fd to epoll, discard client" << endl;
-                            close(client_fd);
-                            if (errno == EPERM || errno == ENOENT || errno == EEXIST) {
-                                continue;
-                            } else {
-                                cout << "Error, shuting down server" << endl;
-                                shutdown = true;
-                                break;
-                            }
-                        }
-                        clients.insert({client_fd, ClientInfo(client_fd)});
-                    }
-                    
-                } else {
-                    // 改个别名方便理解
-                    epoll_event& client_event = events[i];
-                    const int& client_fd = client_event.data.fd;
-                    if (client_event.events & EPOLLIN) {
-                        //读取信息部分
-                        char buf[kBufSize] = "";
-                        int recv_len = 0;
-                        do {
-                            recv_len = recv(client_fd, buf, kBufSize, 0);
-                            // 如果有中断导致什么都没读, 那就立即重读
-                        } while (recv_len == -1 && (errno == EINTR));
+    int admin_fd = -1;
+    if (!admin_option.empty()) {
+        admin_fd = create_admin_fd(admin_path);
+        if (admin_fd == -1) {
+            abort_handoff(handoff, 0);
+            return 1;
+        }
+        LOG_INFO("Metrics available on unix socket %s", admin_path);
+    }
 
-                        if (recv_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                            // 没任何信息可读, 直接处理下一个fd
-                            continue;
-                        } else if (recv_len > 0) {
-                            string recv_message(buf, recv_len);
-                            cout << "received message: " << recv_message << endl;
-                            if (recv_message == "exit") {
-                                epoll_ctl(epfd, EPOLL_CTL_DEL, client_fd, &client_event);
-                                close(client_fd);
-                                clients.erase(client_fd);
-                            } else {
-                                // 直接压入send_buf是因为还没上协议，传的是裸字符串流
-                                clients[client_fd].send_buf.push(recv_message);
-                                if (!(client_event.events & EPOLLOUT)) {
-                                    client_event.events |= EPOLLOUT;
-                                    epoll_ctl(epfd, EPOLL_CTL_MOD, client_fd, &client_event);
-                                }
-                            }
-                        }
-                    }
-                    
-                    // 条件保证client没发close过来而下线, 以及client是可写的
-                    if (clients.count(client_fd) && (client_event.events & EPOLLOUT)) {
-                        //传送信息部分
-                        if (clients[client_fd].send_buf.empty()) {
-                            // 其实是发送缓存是空的, 没东西要发的
-                            client_event.events = EPOLLIN;
-                            epoll_ctl(epfd, EPOLL_CTL_MOD, client_fd, &client_event);
-                        } else {
-                            string& message = clients[client_fd].send_buf.front();
-                            int sent_len = 0;
-                            size_t send_len = message.length();
-                            while (sent_len < send_len) {
-                                ssize_t tmp_len = send(client_fd, message.data() + sent_len, send_len - sent_len, 0);
-                                if (tmp_len == -1) { 
-                                    if(errno == EAGAIN || errno == EWOULDBLOCK) {
-                                        // 因为前面用的是引用, 会直接修改queue中的数据的
-                                        message = message.substr(sent_len);
-                                        break;
-                                    } else if (errno == EINTR) {
-                                        continue;
-                                    } else {
-                                        // 发生严重错误, 直接退出链接
-                                        cout << "Error occur when sending message, disconnect" << endl;
-                                        epoll_ctl(epfd, EPOLL_CTL_DEL, client_fd, nullptr);
-                                        close(client_fd);
-                                        clients.erase(client_fd);
-                                        break;
-                                    }
-                                } else if (tmp_len == 0) {
-                                    // 发生严重错误, 直接退出链接
-                                    cout << "Error occur when sending message, disconnect";
-                                    epoll_ctl(epfd, EPOLL_CTL_DEL, client_fd, nullptr);
-                                    close(client_fd);
-                                    clients.erase(client_fd);
-                                    break;
-                                } else {
-                                    sent_len += tmp_len;
-                                }
-                            }
-                            if (send_len == sent_len) {
-                                clients[client_fd].send_buf.pop();
-                                if (clients[client_fd].send_buf.empty()) {
-                                    client_event.events = EPOLLIN;
-                                    epoll_ctl(epfd, EPOLL_CTL_MOD, client_fd, &client_event);
-                                }
-                            }
-                        }
-                        
-                    }
+    // 先把所有listen_fd都建好再开线程, 这样某个端口绑定失败时可以直接退出
+    bool reuse_port = reactor_num > 1;
+    if (use_udp) {
+        vector<UdpReactor> reactors(reactor_num);
+        for (int i = 0; i < reactor_num; i++) {
+            reactors[i].id = i;
+            reactors[i].fd = create_udp_fd(reuse_port);
+            if (reactors[i].fd == -1) {
+                for (int j = 0; j < i; j++) {
+                    close(reactors[j].fd);
                 }
+                close_admin_fd(admin_fd, admin_path);
+                return 1;
             }
         }
-        
+        LOG_INFO("Listening on %s udp port %u, reactor num: %d, batch %d%s%s", socket_options.address.c_str(),
+                 local_port(reactors[0].fd), reactor_num, udp_options.batch, udp_options.gso ? ", gso" : "",
+                 udp_options.gro ? ", gro" : "");
+        run_reactors(reactors, run_udp_reactor, admin_fd);
+        close_admin_fd(admin_fd, admin_path);
+        LOG_INFO("server shutdown");
+        return 0;
+    }
+    if (use_uring) {
+        vector<UringReactor> reactors(reactor_num);
+        for (int i = 0; i < reactor_num; i++) {
+            reactors[i].id = i;
+            // io_uring自己会在没数据时挂起请求, 监听socket用阻塞的就行; 接过来的socket是不是阻塞的都可以
+            reactors[i].listen_fd =
+                handoff.inherited_fds.empty() ? create_listen_fd(reuse_port, false) : handoff.inherited_fds[i];
+            if (reactors[i].listen_fd == -1) {
+                for (int j = 0; j < i; j++) {
+                    close(reactors[j].listen_fd);
+                }
+                close_admin_fd(admin_fd, admin_path);
+                return 1;
+            }
+        }
+        if (!start_handoff(handoff, reactors)) {
+            for (UringReactor& reactor : reactors) {
+                close(reactor.listen_fd);
+            }
+            close_admin_fd(admin_fd, admin_path);
+            return 1;
+        }
+        LOG_INFO("Listening on %s port %u, io_uring backend, reactor num: %d", socket_options.address.c_str(),
+                 local_port(reactors[0].listen_fd), reactor_num);
+        run_reactors(reactors, run_uring_reactor, admin_fd);
+        finish_handoff(handoff);
+        close_admin_fd(admin_fd, handoff.handed_off ? nullptr : admin_path);
+        LOG_INFO("server shutdown");
+        return 0;
     }
 
-    unordered_map<int, ClientInfo>::iterator iter = clients.begin();
-    while (iter != clients.end()) {
-        close(iter->first);
-        iter++;
+    vector<Reactor> reactors(reactor_num);
+    for (int i = 0; i < reactor_num; i++) {
+        reactors[i].id = i;
+        reactors[i].edge_triggered = edge_triggered;
+        reactors[i].reactor_count = reactor_num;
+        if (!init_reactor(reactors[i], reuse_port, handoff.inherited_fds.empty() ? -1 : handoff.inherited_fds[i])) {
+            for (int j = 0; j < i; j++) {
+                close(reactors[j].listen_fd);
+                close(reactors[j].epfd);
+            }
+            abort_handoff(handoff, i + 1);
+            close_admin_fd(admin_fd, admin_path);
+            return 1;
+        }
+    }
+    if (!start_handoff(handoff, reactors)) {
+        for (Reactor& reactor : reactors) {
+            close(reactor.listen_fd);
+            close(reactor.epfd);
+        }
+        close_admin_fd(admin_fd, admin_path);
+        return 1;
     }
-    close(listen_fd);
-    close(epfd);
+    connect_brokers(reactors);
+    LOG_INFO("Listening on %s port %u, epoll backend, reactor num: %d%s", socket_options.address.c_str(),
+             local_port(reactors[0].listen_fd), reactor_num, edge_triggered ? ", edge triggered" : "");
+    run_reactors(reactors, run_reactor, admin_fd);
+    finish_handoff(handoff);
+    close_admin_fd(admin_fd, handoff.handed_off ? nullptr : admin_path);
+    LOG_INFO("server shutdown");
     return 0;
-}
\ No newline at end of file
+}
@@ -1,168 +1,437 @@
 // 参考资料
 // https://zongxp.blog.csdn.net/article/details/123845651
 
+// 阻塞IO + 线程池的服务器, 作为epoll服务器的对照
+// 主线程阻塞在accept上, 新连接放进队列; 每个工作线程从队列里取一个连接, 用阻塞的recv/send服务到它断开为止
+// 同时能服务的连接数就是线程数, 多出来的连接在队列里排队, 队列也满了就直接关掉
+// 优雅退出时主线程不再accept, 每个工作线程把手上连接的回复发完后shutdown写端, 等对面关掉
+
 #include <sys/socket.h>
+#include <poll.h>
 #include <unistd.h>          //for close(fd)
 #include <netinet/in.h>     //for sockaddr_in
 #include <arpa/inet.h>      //for htons()
-#include <fcntl.h>
 
-#include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstring>
+#include <deque>
+#include <mutex>
 #include <thread>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "logger.h"
+#include "protocol.h"
+#include "server_common.h"
+#include "socket.h"
+#include "zero_copy.h"
+
+// 线程池的参数, 启动时设置好, 之后只读
+struct ThreadServerOptions {
+    // 工作线程数, 也就是最多同时服务多少个连接
+    int workers = 64;
+    // 每次recv最多收多少字节
+    size_t read_chunk = 16 * 1024;
+    // 等待工作线程的连接最多排多少个
+    size_t max_pending = 1024;
+};
+
+ThreadServerOptions thread_server_options;
+
+// 把回复发完, 失败时按原因打日志
+bool send_reply(int client_fd, const std::string& reply, const std::string& peer) {
+    if (send_all(client_fd, reply.data(), reply.size())) {
+        return true;
+    }
+    if (errno == ECONNRESET || errno == EPIPE) {
+        // 没发完对面就关链接了
+        LOG_WARN("Connection closed before sending message to %s", peer.c_str());
+    } else {
+        LOG_WARN("Failed to send message to %s: %s", peer.c_str(), strerror(errno));
+    }
+    return false;
+}
+
+// 已经accept但还没有工作线程接手的连接
+class ClientQueue {
+public:
+    // 队列满了返回false, 由调用者关掉连接
+    bool push(int client_fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || clients_.size() >= thread_server_options.max_pending) {
+            return false;
+        }
+        clients_.push_back(client_fd);
+        cond_.notify_one();
+        return true;
+    }
+
+    // 阻塞到有连接或者队列被关闭, 关闭后返回-1
+    int pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return closed_ || !clients_.empty(); });
+        if (clients_.empty()) {
+            return -1;
+        }
+        int client_fd = clients_.front();
+        clients_.pop_front();
+        return client_fd;
+    }
+
+    // 不再接收新连接, 唤醒所有等着的工作线程, 还在排队的连接直接关掉
+    void close_all() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        for (int client_fd : clients_) {
+            close(client_fd);
+        }
+        clients_.clear();
+        cond_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<int> clients_;
+    bool closed_ = false;
+};
+
+// 所有工作线程正在服务的连接, 关服务器时要把阻塞在recv上的线程叫醒
+class ActiveClients {
+public:
+    void add(int client_fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.insert(client_fd);
+    }
+
+    // 摘掉之后再close, 和shutdown_all互斥, 保证不会shutdown到一个被复用的fd
+    void close_client(int client_fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.erase(client_fd);
+        close(client_fd);
+        if (clients_.empty()) {
+            cond_.notify_all();
+        }
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return clients_.size();
+    }
+
+    // 等到所有连接都关掉, 超时返回false
+    bool wait_empty(uint64_t timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return clients_.empty(); });
+    }
+
+    void shutdown_all() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int client_fd : clients_) {
+            shutdown(client_fd, SHUT_RDWR);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::unordered_set<int> clients_;
+};
+
+struct ThreadServer {
+    Socket listen_socket;
+    ClientQueue queue;
+    ActiveClients active;
+};
+
+// 收到shutdown时调用, 叫醒阻塞在accept上的主线程和阻塞在recv上的工作线程
+void stop_server(ThreadServer& server) {
+    shutdown_server = true;
+    // 对监听socket做shutdown会让阻塞着的accept返回EINVAL
+    shutdown(server.listen_socket.get(), SHUT_RDWR);
+    server.queue.close_all();
+    server.active.shutdown_all();
+}
+
+// 优雅退出: 不再accept, 还在排队的连接直接关掉, 正在服务的连接由工作线程自己收尾, 超时就强制关掉
+void drain_thread_server(ThreadServer& server) {
+    server.listen_socket.reset();
+    server.queue.close_all();
+    LOG_INFO("draining %zu connections", server.active.size());
+    if (!server.active.wait_empty(server_limits.drain_timeout_ms)) {
+        LOG_WARN("drain timed out, closing remaining connections");
+    }
+    stop_server(server);
+}
 
-using std::cout;
-using std::endl;
+// 优雅退出时工作线程对自己的连接调用, 回复都已经发完了
+// 先shutdown写端让对面收到EOF, 再读掉对面还在发的数据直到它关连接; 直接close的话没读的数据会让内核回RST
+// 超时的时候主线程的stop_server会把这里的recv叫醒
+void finish_drained_client(int client_fd) {
+    shutdown(client_fd, SHUT_WR);
+    char discard[4096];
+    while (true) {
+        ssize_t len = recv(client_fd, discard, sizeof(discard), 0);
+        if (len > 0 || (len == -1 && errno == EINTR)) {
+            continue;
+        }
+        return;
+    }
+}
+
+// 把socket上接下来的remaining字节经过pipe splice回去, 阻塞的socket上一直搬到搬完
+bool relay_bulk(int client_fd, Pipe& pipe, uint64_t remaining, const std::string& peer) {
+    if (!pipe.open()) {
+        LOG_WARN("Failed to create pipe for %s: %s", peer.c_str(), strerror(errno));
+        return false;
+    }
+    TransferProgress progress;
+    while (remaining > 0 || pipe.buffered > 0) {
+        if (!splice_relay(client_fd, client_fd, pipe, remaining, 0, progress)) {
+            LOG_WARN("Failed to relay bulk payload to %s: %s", peer.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+// 回复一个kServeFile请求, 文件内容用sendfile直接发出去, 打不开文件时回kError
+bool serve_file(int client_fd, const Frame& frame, const std::string& peer) {
+    std::string path(frame.payload, frame.payload_len);
+    std::string error;
+    uint64_t size = 0;
+    int file_fd = open_served_file(path, size, error);
+    if (file_fd == -1) {
+        LOG_WARN("Cannot serve file %s to %s: %s", path.c_str(), peer.c_str(), error.c_str());
+        std::string reply;
+        append_frame(reply, Opcode::kError, error.data(), error.size());
+        return send_reply(client_fd, reply, peer);
+    }
+    std::string header(kFrameHeaderSize, '\0');
+    encode_frame_header(&header[0], Opcode::kServeFile, size);
+    bool ok = send_reply(client_fd, header, peer);
+    off_t offset = 0;
+    TransferProgress progress;
+    while (ok && size > 0) {
+        if (!send_file_chunk(client_fd, file_fd, offset, size, progress)) {
+            LOG_WARN("Failed to send file %s to %s: %s", path.c_str(), peer.c_str(), strerror(errno));
+            ok = false;
+        }
+    }
+    close(file_fd);
+    return ok;
+}
 
-constexpr uint16_t kPort = 7070;
-constexpr size_t kBufSize = 1024;
+// 用阻塞IO服务一个连接直到它断开, 每收一批数据里的所有帧合起来回复一次
+void serve_client(int client_fd) {
+    std::string peer = peer_address(client_fd);
+    if (log_config.accept) {
+        LOG_INFO("Client connected, IP address and port is: %s", peer.c_str());
+    }
 
-bool send_message(const int send_to_fd, const char* message, const char* to_ip, const uint16_t to_port) {
-    ssize_t str_len = strlen(message);
-    ssize_t sent_len = 0;
-    while (sent_len < str_len) {
-        ssize_t tmp_sent_len = send(send_to_fd, message + sent_len, str_len - sent_len, 0);
-        if (tmp_sent_len == -1) {
+    RecvBuffer recv_buf;
+    std::string reply;
+    // bulk echo用的pipe, 第一次用到时才创建
+    Pipe pipe;
+    bool disconnect = false;
+    while (!disconnect && !shutdown_server.load(std::memory_order_relaxed)) {
+        // 连同drain_event_fd一起等, 它一旦被写过就一直可读, 所有工作线程都能看到
+        pollfd fds[2] = {{client_fd, POLLIN, 0}, {drain_event_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
             if (errno == EINTR) {
-                // 被系统打断, 啥也没发那就重发
                 continue;
-            } else if (errno == ECONNRESET || errno == EPIPE) {
-                // 没发关闭语句对面就关链接了
-                cout << "Connection closed before sending exit message" << endl;
+            }
+            LOG_WARN("Failed to poll client, disconnect: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            finish_drained_client(client_fd);
+            break;
+        }
+        // 先接收信息, 直接收到recv_buf尾部, 有数据了才会走到这里
+        char* buf = recv_buf.prepare(thread_server_options.read_chunk);
+        ssize_t recv_len = recv(client_fd, buf, recv_buf.writable(), 0);
+        if (recv_len == -1 && errno == EINTR) {
+            // 被中断, 直接下一个循环
+            continue;
+        } else if (recv_len == 0) {
+            // 对面关了连接
+            break;
+        } else if (recv_len == -1) {
+            // 接收失败, 跳出循环去disconnect
+            LOG_WARN("Failed to recieve package, disconnect: %s", strerror(errno));
+            break;
+        }
+        recv_buf.commit(recv_len);
+
+        // 一次可能收到好几帧, 也可能只有半帧, 能取多少取多少
+        reply.clear();
+        Frame frame;
+        ParseResult result = ParseResult::kNeedMore;
+        while (!disconnect) {
+            // 没收全的kBulkEcho帧: 已经收到的部分连同前面攒的回复先发出去, 剩下的payload直接从socket splice回socket
+            if (peek_frame_header(recv_buf, frame) == ParseResult::kFrame && frame.opcode == Opcode::kBulkEcho
+                && recv_buf.readable() < kFrameHeaderSize + frame.payload_len) {
+                uint64_t remaining = kFrameHeaderSize + frame.payload_len - recv_buf.readable();
+                reply.append(recv_buf.peek(), recv_buf.readable());
+                recv_buf.read_pos = recv_buf.write_pos;
+                if (!send_reply(client_fd, reply, peer) || !relay_bulk(client_fd, pipe, remaining, peer)) {
+                    disconnect = true;
+                }
+                reply.clear();
                 break;
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // 系统资源问题, 稍候尝试重发
-                cout << "Can't send message now, sleep for a while" << endl;
-                std::this_thread::sleep_for(std::chrono::milliseconds(5));
-                continue;
+            }
+            if ((result = parse_frame(recv_buf, frame)) != ParseResult::kFrame) {
+                break;
+            }
+            if (frame.opcode == Opcode::kExit) {
+                const char exit_str[] = "disconnected";
+                append_frame(reply, Opcode::kEcho, exit_str, strlen(exit_str));
+                disconnect = true;
+            } else if (frame.opcode == Opcode::kShutdown) {
+                const char shutdown_str[] = "server shuting down";
+                append_frame(reply, Opcode::kEcho, shutdown_str, strlen(shutdown_str));
+                send_reply(client_fd, reply, peer);
+                reply.clear();
+                LOG_INFO("received shutdown, draining connections");
+                request_drain();
+                // 后面的帧不再处理, 下一轮poll会看到drain_event_fd
+                break;
+            } else if (frame.opcode == Opcode::kServeFile) {
+                // 文件内容要跟在前面的回复后面
+                if (!send_reply(client_fd, reply, peer) || !serve_file(client_fd, frame, peer)) {
+                    disconnect = true;
+                }
+                reply.clear();
+            } else if (frame.opcode == Opcode::kEcho || frame.opcode == Opcode::kBulkEcho) {
+                if (log_config.message) {
+                    LOG_INFO("Recieved package, message is: %.*s", (int)frame.payload_len, frame.payload);
+                }
+                append_frame(reply, frame.opcode, frame.payload, frame.payload_len);
+            } else if (frame.opcode == Opcode::kRequest) {
+                // 回复带着同样的请求id
+                if (frame.payload_len < kRequestIdSize) {
+                    result = ParseResult::kError;
+                    break;
+                }
+                append_frame(reply, frame.opcode, frame.payload, frame.payload_len);
+            } else if (frame.opcode == Opcode::kSubscribe || frame.opcode == Opcode::kUnsubscribe
+                       || frame.opcode == Opcode::kPublish) {
+                // 每个连接一个线程, 没有能扇出消息的事件循环
+                const char unsupported_str[] = "pub/sub is not supported by this backend";
+                append_frame(reply, Opcode::kError, unsupported_str, strlen(unsupported_str));
             } else {
-                // 这是真出错
-                cout << "Failed to send exit message to " << to_ip << ": " << to_port << endl;
+                // kError只有服务器发
+                result = ParseResult::kError;
                 break;
             }
-        } else if (tmp_sent_len == 0) {
-            cout << "Sent 0 bytes, should be error occured, stop sending" << endl;
-            break;
-        } else {
-            //剩下的情况就是n > 0了
-            sent_len += tmp_sent_len;
-            continue;
+        }
+        if (result == ParseResult::kError) {
+            LOG_WARN("Recieved invalid frame, disconnect");
+            disconnect = true;
+        }
+        if (!reply.empty() && !send_reply(client_fd, reply, peer)) {
+            disconnect = true;
         }
     }
-    return sent_len == str_len;
+    if (log_config.accept) {
+        LOG_INFO("%s disconnected", peer.c_str());
+    }
 }
 
-int main() {
-    // 先创建一个socket_fd
-    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (socket_fd == -1) {
-        cout << "Failed to created socket" << endl;
-        return 1;
+void run_worker(ThreadServer& server) {
+    while (true) {
+        int client_fd = server.queue.pop();
+        if (client_fd == -1) {
+            return;
+        }
+        server.active.add(client_fd);
+        // 加进active之前可能已经开始关服务器了, 这种连接不用服务
+        if (!shutdown_server.load()) {
+            serve_client(client_fd);
+        }
+        server.active.close_client(client_fd);
     }
+}
 
-    // 可选, 设置socket选项, 这里是设为可重用地址
-    int reuse = 1;
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
-        cout << "Failed to set socket option" << endl;
-        close(socket_fd);
+int main(int argc, char* argv[]) {
+    // 用法: ./socket_server.out [工作线程数] [--config=FILE] [--name=value ...], 所有参数见--help
+    // 工作线程数默认64, 也就是最多同时服务64个连接
+    OptionParser parser("Usage: socket_server.out [worker num] [options]");
+    parser.set_positional([](const char* arg) { return parse_config_value(arg, thread_server_options.workers); });
+    parser.add("workers", &thread_server_options.workers, "worker threads");
+    parser.add("read-chunk", &thread_server_options.read_chunk, "max bytes per recv");
+    parser.add("max-pending", &thread_server_options.max_pending, "max accepted clients waiting for a worker");
+    add_server_options(parser);
+    if (!parser.parse(argc, argv) || !finish_server_options()) {
         return 1;
     }
-
-    // 设置监听地址
-    sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(kPort);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    // 绑定socket和要监听的地址
-    if (bind(socket_fd, (sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        cout << "Failed to bind socket with host address" << endl;
-        close(socket_fd);
+    // 对面关了连接时splice和sendfile会触发SIGPIPE, 它们不能像send一样带MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+    if (thread_server_options.workers <= 0 || thread_server_options.read_chunk == 0) {
+        fprintf(stderr, "Invalid thread server options\n");
         return 1;
     }
-
-    // 开始监听
-    if (listen(socket_fd, 20) == -1) {
-        cout << "Failed to listen address" << endl;
-        close(socket_fd);
+    int worker_num = thread_server_options.workers;
+    if (!init_drain_event()) {
+        fprintf(stderr, "Failed to create drain event: %s\n", strerror(errno));
         return 1;
-    } else {
-        cout << "Listening" << endl;
     }
+    install_stop_signals();
+
+    ScopedLogger logger;
 
-    bool shutdown = false;
+    ThreadServer server;
+    // 主线程用poll同时等新连接和优雅退出, 监听socket用非阻塞的, 连接被对面撤回时accept不会卡住
+    server.listen_socket.reset(create_listen_fd(false, true));
+    if (!server.listen_socket.valid()) {
+        return 1;
+    }
+    LOG_INFO("Listening on %s port %u, thread pool backend, worker num: %d", socket_options.address.c_str(), socket_options.port,
+             worker_num);
 
-    while (!shutdown) {
-        // 提前准备好用于记录客户端地址的结构体
-        sockaddr_in client_addr;
-        int client_fd = 0; // 提前定义好client_fd
-        socklen_t len = sizeof(client_addr);
-        client_fd = accept(socket_fd, (sockaddr*)&client_addr, &len);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < worker_num; i++) {
+        workers.emplace_back(run_worker, std::ref(server));
+    }
 
-        if (client_fd == -1 && errno != EAGAIN) {
-            // 如果出错, 直接关闭服务器
-            cout << "Failed to accept package, server shutdown" << endl;
-            shutdown = true;
+    while (!shutdown_server.load() && !drain_server.load()) {
+        pollfd fds[2] = {{server.listen_socket.get(), POLLIN, 0}, {drain_event_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            LOG_ERROR("Failed to poll listen socket, server shutdown: %s", strerror(errno));
+            stop_server(server);
             break;
-        } else if (client_fd == -1 && errno == EAGAIN) {
-            // 没连接就睡一会
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        } else {
-            // 有链接啦, 先记录下IP和端口, 然后设置非阻塞
-            char client_ip[INET_ADDRSTRLEN] = "";
-            uint16_t client_port = ntohs(client_addr.sin_port);
-            if (inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN) == nullptr) {
-                // 拿不到IP不影响后续回送消息
-                cout << "Client connected,  but failed to get client IP" << endl;
-            } else {
-                cout << "Client connected, IP address and port is:  " << client_ip << ": " << client_port << endl;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int client_fd = accept4(server.listen_socket.get(), nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
             }
-            
-            // 非阻塞
-            int flags = fcntl(client_fd, F_GETFL, 0);
-            fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
-
-            char buf[kBufSize + 1] = "";
-            
-            while (!shutdown) {
-                // 先接收信息
-                ssize_t recv_len = recv(client_fd, buf, kBufSize, 0);
-                buf[recv_len] = 0;
-                if (recv_len == -1 && errno == EAGAIN) {
-                    // cout << "Recieved nothing, wait for a while" << endl;
-                    std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                } else if (recv_len > 0) {
-                    cout << "Recieved package, message is: " << buf << endl;
-                    if (strcmp(buf, "exit") == 0) {
-                        const char exit_str[] = "disconnected";
-                        send_message(client_fd, exit_str, client_ip, client_port);
-                        break;
-                    } else if (strcmp(buf, "shutdown") == 0) {
-                        const char shutdown_str[] = "server shuting down";
-                        
-                        send(client_fd, shutdown_str, strlen(shutdown_str) + 1, 0);
-                        shutdown = true;
-                        break;
-                    } else {
-                        if (!send_message(client_fd, buf, client_ip, client_port)) {
-                            break;
-                        }
-                    }
-                } else if (recv_len == -1 && errno == EINTR) {
-                    // 被中断, 直接下一个循环
-                    continue;
-                } else {
-                    // 接收失败, 跳出循环去disconnect
-                    perror("Failed to recieve package, disconnect");
-                    break;
-                }
-                memset(buf, 0, kBufSize);
+            if (!shutdown_server.load()) {
+                // 如果出错, 直接关闭服务器
+                LOG_ERROR("Failed to accept client, server shutdown: %s", strerror(errno));
+                stop_server(server);
             }
-            cout << client_ip << ": " << client_port << " disconnected, wait for next connect" << endl;
+            break;
+        }
+        if (!server.queue.push(client_fd)) {
+            LOG_WARN("Too many pending clients, discard client");
             close(client_fd);
         }
     }
-    cout << "server shutdown" << endl;
-    close(socket_fd);
+
+    if (drain_server.load()) {
+        drain_thread_server(server);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    LOG_INFO("server shutdown");
     return 0;
-}
\ No newline at end of file
+}
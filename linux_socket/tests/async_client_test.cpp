@@ -0,0 +1,187 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_client.h"
+#include "loopback_server.h"
+
+namespace {
+
+SocketAddress loopback_address(uint16_t port) {
+    SocketAddress address;
+    resolve_address("127.0.0.1", port, address);
+    return address;
+}
+
+// AsyncConnection和AsyncClientPool都可以
+template <typename Client>
+Task<void> issue_requests(Client& client, int worker, int count, int& succeeded) {
+    for (int i = 0; i < count; i++) {
+        std::string body = "worker " + std::to_string(worker) + " request " + std::to_string(i);
+        std::optional<std::string> reply = co_await client.request(body);
+        if (reply && *reply == body) {
+            succeeded++;
+        }
+    }
+}
+
+Task<size_t> reply_size(AsyncConnection& conn, std::string body) {
+    std::optional<std::string> reply = co_await conn.request(body);
+    co_return reply ? reply->size() : 0;
+}
+
+// 嵌套的Task要能把值传回来
+Task<void> sum_reply_sizes(AsyncConnection& conn, size_t& total) {
+    total = co_await reply_size(conn, "abc") + co_await reply_size(conn, std::string(100000, 'x'));
+}
+
+// 服务器按id回声, 所有后端都支持
+class AsyncClientTest : public LoopbackTest {
+protected:
+    void SetUp() override {
+        LoopbackTest::SetUp();
+        ASSERT_TRUE(loop_.valid());
+    }
+
+    EventLoop loop_;
+};
+
+TEST_P(AsyncClientTest, ManyConcurrentRequestsOnOneConnection) {
+    AsyncConnection conn(loop_);
+    ASSERT_TRUE(conn.connect(loopback_address(server_.port())));
+    const int workers = 1000;
+    int succeeded = 0;
+    for (int i = 0; i < workers; i++) {
+        loop_.spawn(issue_requests(conn, i, 5, succeeded));
+    }
+    // 每个协程都停在第一个请求上, 一起在飞
+    EXPECT_EQ(conn.outstanding(), (size_t)workers);
+    loop_.run();
+    EXPECT_EQ(loop_.active_tasks(), 0u);
+    EXPECT_EQ(succeeded, workers * 5);
+    EXPECT_EQ(conn.outstanding(), 0u);
+}
+
+TEST_P(AsyncClientTest, PoolSpreadsRequests) {
+    AsyncClientPool pool(loop_);
+    ASSERT_TRUE(pool.connect(loopback_address(server_.port()), 4));
+    int succeeded = 0;
+    for (int i = 0; i < 200; i++) {
+        loop_.spawn(issue_requests(pool, i, 10, succeeded));
+    }
+    for (size_t i = 0; i < pool.size(); i++) {
+        EXPECT_EQ(pool.connection(i).outstanding(), 50u);
+    }
+    loop_.run();
+    EXPECT_EQ(succeeded, 2000);
+}
+
+TEST_P(AsyncClientTest, NestedTasksReturnValues) {
+    AsyncConnection conn(loop_);
+    ASSERT_TRUE(conn.connect(loopback_address(server_.port())));
+    size_t total = 0;
+    loop_.spawn(sum_reply_sizes(conn, total));
+    loop_.run();
+    EXPECT_EQ(total, 100003u);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, AsyncClientTest,
+                         ::testing::Values(Backend::kEpollLevel, Backend::kEpollEdge, Backend::kUring),
+                         backend_test_name);
+
+// 一个只收count个kRequest帧的假服务器, 收全之后交给reply决定怎么回
+class FakeServer {
+public:
+    template <typename Reply>
+    bool start(int count, Reply reply) {
+        socket_options.address = "127.0.0.1";
+        socket_options.port = 0;
+        listen_.reset(create_listen_fd(false, false));
+        if (!listen_.valid()) {
+            return false;
+        }
+        port_ = local_port(listen_.get());
+        thread_ = std::thread([this, count, reply] {
+            Socket client(accept(listen_.get(), nullptr, nullptr));
+            RecvBuffer buf;
+            std::vector<std::string> frames;
+            std::string payload;
+            Opcode opcode;
+            while ((int)frames.size() < count && recv_frame(client.get(), buf, payload, &opcode)) {
+                std::string frame;
+                append_frame(frame, opcode, payload.data(), payload.size());
+                frames.push_back(frame);
+            }
+            reply(client, frames);
+        });
+        return true;
+    }
+
+    ~FakeServer() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    uint16_t port() const { return port_; }
+
+private:
+    Socket listen_;
+    uint16_t port_ = 0;
+    std::thread thread_;
+};
+
+Task<void> expect_reply(AsyncConnection& conn, std::string body, std::vector<std::string>& order) {
+    std::optional<std::string> reply = co_await conn.request(body);
+    order.push_back(reply ? *reply : "failed");
+}
+
+TEST(AsyncClientMatchingTest, MatchesOutOfOrderRepliesById) {
+    FakeServer server;
+    ASSERT_TRUE(server.start(3, [](Socket& client, std::vector<std::string>& frames) {
+        std::string data;
+        for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+            data += *it;
+        }
+        send_all(client.get(), data.data(), data.size());
+    }));
+    EventLoop loop;
+    AsyncConnection conn(loop);
+    ASSERT_TRUE(conn.connect(loopback_address(server.port())));
+    std::vector<std::string> order;
+    for (const char* body : {"first", "second", "third"}) {
+        loop.spawn(expect_reply(conn, body, order));
+    }
+    loop.run();
+    EXPECT_EQ(order, (std::vector<std::string>{"third", "second", "first"}));
+}
+
+TEST(AsyncClientMatchingTest, ClosedConnectionFailsPendingRequests) {
+    FakeServer server;
+    // 只回第一个请求就断开
+    ASSERT_TRUE(server.start(3, [](Socket& client, std::vector<std::string>& frames) {
+        send_all(client.get(), frames[0].data(), frames[0].size());
+        client.reset();
+    }));
+    EventLoop loop;
+    AsyncConnection conn(loop);
+    ASSERT_TRUE(conn.connect(loopback_address(server.port())));
+    std::vector<std::string> order;
+    for (const char* body : {"first", "second", "third"}) {
+        loop.spawn(expect_reply(conn, body, order));
+    }
+    loop.run();
+    EXPECT_EQ(order, (std::vector<std::string>{"first", "failed", "failed"}));
+    EXPECT_FALSE(conn.connected());
+
+    // 断开之后的请求不挂起, 直接失败
+    loop.spawn(expect_reply(conn, "late", order));
+    EXPECT_EQ(order.back(), "failed");
+    EXPECT_EQ(loop.active_tasks(), 0u);
+}
+
+}  // namespace
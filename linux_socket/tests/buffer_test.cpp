@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "buffer.h"
+
+namespace {
+
+void append_to(RecvBuffer& buf, const std::string& data) {
+    char* dst = buf.prepare(data.size());
+    memcpy(dst, data.data(), data.size());
+    buf.commit(data.size());
+}
+
+std::string drain(OutputBuffer& out) {
+    iovec iov[16];
+    int count = out.fill_iovec(iov, 16);
+    std::string data;
+    for (int i = 0; i < count; i++) {
+        data.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+    out.consume(data.size());
+    return data;
+}
+
+TEST(RecvBufferTest, PrepareGrowsAndKeepsUnreadData) {
+    RecvBuffer buf;
+    append_to(buf, "hello");
+    buf.read_pos += 2;
+    append_to(buf, std::string(4096, 'x'));
+    EXPECT_EQ(buf.readable(), 3u + 4096u);
+    EXPECT_EQ(std::string(buf.peek(), 3), "llo");
+}
+
+TEST(RecvBufferTest, RestartsFromHeadWhenFullyParsed) {
+    RecvBuffer buf;
+    append_to(buf, "abcd");
+    const char* head = buf.peek();
+    buf.read_pos = buf.write_pos;
+    append_to(buf, "ef");
+    EXPECT_EQ(buf.peek(), head);
+    EXPECT_EQ(std::string(buf.peek(), 2), "ef");
+}
+
+TEST(RecvBufferTest, SharedBlockIsNeverOverwritten) {
+    RecvBuffer buf;
+    append_to(buf, "frame1");
+    OutputBuffer out;
+    out.append(buf.slice(buf.peek(), 6));
+    buf.read_pos = buf.write_pos;
+
+    // 发送队列还引用着前面的数据, 接着收的数据不能写到它上面
+    append_to(buf, std::string(buf.writable() + 1, 'y'));
+    EXPECT_EQ(drain(out), "frame1");
+}
+
+TEST(RecvBufferTest, RecycleKeepsOnlySmallUnsharedBlock) {
+    RecvBuffer buf;
+    append_to(buf, "abc");
+    buf.recycle(1024);
+    EXPECT_NE(buf.block, nullptr);
+    EXPECT_EQ(buf.readable(), 0u);
+
+    append_to(buf, std::string(4096, 'z'));
+    buf.recycle(1024);
+    EXPECT_EQ(buf.block, nullptr);
+}
+
+TEST(OutputBufferTest, MergesAdjacentSlices) {
+    RecvBuffer buf;
+    append_to(buf, "aaabbb");
+    OutputBuffer out;
+    out.append(buf.slice(buf.peek(), 3));
+    out.append(buf.slice(buf.peek() + 3, 3));
+    iovec iov[4];
+    EXPECT_EQ(out.fill_iovec(iov, 4), 1);
+    EXPECT_EQ(out.size(), 6u);
+}
+
+TEST(OutputBufferTest, PartialConsumeMovesOffset) {
+    OutputBuffer out;
+    out.append("hello", 5);
+    out.append(" world", 6);
+    out.consume(3);
+    EXPECT_EQ(out.size(), 8u);
+    out.consume(4);
+    EXPECT_EQ(drain(out), "orld");
+    EXPECT_TRUE(out.empty());
+}
+
+Slice droppable_slice(const std::string& data) {
+    BlockPtr block = make_block(data.size());
+    memcpy(block->data.get(), data.data(), data.size());
+    return Slice{std::move(block), 0, data.size(), true};
+}
+
+TEST(OutputBufferTest, DropOldestKeepsRepliesAndStartedSlice) {
+    OutputBuffer out;
+    out.append(droppable_slice("m1"));
+    out.append("reply", 5);
+    out.append(droppable_slice("m2"));
+    out.append(droppable_slice("m3"));
+    // 第一段已经发出去一个字节, 不能丢
+    out.consume(1);
+    EXPECT_EQ(out.drop_oldest(8), 1u);
+    EXPECT_EQ(out.size(), 8u);
+    EXPECT_EQ(out.drop_oldest(0), 1u);
+    EXPECT_EQ(drain(out), "1reply");
+}
+
+TEST(OutputBufferTest, WriteToSendsEverything) {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    OutputBuffer out;
+    out.append("ping", 4);
+    out.append("pong", 4);
+    EXPECT_EQ(out.write_to(fds[0]), 8);
+    EXPECT_TRUE(out.empty());
+    char data[8];
+    ASSERT_EQ(recv(fds[1], data, sizeof(data), 0), 8);
+    EXPECT_EQ(std::string(data, 8), "pingpong");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(OutputBufferTest, WriteToStopsAtMaxBytes) {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    OutputBuffer out;
+    out.append("ping", 4);
+    out.append("pong", 4);
+    // 截在第二段中间, 剩下的下次接着发
+    EXPECT_EQ(out.write_to(fds[0], 6), 6);
+    EXPECT_EQ(out.size(), 2u);
+    EXPECT_EQ(out.write_to(fds[0], 4), 2);
+    EXPECT_TRUE(out.empty());
+    char data[8];
+    ASSERT_EQ(recv(fds[1], data, sizeof(data), MSG_WAITALL), 8);
+    EXPECT_EQ(std::string(data, 8), "pingpong");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+}  // namespace
@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+namespace {
+
+struct TestOptions {
+    std::string host = "127.0.0.1";
+    uint16_t port = 7070;
+    bool verbose = false;
+    size_t size = 64;
+    double rate = 0;
+};
+
+void add_test_options(OptionParser& parser, TestOptions& options) {
+    parser.add("host", &options.host, "host");
+    parser.add("port", &options.port, "port");
+    parser.add("verbose", &options.verbose, "verbose");
+    parser.add("size", &options.size, "size");
+    parser.add("rate", &options.rate, "rate");
+}
+
+bool parse(OptionParser& parser, std::vector<std::string> args) {
+    args.insert(args.begin(), "test");
+    std::vector<char*> argv;
+    for (std::string& arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    return parser.parse((int)argv.size(), argv.data());
+}
+
+TEST(ConfigTest, ParsesCommandLine) {
+    TestOptions options;
+    OptionParser parser("test");
+    add_test_options(parser, options);
+    ASSERT_TRUE(parse(parser, {"--host=::1", "--port=9000", "--verbose", "--size=4096", "--rate=1.5"}));
+    EXPECT_EQ(options.host, "::1");
+    EXPECT_EQ(options.port, 9000);
+    EXPECT_TRUE(options.verbose);
+    EXPECT_EQ(options.size, 4096u);
+    EXPECT_DOUBLE_EQ(options.rate, 1.5);
+}
+
+TEST(ConfigTest, RejectsBadValues) {
+    TestOptions options;
+    OptionParser parser("test");
+    add_test_options(parser, options);
+    EXPECT_FALSE(parse(parser, {"--port=70000"}));
+    EXPECT_FALSE(parse(parser, {"--size=-1"}));
+    EXPECT_FALSE(parse(parser, {"--size=12abc"}));
+    EXPECT_FALSE(parse(parser, {"--verbose=maybe"}));
+    EXPECT_FALSE(parse(parser, {"--port"}));
+    EXPECT_FALSE(parse(parser, {"--unknown=1"}));
+    EXPECT_FALSE(parse(parser, {"positional"}));
+    EXPECT_EQ(options.port, 7070);
+}
+
+TEST(ConfigTest, CommandLineOverridesConfigFile) {
+    char path[] = "/tmp/socket_config_testXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(fd, -1);
+    std::string content = "# comment\n\n  port = 8000  \nhost=0.0.0.0\nverbose = true\n";
+    ASSERT_EQ(write(fd, content.data(), content.size()), (ssize_t)content.size());
+    close(fd);
+
+    TestOptions options;
+    OptionParser parser("test");
+    add_test_options(parser, options);
+    bool ok = parse(parser, {"--port=8001", std::string("--config=") + path});
+    unlink(path);
+    ASSERT_TRUE(ok);
+    EXPECT_EQ(options.port, 8001);
+    EXPECT_EQ(options.host, "0.0.0.0");
+    EXPECT_TRUE(options.verbose);
+}
+
+TEST(ConfigTest, PositionalHandler) {
+    int workers = 1;
+    OptionParser parser("test");
+    parser.set_positional([&workers](const char* arg) { return parse_config_value(arg, workers); });
+    ASSERT_TRUE(parse(parser, {"8"}));
+    EXPECT_EQ(workers, 8);
+    EXPECT_FALSE(parse(parser, {"eight"}));
+}
+
+}  // namespace
@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include "connection_table.h"
+
+namespace {
+
+struct TestConn {
+    void reset(int fd) {
+        client_fd = fd;
+        resets++;
+    }
+    void release() { client_fd = -1; }
+
+    int client_fd = -1;
+    int resets = 0;
+};
+
+TEST(ConnectionTableTest, FindByFd) {
+    ConnectionTable<TestConn> table;
+    TestConn* a = table.open(3);
+    TestConn* b = table.open(200);
+    EXPECT_EQ(table.find(3), a);
+    EXPECT_EQ(table.find(200), b);
+    EXPECT_EQ(table.find(4), nullptr);
+    EXPECT_EQ(table.find(-1), nullptr);
+    EXPECT_EQ(table.size(), 2u);
+}
+
+TEST(ConnectionTableTest, ClosedObjectIsReusedOnlyAfterReclaim) {
+    ConnectionTable<TestConn> table;
+    TestConn* a = table.open(5);
+    table.close(a);
+    EXPECT_EQ(a->client_fd, -1);
+    EXPECT_EQ(table.find(5), nullptr);
+
+    // 同一批事件里还没reclaim, 新连接不能拿到刚关掉的对象
+    TestConn* b = table.open(5);
+    EXPECT_NE(a, b);
+    EXPECT_EQ(a->client_fd, -1);
+
+    table.close(b);
+    table.reclaim();
+    TestConn* c = table.open(6);
+    EXPECT_TRUE(c == a || c == b);
+    EXPECT_EQ(c->resets, 2);
+}
+
+TEST(ConnectionTableTest, GrowsBeyondOneChunk) {
+    ConnectionTable<TestConn> table;
+    std::set<TestConn*> conns;
+    for (int fd = 0; fd < 3 * (int)ConnectionTable<TestConn>::kChunkSize; fd++) {
+        conns.insert(table.open(fd));
+    }
+    EXPECT_EQ(conns.size(), table.size());
+    size_t visited = 0;
+    table.for_each([&](TestConn& conn) {
+        EXPECT_EQ(table.find(conn.client_fd), &conn);
+        visited++;
+    });
+    EXPECT_EQ(visited, table.size());
+}
+
+}  // namespace
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include <poll.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "loopback_server.h"
+
+namespace {
+
+// 每个后端都要通过同样的回环测试
+class EchoTest : public LoopbackTest {
+protected:
+    void TearDown() override {
+        LoopbackTest::TearDown();
+        server_limits = ServerLimits();
+    }
+};
+
+TEST_P(EchoTest, RoundTrip) {
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    RecvBuffer buf;
+    std::string reply;
+    for (int i = 0; i < 100; i++) {
+        std::string message = "message " + std::to_string(i);
+        std::string frame;
+        append_frame(frame, Opcode::kEcho, message.data(), message.size());
+        ASSERT_TRUE(send_all(sock.get(), frame.data(), frame.size()));
+        ASSERT_TRUE(recv_frame(sock.get(), buf, reply));
+        EXPECT_EQ(reply, message);
+    }
+}
+
+TEST_P(EchoTest, PipelinedFramesSplitAcrossSends) {
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string data;
+    std::vector<std::string> messages;
+    for (int i = 0; i < 500; i++) {
+        messages.push_back(std::string(i % 37, 'a' + i % 26));
+        append_frame(data, Opcode::kEcho, messages.back().data(), messages.back().size());
+    }
+    // 按奇怪的长度切开发, 帧头和payload都会被拆到两次send里
+    for (size_t pos = 0; pos < data.size(); pos += 13) {
+        ASSERT_TRUE(send_all(sock.get(), data.data() + pos, std::min<size_t>(13, data.size() - pos)));
+    }
+    RecvBuffer buf;
+    std::string reply;
+    for (const std::string& message : messages) {
+        ASSERT_TRUE(recv_frame(sock.get(), buf, reply));
+        EXPECT_EQ(reply, message);
+    }
+}
+
+TEST_P(EchoTest, LargePayload) {
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string message(4 * 1024 * 1024, 'x');
+    for (size_t i = 0; i < message.size(); i += 4096) {
+        message[i] = 'a' + (i / 4096) % 26;
+    }
+    std::string frame;
+    append_frame(frame, Opcode::kEcho, message.data(), message.size());
+    // 客户端一边发一边收, 否则两边的socket缓冲区都满了会卡住
+    std::thread sender([&] { send_all(sock.get(), frame.data(), frame.size()); });
+    RecvBuffer buf;
+    std::string reply;
+    bool received = recv_frame(sock.get(), buf, reply);
+    sender.join();
+    ASSERT_TRUE(received);
+    EXPECT_TRUE(reply == message);
+}
+
+TEST_P(EchoTest, ExitClosesConnection) {
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string frame;
+    append_frame(frame, Opcode::kExit, "", 0);
+    ASSERT_TRUE(send_all(sock.get(), frame.data(), frame.size()));
+    EXPECT_TRUE(wait_closed(sock.get()));
+}
+
+TEST_P(EchoTest, InvalidFrameClosesConnection) {
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    const char garbage[] = "\x00\x00\x00\x01\x7fx";
+    ASSERT_TRUE(send_all(sock.get(), garbage, sizeof(garbage) - 1));
+    EXPECT_TRUE(wait_closed(sock.get()));
+}
+
+TEST_P(EchoTest, ManyClients) {
+    std::vector<Socket> socks;
+    for (int i = 0; i < 50; i++) {
+        socks.push_back(server_.connect());
+        ASSERT_TRUE(socks.back().valid());
+    }
+    std::string frame;
+    append_frame(frame, Opcode::kEcho, "ping", 4);
+    for (Socket& sock : socks) {
+        ASSERT_TRUE(send_all(sock.get(), frame.data(), frame.size()));
+    }
+    std::string reply;
+    for (Socket& sock : socks) {
+        RecvBuffer buf;
+        ASSERT_TRUE(recv_frame(sock.get(), buf, reply));
+        EXPECT_EQ(reply, "ping");
+    }
+}
+
+TEST_P(EchoTest, StalledReaderHitsWriteTimeout) {
+    server_limits.write_timeout_ms = 300;
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    // 只发不收, 接收缓冲区调小, 回复很快就堆在服务器的发送队列里发不出去
+    int rcvbuf = 16 * 1024;
+    setsockopt(sock.get(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    std::string message(64 * 1024, 'x');
+    std::string frame;
+    append_frame(frame, Opcode::kEcho, message.data(), message.size());
+    // 发到服务器停止读, 这边的发送缓冲区也满了为止
+    for (int i = 0; i < 256; i++) {
+        pollfd pfd{sock.get(), POLLOUT, 0};
+        if (poll(&pfd, 1, 200) <= 0 || send(sock.get(), frame.data(), frame.size(), MSG_DONTWAIT | MSG_NOSIGNAL) <= 0) {
+            break;
+        }
+    }
+    // 不读数据, 只等对面关连接; 空闲超时是60秒, 能关掉说明是写超时
+    auto start = std::chrono::steady_clock::now();
+    bool closed = false;
+    while (!closed && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        pollfd pfd{sock.get(), POLLRDHUP, 0};
+        closed = poll(&pfd, 1, 50) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+    }
+    EXPECT_TRUE(closed);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, EchoTest,
+                         ::testing::Values(Backend::kEpollLevel, Backend::kEpollEdge, Backend::kUring),
+                         backend_test_name);
+
+}  // namespace
@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+
+#include "histogram.h"
+#include "metrics.h"
+
+namespace {
+
+TEST(HistogramTest, SmallValuesAreExact) {
+    Histogram histogram;
+    for (uint64_t i = 1; i <= 100; i++) {
+        histogram.record(i);
+    }
+    EXPECT_EQ(histogram.count(), 100u);
+    EXPECT_EQ(histogram.min(), 1u);
+    EXPECT_EQ(histogram.max(), 100u);
+    EXPECT_EQ(histogram.percentile(50), 50u);
+    EXPECT_EQ(histogram.percentile(99), 99u);
+    EXPECT_DOUBLE_EQ(histogram.mean(), 50.5);
+}
+
+TEST(HistogramTest, LargeValuesWithinRelativeError) {
+    Histogram histogram;
+    for (uint64_t i = 1; i <= 100000; i++) {
+        histogram.record(i * 1000);
+    }
+    // 每个桶的宽度不超过值的1/128
+    uint64_t p90 = histogram.percentile(90);
+    EXPECT_GE(p90, 90000000u);
+    EXPECT_LE(p90, 90000000u + 90000000u / 128);
+    EXPECT_EQ(histogram.percentile(100), 100000000u);
+}
+
+TEST(HistogramTest, MergeAddsCounts) {
+    Histogram a;
+    Histogram b;
+    a.record(10, 3);
+    b.record(1000);
+    a.merge(b);
+    EXPECT_EQ(a.count(), 4u);
+    EXPECT_EQ(a.max(), 1000u);
+    EXPECT_EQ(a.min(), 10u);
+}
+
+TEST(HistogramTest, ConcurrentSnapshotMatchesRecords) {
+    ConcurrentHistogram concurrent;
+    for (uint64_t i = 0; i < 1000; i++) {
+        concurrent.record(i);
+    }
+    Histogram snapshot = concurrent.snapshot();
+    EXPECT_EQ(snapshot.count(), 1000u);
+    EXPECT_EQ(concurrent.sum(), 999u * 1000u / 2);
+}
+
+}  // namespace
@@ -0,0 +1,183 @@
+#ifndef LINUX_SOCKET_TESTS_LOOPBACK_SERVER_H
+#define LINUX_SOCKET_TESTS_LOOPBACK_SERVER_H
+
+// 测试和基准共用: 在127.0.0.1的随机端口上起一个reactor线程, 以及一个阻塞的帧协议客户端
+// 服务器用的是和socket_epoll_server.out完全一样的事件循环, 只是不经过main
+// 测试还共用最后的LoopbackTest, 基准不依赖GoogleTest
+
+#include <csignal>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "epoll_reactor.h"
+#include "protocol.h"
+#include "socket.h"
+#include "uring_reactor.h"
+
+enum class Backend {
+    kEpollLevel,
+    kEpollEdge,
+    kUring,
+};
+
+inline const char* backend_name(Backend backend) {
+    switch (backend) {
+    case Backend::kEpollLevel:
+        return "epoll_lt";
+    case Backend::kEpollEdge:
+        return "epoll_et";
+    case Backend::kUring:
+        return "io_uring";
+    }
+    return "unknown";
+}
+
+// 内核不支持这里用到的io_uring特性时返回false
+inline bool uring_supported() {
+    Uring ring;
+    ProvidedBuffers buffers;
+    return ring.init(8) && buffers.init(ring, 8, 4096, 0);
+}
+
+class LoopbackServer {
+public:
+    // 启动失败返回false, 服务器状态是全局的, 同一时间只能有一个
+    bool start(Backend backend) {
+        // splice和sendfile不能像send一样带MSG_NOSIGNAL, 和服务器的main一样忽略SIGPIPE
+        signal(SIGPIPE, SIG_IGN);
+        shutdown_server = false;
+        if (!init_drain_event()) {
+            return false;
+        }
+        socket_options.address = "127.0.0.1";
+        socket_options.port = 0;
+        if (backend == Backend::kUring) {
+            uring_reactor_.reset(new UringReactor);
+            uring_reactor_->listen_fd = create_listen_fd(false, false);
+            if (uring_reactor_->listen_fd == -1) {
+                return false;
+            }
+            port_ = local_port(uring_reactor_->listen_fd);
+            thread_ = std::thread(run_uring_reactor, std::ref(*uring_reactor_));
+        } else {
+            epoll_reactor_.reset(new Reactor);
+            epoll_reactor_->edge_triggered = backend == Backend::kEpollEdge;
+            if (!init_reactor(*epoll_reactor_, false)) {
+                return false;
+            }
+            port_ = local_port(epoll_reactor_->listen_fd);
+            thread_ = std::thread(run_reactor, std::ref(*epoll_reactor_));
+        }
+        return true;
+    }
+
+    // 发shutdown帧让reactor自己退出, 比等epoll_wait超时快
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        Socket sock = connect();
+        if (sock.valid()) {
+            std::string frame;
+            append_frame(frame, Opcode::kShutdown, "", 0);
+            send_all(sock.get(), frame.data(), frame.size());
+        }
+        shutdown_server = true;
+        thread_.join();
+    }
+
+    ~LoopbackServer() { stop(); }
+
+    uint16_t port() const { return port_; }
+
+    const ReactorMetrics& metrics() const { return epoll_reactor_ ? epoll_reactor_->metrics : uring_reactor_->metrics; }
+
+    Socket connect() const {
+        SocketAddress address;
+        resolve_address("127.0.0.1", port_, address);
+        return connect_socket(address);
+    }
+
+private:
+    std::unique_ptr<Reactor> epoll_reactor_;
+    std::unique_ptr<UringReactor> uring_reactor_;
+    std::thread thread_;
+    uint16_t port_ = 0;
+};
+
+// 阻塞地收一整帧, 不限制长度, 这样也能收kBulkEcho的大帧; 连接断开或者协议错误返回false
+inline bool recv_frame(int fd, RecvBuffer& buf, std::string& payload, Opcode* opcode = nullptr) {
+    Frame frame;
+    ParseResult result;
+    size_t want = kFrameHeaderSize;
+    while ((result = peek_frame_header(buf, frame)) != ParseResult::kError) {
+        if (result == ParseResult::kFrame) {
+            want = kFrameHeaderSize + frame.payload_len;
+            if (buf.readable() >= want) {
+                break;
+            }
+        }
+        // 知道帧长之后一次准备好整帧的空间, 大帧不用反复扩容
+        size_t chunk = want - buf.readable() > 64 * 1024 ? want - buf.readable() : 64 * 1024;
+        char* dst = buf.prepare(chunk);
+        ssize_t len = recv(fd, dst, buf.writable(), 0);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return false;
+        }
+        buf.commit(len);
+    }
+    if (result == ParseResult::kError) {
+        return false;
+    }
+    payload.assign(buf.peek() + kFrameHeaderSize, frame.payload_len);
+    buf.read_pos += want;
+    if (opcode != nullptr) {
+        *opcode = frame.opcode;
+    }
+    return true;
+}
+
+// 对面关了连接返回true
+inline bool wait_closed(int fd) {
+    char data[256];
+    while (true) {
+        ssize_t len = recv(fd, data, sizeof(data), 0);
+        if (len == 0 || (len == -1 && errno == ECONNRESET)) {
+            return true;
+        }
+        if (len == -1 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+#if __has_include(<gtest/gtest.h>)
+#include <gtest/gtest.h>
+
+// 按后端参数化的回环测试, 每个用例起一个服务器, 内核不支持io_uring时跳过
+// 改了全局参数的测试套件在自己的TearDown里先调这里的TearDown, 再把参数重置回去
+class LoopbackTest : public ::testing::TestWithParam<Backend> {
+protected:
+    void SetUp() override {
+        if (GetParam() == Backend::kUring && !uring_supported()) {
+            GTEST_SKIP() << "io_uring features not supported by this kernel";
+        }
+        ASSERT_TRUE(server_.start(GetParam()));
+    }
+
+    void TearDown() override { server_.stop(); }
+
+    LoopbackServer server_;
+};
+
+// INSTANTIATE_TEST_SUITE_P的用例名
+inline std::string backend_test_name(const ::testing::TestParamInfo<Backend>& info) {
+    return backend_name(info.param);
+}
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "protocol.h"
+
+namespace {
+
+RecvBuffer make_buffer(const std::string& data) {
+    RecvBuffer buf;
+    if (data.empty()) {
+        return buf;
+    }
+    char* dst = buf.prepare(data.size());
+    memcpy(dst, data.data(), data.size());
+    buf.commit(data.size());
+    return buf;
+}
+
+TEST(ProtocolTest, ParsesMultipleFramesFromOneBuffer) {
+    std::string data;
+    append_frame(data, Opcode::kEcho, "first", 5);
+    append_frame(data, Opcode::kEcho, "", 0);
+    append_frame(data, Opcode::kExit, "", 0);
+    RecvBuffer buf = make_buffer(data);
+
+    Frame frame;
+    ASSERT_EQ(parse_frame(buf, frame), ParseResult::kFrame);
+    EXPECT_EQ(frame.opcode, Opcode::kEcho);
+    EXPECT_EQ(std::string(frame.payload, frame.payload_len), "first");
+    ASSERT_EQ(parse_frame(buf, frame), ParseResult::kFrame);
+    EXPECT_EQ(frame.payload_len, 0u);
+    ASSERT_EQ(parse_frame(buf, frame), ParseResult::kFrame);
+    EXPECT_EQ(frame.opcode, Opcode::kExit);
+    EXPECT_EQ(parse_frame(buf, frame), ParseResult::kNeedMore);
+}
+
+TEST(ProtocolTest, WaitsForWholeFrame) {
+    std::string data;
+    append_frame(data, Opcode::kEcho, "payload", 7);
+    Frame frame;
+    // 头部和payload都可能被拆开, 每一种切法都要等到最后一个字节
+    for (size_t cut = 0; cut < data.size(); cut++) {
+        RecvBuffer buf = make_buffer(data.substr(0, cut));
+        EXPECT_EQ(parse_frame(buf, frame), ParseResult::kNeedMore) << "cut at " << cut;
+        EXPECT_EQ(buf.readable(), cut);
+    }
+}
+
+TEST(ProtocolTest, RequestFrameCarriesId) {
+    std::string data;
+    append_request_frame(data, 0x01020304, "body", 4);
+    RecvBuffer buf = make_buffer(data);
+    Frame frame;
+    ASSERT_EQ(parse_frame(buf, frame), ParseResult::kFrame);
+    EXPECT_EQ(frame.opcode, Opcode::kRequest);
+    uint32_t request_id = 0;
+    ASSERT_TRUE(parse_request_id(frame.payload, frame.payload_len, request_id));
+    EXPECT_EQ(request_id, 0x01020304u);
+    EXPECT_EQ(std::string(frame.payload + kRequestIdSize, frame.payload_len - kRequestIdSize), "body");
+    EXPECT_FALSE(parse_request_id(frame.payload, 3, request_id));
+}
+
+TEST(ProtocolTest, RejectsInvalidOpcode) {
+    std::string data;
+    append_frame(data, Opcode::kEcho, "x", 1);
+    data[4] = 0x7f;
+    RecvBuffer buf = make_buffer(data);
+    Frame frame;
+    EXPECT_EQ(parse_frame(buf, frame), ParseResult::kError);
+}
+
+TEST(ProtocolTest, RejectsOversizedPayloadFromHeaderAlone) {
+    char header[kFrameHeaderSize];
+    encode_frame_header(header, Opcode::kEcho, kMaxPayloadSize + 1);
+    RecvBuffer buf = make_buffer(std::string(header, kFrameHeaderSize));
+    Frame frame;
+    EXPECT_EQ(parse_frame(buf, frame), ParseResult::kError);
+}
+
+TEST(ProtocolTest, PeekHeaderLeavesDataAndAllowsBulkLength) {
+    char header[kFrameHeaderSize];
+    encode_frame_header(header, Opcode::kBulkEcho, kMaxPayloadSize + 1);
+    RecvBuffer buf = make_buffer(std::string(header, kFrameHeaderSize));
+    Frame frame;
+    // 大的bulk帧看帧头就要决定splice, 长度限制只在parse_frame里检查
+    ASSERT_EQ(peek_frame_header(buf, frame), ParseResult::kFrame);
+    EXPECT_EQ(frame.opcode, Opcode::kBulkEcho);
+    EXPECT_EQ(frame.payload_len, kMaxPayloadSize + 1);
+    EXPECT_EQ(buf.readable(), kFrameHeaderSize);
+    EXPECT_EQ(parse_frame(buf, frame), ParseResult::kError);
+}
+
+}  // namespace
@@ -0,0 +1,280 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "loopback_server.h"
+#include "pubsub.h"
+
+namespace {
+
+// broker只用到连接的这几个成员
+struct FakeConn {
+    bool can_enqueue() const { return !transferring; }
+
+    OutputBuffer send_buf;
+    SubscriberState subscriber;
+    bool transferring = false;
+};
+
+using FakeBroker = TopicBroker<FakeConn>;
+
+Slice make_frame(const std::string& topic, const std::string& message) {
+    std::string frame;
+    append_publish_frame(frame, topic, message.data(), message.size());
+    BlockPtr block = make_block(frame.size());
+    memcpy(block->data.get(), frame.data(), frame.size());
+    return Slice{std::move(block), 0, frame.size(), false};
+}
+
+std::vector<const char*> queued_pointers(const OutputBuffer& out) {
+    iovec iov[64];
+    int count = out.fill_iovec(iov, 64);
+    std::vector<const char*> pointers;
+    for (int i = 0; i < count; i++) {
+        pointers.push_back(static_cast<const char*>(iov[i].iov_base));
+    }
+    return pointers;
+}
+
+class TopicBrokerTest : public ::testing::Test {
+protected:
+    void TearDown() override { pubsub_options = PubSubOptions(); }
+
+    ReactorMetrics metrics_;
+};
+
+TEST_F(TopicBrokerTest, FanOutSharesOneBlockAcrossBrokers) {
+    FakeBroker local;
+    FakeBroker remote;
+    ASSERT_TRUE(local.init());
+    ASSERT_TRUE(remote.init());
+    local.set_peers({&remote});
+    remote.set_peers({&local});
+
+    std::vector<FakeConn> conns(3);
+    ASSERT_TRUE(local.subscribe(conns[0], "news"));
+    ASSERT_TRUE(local.subscribe(conns[1], "news"));
+    ASSERT_TRUE(remote.subscribe(conns[2], "news"));
+    FakeConn other;
+    ASSERT_TRUE(local.subscribe(other, "sports"));
+
+    Slice frame = make_frame("news", "hello");
+    local.publish("news", frame, metrics_);
+    EXPECT_EQ(metrics_.deliveries.get(), 2u);
+    // 另一个reactor的订阅者要等它自己的线程取收件箱
+    EXPECT_TRUE(conns[2].send_buf.empty());
+    remote.drain_inbox(metrics_);
+    EXPECT_EQ(metrics_.deliveries.get(), 3u);
+
+    // 每个订阅者的发送队列引用的都是同一块内存, 没有拷贝
+    for (FakeConn& conn : conns) {
+        EXPECT_EQ(queued_pointers(conn.send_buf), std::vector<const char*>{frame.data()});
+    }
+    EXPECT_TRUE(other.send_buf.empty());
+    EXPECT_EQ(frame.block.use_count(), 4);
+}
+
+TEST_F(TopicBrokerTest, FlushVisitsEachSubscriberOnce) {
+    FakeBroker broker;
+    FakeConn conn;
+    broker.subscribe(conn, "a");
+    broker.subscribe(conn, "b");
+    broker.publish("a", make_frame("a", "1"), metrics_);
+    broker.publish("b", make_frame("b", "2"), metrics_);
+    broker.publish("a", make_frame("a", "3"), metrics_);
+    int flushed = 0;
+    broker.flush([&](FakeConn&) { flushed++; }, [](FakeConn&) { FAIL(); });
+    EXPECT_EQ(flushed, 1);
+    EXPECT_EQ(queued_pointers(conn.send_buf).size(), 3u);
+}
+
+TEST_F(TopicBrokerTest, UnsubscribeAndRemove) {
+    FakeBroker broker;
+    FakeConn first;
+    FakeConn second;
+    broker.subscribe(first, "t");
+    broker.subscribe(second, "t");
+    broker.unsubscribe(first, "t");
+    broker.publish("t", make_frame("t", "x"), metrics_);
+    EXPECT_TRUE(first.send_buf.empty());
+    EXPECT_FALSE(second.send_buf.empty());
+    broker.remove(second);
+    EXPECT_EQ(broker.topic_count(), 0u);
+    EXPECT_TRUE(second.subscriber.topics.empty());
+}
+
+TEST_F(TopicBrokerTest, SubscriptionLimit) {
+    pubsub_options.max_subscriptions = 2;
+    FakeBroker broker;
+    FakeConn conn;
+    EXPECT_TRUE(broker.subscribe(conn, "a"));
+    EXPECT_TRUE(broker.subscribe(conn, "b"));
+    EXPECT_TRUE(broker.subscribe(conn, "a"));
+    EXPECT_FALSE(broker.subscribe(conn, "c"));
+}
+
+TEST_F(TopicBrokerTest, SlowSubscriberDropsOldest) {
+    Slice frame = make_frame("t", "0123456789");
+    pubsub_options.max_queued = 3 * frame.len;
+    FakeBroker broker;
+    FakeConn conn;
+    broker.subscribe(conn, "t");
+    std::vector<Slice> frames;
+    for (int i = 0; i < 5; i++) {
+        frames.push_back(make_frame("t", "012345678" + std::to_string(i)));
+        broker.publish("t", frames.back(), metrics_);
+    }
+    // 队列里留下最新的三条
+    EXPECT_EQ(conn.send_buf.size(), 3 * frame.len);
+    EXPECT_EQ(queued_pointers(conn.send_buf), (std::vector<const char*>{frames[2].data(), frames[3].data(), frames[4].data()}));
+    EXPECT_EQ(metrics_.dropped_messages.get(), 2u);
+}
+
+TEST_F(TopicBrokerTest, SlowSubscriberDisconnects) {
+    Slice frame = make_frame("t", "0123456789");
+    pubsub_options.max_queued = 2 * frame.len;
+    pubsub_options.slow_policy = SlowPolicy::kDisconnect;
+    FakeBroker broker;
+    FakeConn slow;
+    FakeConn fast;
+    broker.subscribe(slow, "t");
+    broker.subscribe(fast, "t");
+    for (int i = 0; i < 3; i++) {
+        broker.publish("t", frame, metrics_);
+        // fast每轮都发干净
+        fast.send_buf.clear();
+    }
+    std::vector<FakeConn*> evicted;
+    broker.flush([](FakeConn&) {}, [&](FakeConn& conn) { evicted.push_back(&conn); });
+    EXPECT_EQ(evicted, std::vector<FakeConn*>{&slow});
+}
+
+TEST_F(TopicBrokerTest, TransferInProgressDropsMessages) {
+    FakeBroker broker;
+    FakeConn conn;
+    conn.transferring = true;
+    broker.subscribe(conn, "t");
+    broker.publish("t", make_frame("t", "x"), metrics_);
+    EXPECT_TRUE(conn.send_buf.empty());
+    EXPECT_EQ(metrics_.dropped_messages.get(), 1u);
+}
+
+// 回环上的订阅和发布, io_uring后端不支持发布订阅, 要回kError
+class PubSubTest : public LoopbackTest {
+protected:
+    void TearDown() override {
+        LoopbackTest::TearDown();
+        pubsub_options = PubSubOptions();
+    }
+
+    // 订阅并等到确认
+    void subscribe(Socket& sock, RecvBuffer& buf, const std::string& topic) {
+        std::string frame;
+        append_frame(frame, Opcode::kSubscribe, topic.data(), topic.size());
+        ASSERT_TRUE(send_all(sock.get(), frame.data(), frame.size()));
+        std::string reply;
+        Opcode opcode;
+        ASSERT_TRUE(recv_frame(sock.get(), buf, reply, &opcode));
+        ASSERT_EQ(opcode, Opcode::kSubscribe);
+        ASSERT_EQ(reply, topic);
+    }
+};
+
+TEST_P(PubSubTest, FanOut) {
+    if (GetParam() == Backend::kUring) {
+        Socket sock = server_.connect();
+        std::string frame;
+        append_frame(frame, Opcode::kSubscribe, "news", 4);
+        ASSERT_TRUE(send_all(sock.get(), frame.data(), frame.size()));
+        RecvBuffer buf;
+        std::string reply;
+        Opcode opcode;
+        ASSERT_TRUE(recv_frame(sock.get(), buf, reply, &opcode));
+        EXPECT_EQ(opcode, Opcode::kError);
+        return;
+    }
+    std::vector<Socket> subscribers;
+    std::vector<RecvBuffer> buffers(20);
+    for (size_t i = 0; i < buffers.size(); i++) {
+        subscribers.push_back(server_.connect());
+        ASSERT_TRUE(subscribers.back().valid());
+        subscribe(subscribers.back(), buffers[i], "news");
+    }
+
+    Socket publisher = server_.connect();
+    std::string data;
+    for (int i = 0; i < 10; i++) {
+        std::string message = "message " + std::to_string(i);
+        append_publish_frame(data, "news", message.data(), message.size());
+        append_publish_frame(data, "sports", message.data(), message.size());
+    }
+    // 发布者自己没订阅, 只会收到这个回声
+    append_frame(data, Opcode::kEcho, "done", 4);
+    ASSERT_TRUE(send_all(publisher.get(), data.data(), data.size()));
+    RecvBuffer publisher_buf;
+    std::string reply;
+    ASSERT_TRUE(recv_frame(publisher.get(), publisher_buf, reply));
+    EXPECT_EQ(reply, "done");
+
+    for (size_t i = 0; i < subscribers.size(); i++) {
+        for (int j = 0; j < 10; j++) {
+            Opcode opcode;
+            ASSERT_TRUE(recv_frame(subscribers[i].get(), buffers[i], reply, &opcode));
+            EXPECT_EQ(opcode, Opcode::kPublish);
+            EXPECT_EQ(reply, "\x04news" "message " + std::to_string(j));
+        }
+    }
+}
+
+TEST_P(PubSubTest, ClosedSubscriberIsForgotten) {
+    if (GetParam() == Backend::kUring) {
+        GTEST_SKIP() << "io_uring backend does not support pub/sub";
+    }
+    RecvBuffer buf;
+    {
+        Socket gone = server_.connect();
+        subscribe(gone, buf, "news");
+    }
+    Socket subscriber = server_.connect();
+    RecvBuffer subscriber_buf;
+    subscribe(subscriber, subscriber_buf, "news");
+    // 关掉的连接对象可能已经分给了新连接, 新连接只能收到一份
+    Socket publisher = server_.connect();
+    std::string data;
+    append_publish_frame(data, "news", "a", 1);
+    append_publish_frame(data, "news", "b", 1);
+    ASSERT_TRUE(send_all(publisher.get(), data.data(), data.size()));
+    std::string reply;
+    ASSERT_TRUE(recv_frame(subscriber.get(), subscriber_buf, reply));
+    EXPECT_EQ(reply, "\x04news" "a");
+    ASSERT_TRUE(recv_frame(subscriber.get(), subscriber_buf, reply));
+    EXPECT_EQ(reply, "\x04news" "b");
+}
+
+TEST_P(PubSubTest, SlowSubscriberIsDisconnected) {
+    if (GetParam() == Backend::kUring) {
+        GTEST_SKIP() << "io_uring backend does not support pub/sub";
+    }
+    pubsub_options.max_queued = 256 * 1024;
+    pubsub_options.slow_policy = SlowPolicy::kDisconnect;
+    Socket slow = server_.connect();
+    RecvBuffer buf;
+    subscribe(slow, buf, "flood");
+
+    // 订阅者一直不读, 内核缓冲区满了之后发送队列很快超过上限
+    Socket publisher = server_.connect();
+    std::string message(64 * 1024, 'x');
+    std::string data;
+    append_publish_frame(data, "flood", message.data(), message.size());
+    for (int i = 0; i < 1024; i++) {
+        ASSERT_TRUE(send_all(publisher.get(), data.data(), data.size()));
+    }
+    EXPECT_TRUE(wait_closed(slow.get()));
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, PubSubTest,
+                         ::testing::Values(Backend::kEpollLevel, Backend::kEpollEdge, Backend::kUring),
+                         backend_test_name);
+
+}  // namespace
@@ -0,0 +1,241 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "loopback_server.h"
+#include "rate_limit.h"
+
+namespace {
+
+TEST(TokenBucketTest, DisabledNeverWaits) {
+    TokenBucket bucket;
+    bucket.init(0, 0, 0);
+    bucket.consume(1 << 30);
+    EXPECT_FALSE(bucket.enabled());
+    EXPECT_EQ(bucket.wait_ms(), 0u);
+}
+
+TEST(TokenBucketTest, RefillsAtRateUpToBurst) {
+    TokenBucket bucket;
+    bucket.init(1000, 100, 0);
+    bucket.consume(100);
+    EXPECT_EQ(bucket.tokens(), 0);
+    bucket.refill(50);
+    EXPECT_EQ(bucket.tokens(), 50);
+    // 空闲再久也只攒到burst
+    bucket.refill(10000);
+    EXPECT_EQ(bucket.tokens(), 100);
+}
+
+TEST(TokenBucketTest, OverdraftWaitsUntilPositive) {
+    TokenBucket bucket;
+    bucket.init(1000, 100, 0);
+    // 一次读上来的比桶大也照收, 欠下的按速率补
+    bucket.consume(300);
+    EXPECT_EQ(bucket.wait_ms(), 201u);
+    bucket.refill(201);
+    EXPECT_EQ(bucket.wait_ms(), 0u);
+}
+
+TEST(TokenBucketTest, InitSplitsRateAcrossShares) {
+    rate_limit_options.burst_ms = 1000;
+    TokenBucket bucket;
+    init_bucket(bucket, 1000, 3, 0);
+    // 每份向上取整, 容量是一秒的量
+    EXPECT_EQ(bucket.tokens(), 334);
+    rate_limit_options = RateLimitOptions();
+}
+
+// 不开线程, 直接调reactor的发送函数, 用socketpair代替客户端, 看每一轮每个连接发了多少
+class DrrTest : public ::testing::Test {
+protected:
+    static constexpr size_t kQuantum = 4096;
+
+    void SetUp() override {
+        rate_limit_options.write_quantum = kQuantum;
+        socket_options.address = "127.0.0.1";
+        socket_options.port = 0;
+        ASSERT_TRUE(init_reactor(reactor_, false));
+        for (int i = 0; i < 3; i++) {
+            int fds[2];
+            ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds), 0);
+            add_client(reactor_, fds[0]);
+            peers_[i].reset(fds[1]);
+            reactor_.clients.for_each([this, i, fd = fds[0]](ClientInfo& client) {
+                if (client.client_fd == fd) {
+                    clients_[i] = &client;
+                }
+            });
+            ASSERT_NE(clients_[i], nullptr);
+        }
+    }
+
+    void TearDown() override {
+        for (ClientInfo* client : clients_) {
+            if (client != nullptr && client->client_fd != -1) {
+                close_client(reactor_, *client);
+            }
+        }
+        reactor_.clients.reclaim();
+        close(reactor_.listen_fd);
+        close(reactor_.epfd);
+        rate_limit_options = RateLimitOptions();
+    }
+
+    // 对面这次能读到多少字节
+    size_t received(int i) {
+        char buf[64 * 1024];
+        size_t total = 0;
+        ssize_t len;
+        while ((len = recv(peers_[i].get(), buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            total += len;
+        }
+        return total;
+    }
+
+    void queue(int i, size_t len) { clients_[i]->send_buf.append(std::string(len, 'a' + i).data(), len); }
+
+    Reactor reactor_;
+    ClientInfo* clients_[3] = {};
+    Socket peers_[3];
+};
+
+TEST_F(DrrTest, YieldedConnectionsTakeTurns) {
+    // 0和1各有三份数据, 2是后来才有少量数据的普通连接
+    queue(0, 3 * kQuantum);
+    queue(1, 3 * kQuantum);
+    reactor_.round = 1;
+    ASSERT_TRUE(flush_send_buf(reactor_, *clients_[0]));
+    ASSERT_TRUE(flush_send_buf(reactor_, *clients_[1]));
+    EXPECT_EQ(received(0), kQuantum);
+    EXPECT_EQ(received(1), kQuantum);
+    ASSERT_EQ(reactor_.write_queue, (std::vector<ClientInfo*>{clients_[0], clients_[1]}));
+    // 排着队的连接不等EPOLLOUT
+    EXPECT_FALSE(clients_[0]->want_write);
+
+    // 下一轮先按顺序轮一遍, 发完一份的重新排到队尾
+    std::vector<ClientInfo*> batch;
+    reactor_.round = 2;
+    flush_write_queue(reactor_, batch);
+    EXPECT_EQ(received(0), kQuantum);
+    EXPECT_EQ(received(1), kQuantum);
+    ASSERT_EQ(reactor_.write_queue, (std::vector<ClientInfo*>{clients_[0], clients_[1]}));
+    // 同一轮里再有事件也不能多发, 后来的普通连接照常发
+    ASSERT_TRUE(flush_send_buf(reactor_, *clients_[0]));
+    EXPECT_EQ(received(0), 0u);
+    queue(2, 100);
+    ASSERT_TRUE(flush_send_buf(reactor_, *clients_[2]));
+    EXPECT_EQ(received(2), 100u);
+    EXPECT_EQ(reactor_.write_queue.size(), 2u);
+
+    // 最后一份发完就离开队列, 重新关注EPOLLOUT之前不用再排
+    reactor_.round = 3;
+    flush_write_queue(reactor_, batch);
+    EXPECT_EQ(received(0), kQuantum);
+    EXPECT_EQ(received(1), kQuantum);
+    EXPECT_TRUE(reactor_.write_queue.empty());
+    EXPECT_TRUE(clients_[0]->send_buf.empty());
+    EXPECT_EQ(reactor_.metrics.write_yields.get(), 4u);
+}
+
+// 限速和DRR只在epoll后端实现
+class RateLimitTest : public LoopbackTest {
+protected:
+    void TearDown() override {
+        LoopbackTest::TearDown();
+        rate_limit_options = RateLimitOptions();
+    }
+
+    // 一次发出去count个echo帧, 收齐回复, 返回用了多少毫秒, 失败返回-1
+    long echo_burst(const Socket& sock, int count, size_t size) {
+        std::string message(size, 'x');
+        std::string data;
+        for (int i = 0; i < count; i++) {
+            append_frame(data, Opcode::kEcho, message.data(), message.size());
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!send_all(sock.get(), data.data(), data.size())) {
+            return -1;
+        }
+        RecvBuffer buf;
+        std::string reply;
+        for (int i = 0; i < count; i++) {
+            if (!recv_frame(sock.get(), buf, reply) || reply != message) {
+                return -1;
+            }
+        }
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+TEST_P(RateLimitTest, ByteRateSlowsOneConnection) {
+    // 100KB/s, 桶里10KB; 一次读上来多少都照收, 透支的部分要等令牌补回来才接着读
+    // LT模式下第一批就会被拖慢, ET模式下第一批一次读完, 慢在后面的请求上
+    rate_limit_options.conn_bytes = 100 * 1024;
+    Socket sock = server_.connect();
+    long first = echo_burst(sock, 50, 1024);
+    ASSERT_GE(first, 0);
+    long elapsed = echo_burst(sock, 1, 1024);
+    ASSERT_GE(elapsed, 0);
+    elapsed += first;
+    EXPECT_GE(elapsed, 250);
+    EXPECT_LT(elapsed, 3000);
+    EXPECT_GT(server_.metrics().throttled.get(), 0u);
+    // 别的连接有自己的桶
+    Socket other = server_.connect();
+    elapsed = echo_burst(other, 1, 1024);
+    ASSERT_GE(elapsed, 0);
+    EXPECT_LT(elapsed, 200);
+}
+
+TEST_P(RateLimitTest, MessageRateSlowsOneConnection) {
+    // 每秒100个帧, 桶里10个; 40个帧透支30个
+    rate_limit_options.conn_messages = 100;
+    Socket sock = server_.connect();
+    long first = echo_burst(sock, 40, 16);
+    ASSERT_GE(first, 0);
+    long elapsed = echo_burst(sock, 1, 16);
+    ASSERT_GE(elapsed, 0);
+    elapsed += first;
+    EXPECT_GE(elapsed, 200);
+    EXPECT_LT(elapsed, 3000);
+}
+
+TEST_P(RateLimitTest, SmallQuantumStillDeliversLargeReplies) {
+    // 每轮只发4KB, 大回复要排很多轮才能发完
+    rate_limit_options.write_quantum = 4096;
+    Socket sock = server_.connect();
+    ASSERT_GE(echo_burst(sock, 8, 256 * 1024), 0);
+    EXPECT_GT(server_.metrics().write_yields.get(), 0u);
+}
+
+TEST_P(RateLimitTest, FlooderIsThrottledWhileOthersAreServed) {
+    rate_limit_options.conn_bytes = 1024 * 1024;
+    // 一直发不读的客户端, 发到socket缓冲区满为止
+    Socket flooder = server_.connect();
+    std::string message(64 * 1024, 'x');
+    std::string data;
+    append_frame(data, Opcode::kEcho, message.data(), message.size());
+    for (int i = 0; i < 64 && send(flooder.get(), data.data(), data.size(), MSG_DONTWAIT | MSG_NOSIGNAL) > 0; i++) {
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // 令牌用完之后就不再读它: 100毫秒里最多读桶里的100KB, 补上的100KB, 加上透支的一次读
+    // 不限速的话服务器会一直读到发送队列的高水位, 好几MB
+    EXPECT_GT(server_.metrics().throttled.get(), 0u);
+    EXPECT_LT(server_.metrics().bytes_in.get(), 512u * 1024);
+    // 普通客户端有自己的桶, 照常回复
+    Socket sock = server_.connect();
+    long elapsed = echo_burst(sock, 1, 64);
+    ASSERT_GE(elapsed, 0);
+    EXPECT_LT(elapsed, 200);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, RateLimitTest, ::testing::Values(Backend::kEpollLevel, Backend::kEpollEdge), backend_test_name);
+
+}  // namespace
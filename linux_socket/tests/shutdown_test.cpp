@@ -0,0 +1,270 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hot_restart.h"
+#include "loopback_server.h"
+
+namespace {
+
+// 优雅退出: 已经在发送队列里的回复要发完, 然后对面收到EOF
+class DrainTest : public LoopbackTest {
+protected:
+    void TearDown() override {
+        LoopbackTest::TearDown();
+        server_limits = ServerLimits();
+    }
+};
+
+TEST_P(DrainTest, FlushesRepliesThenCloses) {
+    Socket idle = server_.connect();
+    Socket sock = server_.connect();
+    ASSERT_TRUE(idle.valid());
+    ASSERT_TRUE(sock.valid());
+    // 回复比内核缓冲区大, 开始排空时还有一部分在服务器的发送队列里
+    const int count = 64;
+    std::string message(32 * 1024, 'x');
+    std::string data;
+    for (int i = 0; i < count; i++) {
+        message[0] = 'a' + i % 26;
+        append_frame(data, Opcode::kEcho, message.data(), message.size());
+    }
+    // shutdown后面的帧不再处理
+    append_frame(data, Opcode::kShutdown, "", 0);
+    append_frame(data, Opcode::kEcho, "late", 4);
+    ASSERT_TRUE(send_all(sock.get(), data.data(), data.size()));
+
+    RecvBuffer buf;
+    std::string reply;
+    for (int i = 0; i < count; i++) {
+        ASSERT_TRUE(recv_frame(sock.get(), buf, reply));
+        message[0] = 'a' + i % 26;
+        ASSERT_EQ(reply, message);
+    }
+    // 最后一个回复之后就是EOF, 没有late的回声
+    EXPECT_FALSE(recv_frame(sock.get(), buf, reply));
+    EXPECT_TRUE(wait_closed(idle.get()));
+    // 监听socket已经关了
+    EXPECT_FALSE(server_.connect().valid());
+}
+
+TEST_P(DrainTest, DeadlineClosesStuckClients) {
+    server_limits.drain_timeout_ms = 200;
+    Socket stuck = server_.connect();
+    ASSERT_TRUE(stuck.valid());
+    // 一直发不读, 服务器的发送队列到了高水位就不再读, 这边的send最后会阻塞住
+    std::atomic<bool> send_failed{false};
+    std::thread sender([&stuck, &send_failed] {
+        std::string message(64 * 1024, 'x');
+        std::string data;
+        append_frame(data, Opcode::kEcho, message.data(), message.size());
+        while (send_all(stuck.get(), data.data(), data.size())) {
+        }
+        send_failed = true;
+    });
+    // 等发送队列堆起来
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    Socket sock = server_.connect();
+    std::string frame;
+    append_frame(frame, Opcode::kShutdown, "", 0);
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(send_all(sock.get(), frame.data(), frame.size()));
+    EXPECT_TRUE(wait_closed(sock.get()));
+    // 到了截止时间服务器直接关掉连接, 阻塞着的send会失败
+    sender.join();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    EXPECT_TRUE(send_failed);
+    EXPECT_GE(elapsed.count(), 150);
+    EXPECT_LT(elapsed.count(), 3000);
+}
+
+TEST_P(DrainTest, FinishesRunningBulkEcho) {
+    if (GetParam() == Backend::kUring) {
+        GTEST_SKIP() << "io_uring backend buffers bulk frames like echo frames";
+    }
+    server_limits.drain_timeout_ms = 3000;
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string payload(4 * 1024 * 1024, 'x');
+    for (size_t i = 0; i < payload.size(); i += 4096) {
+        payload[i] = 'a' + (i / 4096) % 26;
+    }
+    std::string data;
+    append_frame(data, Opcode::kBulkEcho, payload.data(), payload.size());
+    const size_t half = data.size() / 2;
+    // 发到一半开始优雅退出, 剩下的payload还要照常splice回来
+    std::thread sender([&] {
+        send_all(sock.get(), data.data(), half);
+        Socket trigger = server_.connect();
+        std::string frame;
+        append_frame(frame, Opcode::kShutdown, "", 0);
+        send_all(trigger.get(), frame.data(), frame.size());
+        wait_closed(trigger.get());
+        send_all(sock.get(), data.data() + half, data.size() - half);
+    });
+    auto start = std::chrono::steady_clock::now();
+    RecvBuffer buf;
+    std::string reply;
+    Opcode opcode;
+    EXPECT_TRUE(recv_frame(sock.get(), buf, reply, &opcode));
+    sender.join();
+    EXPECT_EQ(opcode, Opcode::kBulkEcho);
+    EXPECT_TRUE(reply == payload);
+    // 传完之后就是EOF, 不用等到截止时间
+    EXPECT_FALSE(recv_frame(sock.get(), buf, reply));
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    EXPECT_LT(elapsed.count(), 2000);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, DrainTest,
+                         ::testing::Values(Backend::kEpollLevel, Backend::kEpollEdge, Backend::kUring),
+                         backend_test_name);
+
+TEST(UringDrainTest, LateAcceptIsDrainedNotRejected) {
+    if (!uring_supported()) {
+        GTEST_SKIP() << "io_uring not supported by this kernel";
+    }
+    // 取消multishot accept生效之前又收到一个连接, 不用起reactor线程, 直接把accept的完成事件交给它
+    socket_options.address = "127.0.0.1";
+    socket_options.port = 0;
+    Socket listener(create_listen_fd(false, false));
+    ASSERT_TRUE(listener.valid());
+    SocketAddress address;
+    resolve_address("127.0.0.1", local_port(listener.get()), address);
+    Socket client = connect_socket(address);
+    ASSERT_TRUE(client.valid());
+    int accepted = accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC);
+    ASSERT_NE(accepted, -1);
+
+    UringReactor reactor;
+    ASSERT_TRUE(reactor.ring.init(8));
+    ASSERT_TRUE(reactor.buffers.init(reactor.ring, 8, 4096, kUringBufGroup));
+    reactor.now_ms = now_ns() / 1000000;
+    reactor.timers.init(reactor.now_ms);
+    reactor.draining = true;
+    reactor.drain_deadline_ms = reactor.now_ms + 3000;
+    io_uring_cqe cqe{};
+    cqe.res = accepted;
+    handle_uring_accept(reactor, cqe);
+    EXPECT_EQ(reactor.metrics.rejected_connections.get(), 0u);
+    EXPECT_EQ(reactor.clients.size(), 1u);
+
+    // 和已有的连接一样排空: 没有回复要发, 直接shutdown写端, 对面收到EOF而不是RST
+    EXPECT_FALSE(uring_drain_step(reactor));
+    char c;
+    EXPECT_EQ(recv(client.get(), &c, 1, 0), 0);
+    // 对面关掉之后连接释放
+    client.reset();
+    bool drained = false;
+    for (int i = 0; i < 100 && !drained; i++) {
+        reactor.ring.submit(1, 100);
+        reactor.ring.for_each_cqe([&reactor](const io_uring_cqe& cqe) {
+            handle_uring_cqe(reactor, cqe);
+        });
+        drained = uring_drain_step(reactor);
+        reactor.buffers.publish();
+        reactor.clients.reclaim();
+    }
+    EXPECT_TRUE(drained);
+    reactor.ring.destroy();
+}
+
+// 热重启的交接协议, 新旧两个进程都用这个进程里的线程模拟
+class HandoffTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        path_ = "/tmp/socket_learning_handoff_" + std::to_string(getpid()) + ".sock";
+        ASSERT_TRUE(init_drain_event());
+        socket_options.address = "127.0.0.1";
+        socket_options.port = 0;
+        listen_fd_ = create_listen_fd(false, true);
+        ASSERT_NE(listen_fd_, -1);
+        handoff_fd_ = create_handoff_fd(path_.c_str());
+        ASSERT_NE(handoff_fd_, -1);
+        old_ = std::thread(run_handoff_server, handoff_fd_, std::vector<int>{dup(listen_fd_)}, std::ref(handed_off_));
+    }
+
+    void TearDown() override {
+        shutdown_server = true;
+        if (old_.joinable()) {
+            old_.join();
+        }
+        shutdown_server = false;
+        init_drain_event();
+        if (handoff_fd_ != -1) {
+            close(handoff_fd_);
+        }
+        if (listen_fd_ != -1) {
+            close(listen_fd_);
+        }
+        unlink(path_.c_str());
+    }
+
+    std::string path_;
+    int listen_fd_ = -1;
+    int handoff_fd_ = -1;
+    std::atomic<bool> handed_off_{false};
+    std::thread old_;
+};
+
+TEST_F(HandoffTest, NoOldProcess) {
+    std::vector<int> fds;
+    int peer_fd = 0;
+    EXPECT_TRUE(take_over_listen_fds((path_ + ".missing").c_str(), fds, peer_fd));
+    EXPECT_TRUE(fds.empty());
+    EXPECT_EQ(peer_fd, -1);
+}
+
+TEST_F(HandoffTest, PassesListenSocketAndDrainsOnAck) {
+    uint16_t port = local_port(listen_fd_);
+    // 交接之前连上的连接还在同一个监听socket的队列里, 新进程能accept到
+    SocketAddress address;
+    resolve_address("127.0.0.1", port, address);
+    Socket client = connect_socket(address);
+    ASSERT_TRUE(client.valid());
+
+    std::vector<int> fds;
+    int peer_fd = -1;
+    ASSERT_TRUE(take_over_listen_fds(path_.c_str(), fds, peer_fd));
+    ASSERT_EQ(fds.size(), 1u);
+    ASSERT_NE(peer_fd, -1);
+    EXPECT_EQ(local_port(fds[0]), port);
+    // 旧进程关掉自己的监听socket之后, 新进程的还能用
+    close(listen_fd_);
+    listen_fd_ = -1;
+    Socket accepted(accept(fds[0], nullptr, nullptr));
+    EXPECT_TRUE(accepted.valid());
+
+    EXPECT_FALSE(drain_server);
+    ASSERT_TRUE(send_handoff_ack(peer_fd));
+    old_.join();
+    EXPECT_TRUE(handed_off_);
+    EXPECT_TRUE(drain_server);
+    close(fds[0]);
+}
+
+TEST_F(HandoffTest, OldProcessKeepsServingWithoutAck) {
+    std::vector<int> fds;
+    int peer_fd = -1;
+    ASSERT_TRUE(take_over_listen_fds(path_.c_str(), fds, peer_fd));
+    ASSERT_EQ(fds.size(), 1u);
+    // 新进程启动失败, 没回确认就断开了
+    close(peer_fd);
+    close(fds[0]);
+    // 旧进程还能再交接一次
+    ASSERT_TRUE(take_over_listen_fds(path_.c_str(), fds, peer_fd));
+    ASSERT_EQ(fds.size(), 1u);
+    EXPECT_FALSE(handed_off_);
+    EXPECT_FALSE(drain_server);
+    close(peer_fd);
+    close(fds[0]);
+}
+
+}  // namespace
@@ -0,0 +1,82 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+#include "timing_wheel.h"
+
+namespace {
+
+TEST(TimingWheelTest, FiresWithinOneTickAfterExpire) {
+    TimingWheel wheel(10);
+    wheel.init(1000);
+    std::vector<TimerNode> nodes(2000);
+    std::mt19937 rng(42);
+    // 覆盖最底层, 需要倒槽的上层以及超过一圈的时间
+    std::uniform_int_distribution<uint64_t> delay(0, 3 * 3600 * 1000);
+    for (TimerNode& node : nodes) {
+        wheel.schedule(&node, 1000 + delay(rng));
+    }
+    EXPECT_EQ(wheel.size(), nodes.size());
+
+    // 每次推进7ms, 触发时间最多比到期时间晚一个tick再加一步
+    const uint64_t step = 7;
+    size_t fired = 0;
+    uint64_t now = 1000;
+    while (wheel.size() > 0) {
+        now += step;
+        wheel.advance(now, [&](TimerNode* node) {
+            EXPECT_GE(now, node->expire_ms);
+            EXPECT_LT(now, node->expire_ms + 10 + step);
+            fired++;
+        });
+    }
+    EXPECT_EQ(fired, nodes.size());
+}
+
+TEST(TimingWheelTest, CancelledTimerDoesNotFire) {
+    TimingWheel wheel(10);
+    wheel.init(0);
+    TimerNode kept;
+    TimerNode cancelled;
+    wheel.schedule(&kept, 50);
+    wheel.schedule(&cancelled, 50);
+    wheel.cancel(&cancelled);
+    EXPECT_FALSE(cancelled.linked());
+
+    std::vector<TimerNode*> fired;
+    wheel.advance(100, [&](TimerNode* node) { fired.push_back(node); });
+    ASSERT_EQ(fired.size(), 1u);
+    EXPECT_EQ(fired[0], &kept);
+}
+
+TEST(TimingWheelTest, RescheduleFromCallback) {
+    TimingWheel wheel(10);
+    wheel.init(0);
+    TimerNode node;
+    wheel.schedule(&node, 30);
+    int fired = 0;
+    for (uint64_t now = 10; now <= 200; now += 10) {
+        wheel.advance(now, [&](TimerNode* timer) {
+            fired++;
+            if (fired < 3) {
+                wheel.schedule(timer, now + 30);
+            }
+        });
+    }
+    EXPECT_EQ(fired, 3);
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimingWheelTest, NextTimeoutNeverSleepsPastExpire) {
+    TimingWheel wheel(10);
+    wheel.init(0);
+    EXPECT_EQ(wheel.next_timeout(0), -1);
+    TimerNode node;
+    wheel.schedule(&node, 45);
+    int timeout = wheel.next_timeout(0);
+    EXPECT_GE(timeout, 0);
+    EXPECT_LE(timeout, 50);
+}
+
+}  // namespace
@@ -0,0 +1,214 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "socket.h"
+#include "udp_server.h"
+
+namespace {
+
+// 手工填一个recvmmsg的结果
+void fake_datagram(UdpBatch& batch, int index, const sockaddr_in& from, size_t len) {
+    memcpy(&batch.addrs[index], &from, sizeof(from));
+    msghdr& msg = batch.recv_msgs[index].msg_hdr;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_controllen = 0;
+    msg.msg_flags = 0;
+    batch.recv_msgs[index].msg_len = len;
+    memset(batch.slot(index), 'a' + index, len);
+}
+
+sockaddr_in loopback_peer(uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+class UdpBatchTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        // 同一个地址: 三个整段加一个短段; 换一个地址: 两个整段
+        for (int i = 0; i < 4; i++) {
+            fake_datagram(batch_, i, loopback_peer(1000), i < 3 ? 100 : 50);
+        }
+        fake_datagram(batch_, 4, loopback_peer(2000), 100);
+        fake_datagram(batch_, 5, loopback_peer(2000), 100);
+    }
+
+    void TearDown() override { udp_options = UdpOptions(); }
+
+    UdpBatch batch_{8, 128};
+    ReactorMetrics metrics_;
+};
+
+TEST_F(UdpBatchTest, OneReplyPerDatagramWithoutGso) {
+    EXPECT_EQ(build_echo_batch(batch_, 6, metrics_), 6);
+    EXPECT_EQ(metrics_.messages_in.get(), 6u);
+    for (int i = 0; i < 6; i++) {
+        EXPECT_EQ(batch_.send_msgs[i].msg_hdr.msg_iov[0].iov_base, batch_.slot(i));
+        EXPECT_EQ(batch_.send_msgs[i].msg_hdr.msg_controllen, 0u);
+    }
+}
+
+TEST_F(UdpBatchTest, GsoGroupsRunsToTheSamePeer) {
+    udp_options.gso = true;
+    ASSERT_EQ(build_echo_batch(batch_, 6, metrics_), 2);
+    const msghdr& first = batch_.send_msgs[0].msg_hdr;
+    EXPECT_EQ(first.msg_iovlen, 4u);
+    EXPECT_EQ(batch_.send_segments[0], 4);
+    EXPECT_EQ(batch_.send_segment_size[0], 100);
+    ASSERT_NE(first.msg_controllen, 0u);
+    const cmsghdr* cmsg = CMSG_FIRSTHDR(&first);
+    EXPECT_EQ(cmsg->cmsg_type, UDP_SEGMENT);
+    uint16_t segment;
+    memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+    EXPECT_EQ(segment, 100);
+    // 短段之后不能再接, 换了地址也不能接
+    EXPECT_EQ(batch_.send_msgs[1].msg_hdr.msg_iovlen, 2u);
+    EXPECT_EQ(batch_.send_msgs[1].msg_hdr.msg_name, &batch_.addrs[4]);
+}
+
+TEST_F(UdpBatchTest, TruncatedDatagramIsDropped) {
+    batch_.recv_msgs[2].msg_hdr.msg_flags = MSG_TRUNC;
+    EXPECT_EQ(build_echo_batch(batch_, 6, metrics_), 5);
+    EXPECT_EQ(metrics_.dropped_datagrams.get(), 1u);
+}
+
+struct UdpMode {
+    bool gso;
+    bool gro;
+};
+
+// 回环上的UDP回声, 客户端用UDP_SEGMENT一次发出一批, 服务器开GRO时会收到合并的包
+class UdpEchoTest : public ::testing::TestWithParam<UdpMode> {
+protected:
+    void SetUp() override {
+        shutdown_server = false;
+        ASSERT_TRUE(init_drain_event());
+        udp_options.gso = GetParam().gso;
+        udp_options.gro = GetParam().gro;
+        socket_options.address = "127.0.0.1";
+        socket_options.port = 0;
+        reactor_.fd = create_udp_fd(false);
+        ASSERT_NE(reactor_.fd, -1);
+        port_ = local_port(reactor_.fd);
+        thread_ = std::thread(run_udp_reactor, std::ref(reactor_));
+
+        client_.reset(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+        sockaddr_in server = loopback_peer(port_);
+        ASSERT_EQ(connect(client_.get(), (sockaddr*)&server, sizeof(server)), 0);
+        timeval timeout{2, 0};
+        setsockopt(client_.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    void TearDown() override {
+        if (thread_.joinable()) {
+            request_drain();
+            thread_.join();
+        }
+        init_drain_event();
+        udp_options = UdpOptions();
+    }
+
+    // 一次GSO发送, 内核不支持时返回false
+    bool send_segmented(const std::string& data, uint16_t segment) {
+        iovec iov{const_cast<char*>(data.data()), data.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        return sendmsg(client_.get(), &msg, 0) == (ssize_t)data.size();
+    }
+
+    UdpReactor reactor_;
+    std::thread thread_;
+    uint16_t port_ = 0;
+    Socket client_;
+};
+
+TEST_P(UdpEchoTest, EchoesEveryDatagram) {
+    const int count = 40;
+    const size_t size = 200;
+    std::string data;
+    for (int i = 0; i < count; i++) {
+        data += std::string(size, 'a' + i % 26);
+    }
+    // 最后一个短一点
+    data += "tail";
+    if (!send_segmented(data, size)) {
+        GTEST_SKIP() << "UDP_SEGMENT not supported by this kernel";
+    }
+    char reply[1024];
+    for (int i = 0; i < count; i++) {
+        ASSERT_EQ(recv(client_.get(), reply, sizeof(reply), 0), (ssize_t)size);
+        EXPECT_EQ(std::string(reply, size), std::string(size, 'a' + i % 26));
+    }
+    ASSERT_EQ(recv(client_.get(), reply, sizeof(reply), 0), 4);
+    EXPECT_EQ(std::string(reply, 4), "tail");
+    EXPECT_EQ(reactor_.metrics.messages_in.get(), (uint64_t)count + 1);
+}
+
+TEST_P(UdpEchoTest, OversizedDatagramIsDropped) {
+    if (GetParam().gro) {
+        GTEST_SKIP() << "GRO receive buffers hold any datagram";
+    }
+    std::string big(udp_options.max_datagram + 1, 'x');
+    ASSERT_EQ(send(client_.get(), big.data(), big.size(), 0), (ssize_t)big.size());
+    ASSERT_EQ(send(client_.get(), "small", 5, 0), 5);
+    char reply[64];
+    ASSERT_EQ(recv(client_.get(), reply, sizeof(reply), 0), 5);
+    EXPECT_EQ(reactor_.metrics.dropped_datagrams.get(), 1u);
+}
+
+TEST(UdpReactorTest, FloodReturnsToPollBetweenBatches) {
+    // 一直有包时也要回到poll检查退出; 每次唤醒只收一批, 提前排好的32个数据报要唤醒8次
+    udp_options.batch = 4;
+    udp_options.batches_per_wakeup = 1;
+    shutdown_server = false;
+    ASSERT_TRUE(init_drain_event());
+    socket_options.address = "127.0.0.1";
+    socket_options.port = 0;
+    UdpReactor reactor;
+    reactor.fd = create_udp_fd(false);
+    ASSERT_NE(reactor.fd, -1);
+    Socket client(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    sockaddr_in server = loopback_peer(local_port(reactor.fd));
+    ASSERT_EQ(connect(client.get(), (sockaddr*)&server, sizeof(server)), 0);
+    timeval timeout{2, 0};
+    setsockopt(client.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    const int count = 32;
+    for (int i = 0; i < count; i++) {
+        ASSERT_EQ(send(client.get(), "ping", 4, 0), 4);
+    }
+
+    std::thread thread(run_udp_reactor, std::ref(reactor));
+    char reply[64];
+    for (int i = 0; i < count; i++) {
+        ASSERT_EQ(recv(client.get(), reply, sizeof(reply), 0), 4) << i;
+    }
+    EXPECT_GE(reactor.metrics.loop_iterations.get(), (uint64_t)count / 4);
+    request_drain();
+    thread.join();
+    init_drain_event();
+    udp_options = UdpOptions();
+}
+
+INSTANTIATE_TEST_SUITE_P(Modes, UdpEchoTest,
+                         ::testing::Values(UdpMode{false, false}, UdpMode{true, false}, UdpMode{false, true}, UdpMode{true, true}),
+                         [](const ::testing::TestParamInfo<UdpMode>& info) {
+                             return std::string(info.param.gso ? "gso" : "nogso") + "_" + (info.param.gro ? "gro" : "nogro");
+                         });
+
+}  // namespace
@@ -0,0 +1,228 @@
+#include <gtest/gtest.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "loopback_server.h"
+
+namespace {
+
+std::string make_payload(size_t size) {
+    std::string payload(size, 'x');
+    for (size_t i = 0; i < size; i += 4096) {
+        payload[i] = 'a' + (i / 4096) % 26;
+    }
+    return payload;
+}
+
+// 零拷贝传输只有epoll后端支持, io_uring后端走的是退化的路径, 也要检查
+class ZeroCopyTest : public LoopbackTest {
+protected:
+    void SetUp() override {
+        char dir[] = "/tmp/zero_copy_test.XXXXXX";
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        root_ = dir;
+        transfer_options.file_root = root_;
+        LoopbackTest::SetUp();
+    }
+
+    void TearDown() override {
+        LoopbackTest::TearDown();
+        transfer_options = TransferOptions();
+        if (!root_.empty()) {
+            std::remove((root_ + "/data.bin").c_str());
+            rmdir(root_.c_str());
+        }
+    }
+
+    bool zero_copy() const { return GetParam() != Backend::kUring; }
+
+    void write_file(const std::string& content) {
+        FILE* file = fopen((root_ + "/data.bin").c_str(), "wb");
+        ASSERT_NE(file, nullptr);
+        ASSERT_EQ(fwrite(content.data(), 1, content.size(), file), content.size());
+        fclose(file);
+    }
+
+    // 发一段数据, 同时按顺序收回replies.size()帧
+    void exchange(int fd, const std::string& data, std::vector<std::string>& replies, std::vector<Opcode>& opcodes) {
+        // 一边发一边收, 否则两边的socket缓冲区都满了会卡住
+        std::thread sender([&] { send_all(fd, data.data(), data.size()); });
+        RecvBuffer buf;
+        for (size_t i = 0; i < replies.size(); i++) {
+            if (!recv_frame(fd, buf, replies[i], &opcodes[i])) {
+                ADD_FAILURE() << "connection closed before reply " << i;
+                break;
+            }
+        }
+        sender.join();
+    }
+
+    std::string root_;
+};
+
+TEST_P(ZeroCopyTest, BulkEchoBeyondFrameLimit) {
+    if (!zero_copy()) {
+        GTEST_SKIP() << "io_uring backend buffers bulk frames like echo frames";
+    }
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string payload = make_payload(kMaxPayloadSize + 4 * 1024 * 1024);
+    std::string data;
+    append_frame(data, Opcode::kBulkEcho, payload.data(), payload.size());
+    // 紧跟在后面的帧要在splice完之后照常处理
+    append_frame(data, Opcode::kEcho, "after", 5);
+
+    std::vector<std::string> replies(2);
+    std::vector<Opcode> opcodes(2);
+    exchange(sock.get(), data, replies, opcodes);
+    EXPECT_EQ(opcodes[0], Opcode::kBulkEcho);
+    EXPECT_TRUE(replies[0] == payload);
+    EXPECT_EQ(replies[1], "after");
+}
+
+TEST_P(ZeroCopyTest, BulkEchoWithinFrameLimit) {
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string data;
+    std::vector<std::string> payloads;
+    for (size_t size : {0, 100, 1024 * 1024, 3 * 1024 * 1024 + 7}) {
+        payloads.push_back(make_payload(size));
+        append_frame(data, Opcode::kBulkEcho, payloads.back().data(), payloads.back().size());
+    }
+
+    std::vector<std::string> replies(payloads.size());
+    std::vector<Opcode> opcodes(payloads.size());
+    exchange(sock.get(), data, replies, opcodes);
+    for (size_t i = 0; i < payloads.size(); i++) {
+        EXPECT_EQ(opcodes[i], Opcode::kBulkEcho);
+        EXPECT_TRUE(replies[i] == payloads[i]) << "frame " << i;
+    }
+}
+
+TEST_P(ZeroCopyTest, BlockedBulkEchoDoesNotSpin) {
+    if (!zero_copy()) {
+        GTEST_SKIP() << "io_uring backend buffers bulk frames like echo frames";
+    }
+    // 只有一页的pipe, 里面有一段没搬出去的数据就占满了, 往里splice返回EAGAIN, 虽然按字节算还没满
+    // 客户端不读, 搬出去那边也是EAGAIN, 这时再关注EPOLLIN的话LT模式下socket里有数据就一直空转
+    transfer_options.pipe_size = 4096;
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    int rcvbuf = 16 * 1024;
+    setsockopt(sock.get(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    int nodelay = 1;
+    setsockopt(sock.get(), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    char header[kFrameHeaderSize];
+    encode_frame_header(header, Opcode::kBulkEcho, 64 * 1024 * 1024);
+    ASSERT_TRUE(send_all(sock.get(), header, sizeof(header)));
+    // 一小段一小段地发, 直到两边的缓冲区都满了
+    std::string chunk(500, 'x');
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    while (std::chrono::steady_clock::now() < deadline) {
+        pollfd pfd{sock.get(), POLLOUT, 0};
+        if (poll(&pfd, 1, 10) > 0 && send(sock.get(), chunk.data(), chunk.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+            && errno != EAGAIN) {
+            break;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    uint64_t before = server_.metrics().loop_iterations.get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // 没事可做的reactor只有定时器会唤醒它
+    EXPECT_LT(server_.metrics().loop_iterations.get() - before, 100u);
+}
+
+TEST_P(ZeroCopyTest, ServeFile) {
+    std::string content = make_payload(3 * 1024 * 1024 + 123);
+    write_file(content);
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string data;
+    append_frame(data, Opcode::kServeFile, "data.bin", 8);
+    append_frame(data, Opcode::kEcho, "after", 5);
+
+    std::vector<std::string> replies(2);
+    std::vector<Opcode> opcodes(2);
+    exchange(sock.get(), data, replies, opcodes);
+    if (zero_copy()) {
+        EXPECT_EQ(opcodes[0], Opcode::kServeFile);
+        EXPECT_TRUE(replies[0] == content);
+    } else {
+        EXPECT_EQ(opcodes[0], Opcode::kError);
+    }
+    EXPECT_EQ(replies[1], "after");
+}
+
+TEST_P(ZeroCopyTest, ServeFileRejectsBadPaths) {
+    write_file("secret");
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    const std::string paths[] = {"../data.bin", "/etc/passwd", "missing.bin", "", "."};
+    std::string data;
+    for (const std::string& path : paths) {
+        append_frame(data, Opcode::kServeFile, path.data(), path.size());
+    }
+
+    std::vector<std::string> replies(std::size(paths));
+    std::vector<Opcode> opcodes(std::size(paths));
+    exchange(sock.get(), data, replies, opcodes);
+    for (size_t i = 0; i < std::size(paths); i++) {
+        EXPECT_EQ(opcodes[i], Opcode::kError) << paths[i];
+    }
+}
+
+TEST_P(ZeroCopyTest, ServeFileRejectsFifoWithoutBlocking) {
+    // 没有写端的FIFO, 阻塞的open会一直等下去, 整个reactor都跟着卡住
+    std::string fifo = root_ + "/pipe";
+    ASSERT_EQ(mkfifo(fifo.c_str(), 0600), 0);
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string data;
+    append_frame(data, Opcode::kServeFile, "pipe", 4);
+    append_frame(data, Opcode::kEcho, "after", 5);
+    timeval timeout{2, 0};
+    setsockopt(sock.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::vector<std::string> replies(2);
+    std::vector<Opcode> opcodes(2);
+    exchange(sock.get(), data, replies, opcodes);
+    EXPECT_EQ(opcodes[0], Opcode::kError);
+    EXPECT_EQ(replies[1], "after");
+    unlink(fifo.c_str());
+}
+
+TEST_P(ZeroCopyTest, ServeFileRejectsSymlinkOutOfRoot) {
+    // root下面的符号链接指到root外面, 路径本身没有..也不能跟过去
+    std::string link = root_ + "/etc";
+    ASSERT_EQ(symlink("/etc", link.c_str()), 0);
+    Socket sock = server_.connect();
+    ASSERT_TRUE(sock.valid());
+    std::string data;
+    append_frame(data, Opcode::kServeFile, "etc/passwd", 10);
+    append_frame(data, Opcode::kEcho, "after", 5);
+
+    std::vector<std::string> replies(2);
+    std::vector<Opcode> opcodes(2);
+    exchange(sock.get(), data, replies, opcodes);
+    EXPECT_EQ(opcodes[0], Opcode::kError);
+    EXPECT_EQ(replies[1], "after");
+    unlink(link.c_str());
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, ZeroCopyTest,
+                         ::testing::Values(Backend::kEpollLevel, Backend::kEpollEdge, Backend::kUring),
+                         backend_test_name);
+
+}  // namespace
@@ -0,0 +1,175 @@
+#ifndef LINUX_SOCKET_TIMING_WHEEL_H
+#define LINUX_SOCKET_TIMING_WHEEL_H
+
+// 分层时间轮
+// 4层, 每层64个槽, 最底层一个槽是一个tick, 往上每层一个槽是下一层转一圈的时间
+// 定时器是嵌在连接对象里的双向链表节点, 挂上, 取消都是O(1), 不分配内存
+// 时间往前走时只处理最底层当前槽里的定时器, 上层槽在下层转完一圈时整体往下倒一次
+// 只给reactor自己的线程用, 不加锁
+
+#include <cstdint>
+#include <memory>
+
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    // 到期时间(毫秒), 实际触发会晚不到一个tick
+    uint64_t expire_ms = 0;
+    // 定时器属于谁, 到期时由回调自己转回去
+    void* owner = nullptr;
+
+    bool linked() const { return prev != nullptr; }
+};
+
+class TimingWheel {
+public:
+    static constexpr int kSlotBits = 6;
+    static constexpr uint64_t kSlotCount = 1ULL << kSlotBits;
+    static constexpr uint64_t kSlotMask = kSlotCount - 1;
+    static constexpr int kLevels = 4;
+
+    explicit TimingWheel(uint64_t tick_ms = 10) : tick_ms_(tick_ms), slots_(new TimerNode[kLevels * kSlotCount]) {
+        for (uint64_t i = 0; i < kLevels * kSlotCount; i++) {
+            slots_[i].prev = slots_[i].next = &slots_[i];
+        }
+    }
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    // 第一次使用前设置当前时间
+    void init(uint64_t now_ms) { current_tick_ = now_ms / tick_ms_; }
+
+    size_t size() const { return size_; }
+
+    // 挂上或者改时间, 已经过期的时间会在下一个tick触发
+    void schedule(TimerNode* node, uint64_t expire_ms) {
+        cancel(node);
+        node->expire_ms = expire_ms;
+        // 向上取整, 保证触发时一定已经到了expire_ms
+        uint64_t expire_tick = (expire_ms + tick_ms_ - 1) / tick_ms_;
+        insert(node, expire_tick);
+        size_++;
+    }
+
+    void cancel(TimerNode* node) {
+        if (!node->linked()) {
+            return;
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        size_--;
+    }
+
+    // 把时间推进到now_ms, 对每个到期的定时器调用func(TimerNode*), 回调里可以重新挂上或者取消任何定时器
+    template <typename Func>
+    void advance(uint64_t now_ms, Func func) {
+        uint64_t target_tick = now_ms / tick_ms_;
+        if (size_ == 0) {
+            current_tick_ = target_tick;
+            return;
+        }
+        while (current_tick_ < target_tick) {
+            current_tick_++;
+            cascade();
+            // 先把整个槽摘下来再一个个触发, 回调里新挂的定时器不会在这一轮被处理
+            TimerNode expired;
+            take_slot(slot(0, current_tick_ & kSlotMask), expired);
+            while (expired.next != &expired) {
+                TimerNode* node = expired.next;
+                unlink(node);
+                size_--;
+                func(node);
+            }
+            if (size_ == 0) {
+                current_tick_ = target_tick;
+                return;
+            }
+        }
+    }
+
+    // 距离下一次可能有定时器到期还有多少毫秒, 用作epoll_wait的超时, 没有定时器返回-1
+    // 最底层找不到时返回到下一次倒槽的时间, 最多多醒几次, 不会睡过头
+    int next_timeout(uint64_t now_ms) const {
+        if (size_ == 0) {
+            return -1;
+        }
+        uint64_t next_tick = current_tick_ + kSlotCount - (current_tick_ & kSlotMask);
+        for (uint64_t tick = current_tick_ + 1; tick < next_tick; tick++) {
+            const TimerNode& head = slots_[tick & kSlotMask];
+            if (head.next != &head) {
+                next_tick = tick;
+                break;
+            }
+        }
+        uint64_t next_ms = next_tick * tick_ms_;
+        return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+    }
+
+private:
+    TimerNode* slot(int level, uint64_t index) { return &slots_[level * kSlotCount + index]; }
+
+    // 当前tick的槽已经处理过了, 已经到期的挂到下一个tick; 倒槽时当前tick的槽还没处理, 可以直接挂进去
+    void insert(TimerNode* node, uint64_t expire_tick, bool cascading = false) {
+        uint64_t earliest_tick = cascading ? current_tick_ : current_tick_ + 1;
+        if (expire_tick < earliest_tick) {
+            expire_tick = earliest_tick;
+        }
+        uint64_t delta = expire_tick - current_tick_;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (1ULL << (kSlotBits * (level + 1)))) {
+            level++;
+        }
+        if (delta >= (1ULL << (kSlotBits * kLevels))) {
+            // 超出时间轮范围的先挂在最远的地方, 到时候回调发现没到期会自己重新挂
+            expire_tick = current_tick_ + (1ULL << (kSlotBits * kLevels)) - 1;
+        }
+        TimerNode* head = slot(level, (expire_tick >> (kSlotBits * level)) & kSlotMask);
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    // 下层转完一圈时把上层当前槽里的定时器按剩余时间重新挂到下层
+    void cascade() {
+        for (int level = 1; level < kLevels; level++) {
+            if ((current_tick_ & ((1ULL << (kSlotBits * level)) - 1)) != 0) {
+                break;
+            }
+            TimerNode list;
+            take_slot(slot(level, (current_tick_ >> (kSlotBits * level)) & kSlotMask), list);
+            while (list.next != &list) {
+                TimerNode* node = list.next;
+                unlink(node);
+                insert(node, (node->expire_ms + tick_ms_ - 1) / tick_ms_, true);
+            }
+        }
+    }
+
+    // 把head挂着的整条链表转给list, list是个空的哨兵
+    static void take_slot(TimerNode* head, TimerNode& list) {
+        if (head->next == head) {
+            list.prev = list.next = &list;
+            return;
+        }
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+    }
+
+    static void unlink(TimerNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    uint64_t tick_ms_;
+    uint64_t current_tick_ = 0;
+    size_t size_ = 0;
+    std::unique_ptr<TimerNode[]> slots_;
+};
+
+#endif
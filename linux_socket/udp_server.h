@@ -0,0 +1,346 @@
+#ifndef LINUX_SOCKET_UDP_SERVER_H
+#define LINUX_SOCKET_UDP_SERVER_H
+
+// UDP回声后端
+// 每个reactor一个UDP socket, 多个reactor时打开SO_REUSEPORT让内核按四元组把数据报分到各个socket
+// 一次recvmmsg收一批数据报, 原样回给发送方, 整批回复用一次sendmmsg发出去; 没有连接状态, 也没有帧协议, 一个数据报就是一条消息
+// 可选的卸载:
+//   GRO: 内核把同一个发送方连续的数据报合成一个大包交上来, 控制消息里带着每段的长度
+//   GSO: 发给同一个地址, 长度相同的连续回复合成一次发送, 用UDP_SEGMENT告诉内核按多长切开
+// 两个都开时GRO收上来的大包不用拆, 直接作为一次GSO发送回去
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "config.h"
+#include "logger.h"
+#include "metrics.h"
+#include "server_common.h"
+
+struct UdpOptions {
+    // 一次recvmmsg最多收多少个数据报
+    int batch = 64;
+    // 每次唤醒最多收多少批, 一直有包进来时也要回到poll, 检查退出和排空
+    int batches_per_wakeup = 16;
+    // 不开GRO时每个数据报的接收缓冲区大小, 更长的数据报会被截断, 直接丢掉
+    size_t max_datagram = 2048;
+    bool gso = false;
+    bool gro = false;
+};
+
+inline UdpOptions udp_options;
+
+inline void add_udp_options(OptionParser& parser) {
+    parser.add("udp-batch", &udp_options.batch, "datagrams per recvmmsg");
+    parser.add("udp-batches-per-wakeup", &udp_options.batches_per_wakeup, "max recvmmsg batches per wakeup");
+    parser.add("udp-max-datagram", &udp_options.max_datagram, "longest datagram accepted without GRO");
+    parser.add("udp-gso", &udp_options.gso, "send replies to the same peer as one UDP_SEGMENT send");
+    parser.add("udp-gro", &udp_options.gro, "let the kernel coalesce received datagrams with UDP_GRO");
+}
+
+inline bool check_udp_options() {
+    return udp_options.batch > 0 && udp_options.batches_per_wakeup > 0 && udp_options.max_datagram > 0 && udp_options.max_datagram <= 65535;
+}
+
+// 一次GSO发送最多切多少段, 总长不能超过一个UDP包
+constexpr int kMaxGsoSegments = 64;
+constexpr size_t kMaxGsoBytes = 65507;
+// 开GRO时合并后的包最长64KB
+constexpr size_t kGroBufferSize = 65535;
+
+// 创建UDP socket并绑定到socket_options的地址, 失败返回-1
+// 内核不支持UDP_GRO时关掉udp_options.gro继续运行
+inline int create_udp_fd(bool reuse_port) {
+    SocketAddress server_addr;
+    if (!resolve_address(socket_options.address, socket_options.port, server_addr)) {
+        LOG_ERROR("Invalid listen address: %s", socket_options.address.c_str());
+        return -1;
+    }
+    int fd = socket(server_addr.family(), SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        LOG_ERROR("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    int on = 1;
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        LOG_ERROR("Failed to set SO_REUSEPORT: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int v6only = socket_options.v6only ? 1 : 0;
+    if (server_addr.family() == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1) {
+        LOG_ERROR("Failed to set IPV6_V6ONLY: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // 包多的时候默认的接收缓冲区很快就满了, 用--rcvbuf/--sndbuf调大
+    if (socket_options.rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &socket_options.rcvbuf, sizeof(int)) == -1) {
+        LOG_ERROR("Failed to set SO_RCVBUF: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (socket_options.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &socket_options.sndbuf, sizeof(int)) == -1) {
+        LOG_ERROR("Failed to set SO_SNDBUF: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (udp_options.gro && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+        LOG_WARN("UDP_GRO is not supported, receive datagrams one by one: %s", strerror(errno));
+        udp_options.gro = false;
+    }
+    if (bind(fd, server_addr.get(), server_addr.len) == -1) {
+        LOG_ERROR("Failed to bind socket with address %s: %s", format_address(server_addr.get()).c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct UdpReactor {
+    int id = 0;
+    int fd = -1;
+    ReactorMetrics metrics;
+};
+
+// 一个reactor收发用的所有缓冲区, 启动时按选项分配好, 之后不再扩容, 里面的指针一直有效
+struct UdpBatch {
+    UdpBatch(int batch, size_t slot_size)
+        : size(batch),
+          slot_size(slot_size),
+          buffers(batch * slot_size),
+          addrs(batch),
+          recv_iovs(batch),
+          recv_controls(batch * kControlSize),
+          recv_msgs(batch),
+          send_iovs(batch * kMaxGsoSegments),
+          send_controls(batch * kMaxGsoSegments * kControlSize),
+          send_msgs(batch * kMaxGsoSegments),
+          send_segments(batch * kMaxGsoSegments),
+          send_segment_size(batch * kMaxGsoSegments) {
+        for (int i = 0; i < batch; i++) {
+            recv_iovs[i].iov_base = slot(i);
+            recv_iovs[i].iov_len = slot_size;
+            msghdr& msg = recv_msgs[i].msg_hdr;
+            msg.msg_name = &addrs[i];
+            msg.msg_iov = &recv_iovs[i];
+            msg.msg_iovlen = 1;
+        }
+    }
+
+    char* slot(int i) { return buffers.data() + i * slot_size; }
+
+    // 收之前重置内核会改写的长度
+    void prepare_recv() {
+        for (int i = 0; i < size; i++) {
+            msghdr& msg = recv_msgs[i].msg_hdr;
+            msg.msg_namelen = sizeof(sockaddr_storage);
+            msg.msg_control = udp_options.gro ? &recv_controls[i * kControlSize] : nullptr;
+            msg.msg_controllen = udp_options.gro ? kControlSize : 0;
+            msg.msg_flags = 0;
+        }
+    }
+
+    static constexpr size_t kControlSize = CMSG_SPACE(sizeof(int));
+
+    int size;
+    size_t slot_size;
+    std::vector<char> buffers;
+    std::vector<sockaddr_storage> addrs;
+    std::vector<iovec> recv_iovs;
+    std::vector<char> recv_controls;
+    std::vector<mmsghdr> recv_msgs;
+    // 回复: GRO合并的包不用GSO发时要拆开, 所以按每个数据报都单独一项来分配
+    std::vector<iovec> send_iovs;
+    std::vector<char> send_controls;
+    std::vector<mmsghdr> send_msgs;
+    // 每一项回复里有几个数据报, 每段多长
+    std::vector<int> send_segments;
+    std::vector<uint16_t> send_segment_size;
+};
+
+// GRO合并的包每段多长, 没有合并返回0
+inline int gro_segment_size(msghdr& msg) {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+    return 0;
+}
+
+inline bool same_address(const msghdr& a, const msghdr& b) {
+    return a.msg_namelen == b.msg_namelen && memcmp(a.msg_name, b.msg_name, a.msg_namelen) == 0;
+}
+
+// 把收到的received个数据报排成回复, 返回回复的项数
+// 开GSO时发给同一个地址, 段长相同的连续数据报合成一项, 只有最后一段可以短一些
+inline int build_echo_batch(UdpBatch& batch, int received, ReactorMetrics& metrics) {
+    int count = 0;
+    int iov_used = 0;
+    // 当前还能往后接的那一项, 最后一段比段长短时就不能再接了
+    mmsghdr* open = nullptr;
+    size_t open_segment = 0;
+    size_t open_bytes = 0;
+    for (int i = 0; i < received; i++) {
+        msghdr& in = batch.recv_msgs[i].msg_hdr;
+        size_t len = batch.recv_msgs[i].msg_len;
+        if (in.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            metrics.dropped_datagrams.add();
+            continue;
+        }
+        size_t segment = udp_options.gro ? gro_segment_size(in) : 0;
+        if (segment == 0 || segment > len) {
+            segment = len;
+        }
+        int segments = len == 0 ? 1 : (len + segment - 1) / segment;
+        metrics.messages_in.add(segments);
+        metrics.bytes_in.add(len);
+        char* data = batch.slot(i);
+
+        if (!udp_options.gso) {
+            // 不用GSO: GRO合并的包拆回一个个数据报
+            size_t offset = 0;
+            do {
+                iovec& iov = batch.send_iovs[iov_used++];
+                iov.iov_base = data + offset;
+                iov.iov_len = len - offset < segment ? len - offset : segment;
+                mmsghdr& out = batch.send_msgs[count];
+                out.msg_hdr = msghdr{};
+                out.msg_hdr.msg_name = in.msg_name;
+                out.msg_hdr.msg_namelen = in.msg_namelen;
+                out.msg_hdr.msg_iov = &iov;
+                out.msg_hdr.msg_iovlen = 1;
+                batch.send_segments[count++] = 1;
+                offset += segment;
+            } while (offset < len);
+            continue;
+        }
+
+        iovec& iov = batch.send_iovs[iov_used++];
+        iov.iov_base = data;
+        iov.iov_len = len;
+        // 单个数据报可以比段长短, 作为最后一段接上; GRO合并的包段长必须一样
+        bool fits = segments == 1 ? len > 0 && len <= open_segment : segment == open_segment;
+        if (open != nullptr && fits && same_address(open->msg_hdr, in)
+            && batch.send_segments[count - 1] + segments <= kMaxGsoSegments && open_bytes + len <= kMaxGsoBytes) {
+            // iov是连着分配的, 接在上一项的后面
+            open->msg_hdr.msg_iovlen++;
+            batch.send_segments[count - 1] += segments;
+            open_bytes += len;
+        } else {
+            mmsghdr& out = batch.send_msgs[count];
+            out.msg_hdr = msghdr{};
+            out.msg_hdr.msg_name = in.msg_name;
+            out.msg_hdr.msg_namelen = in.msg_namelen;
+            out.msg_hdr.msg_iov = &iov;
+            out.msg_hdr.msg_iovlen = 1;
+            batch.send_segments[count] = segments;
+            batch.send_segment_size[count++] = segment;
+            open = &out;
+            open_segment = segment;
+            open_bytes = len;
+        }
+        if (len == 0 || len % open_segment != 0) {
+            open = nullptr;
+        }
+    }
+
+    // 只有一段的项不带UDP_SEGMENT, 按普通数据报发
+    for (int i = 0; udp_options.gso && i < count; i++) {
+        if (batch.send_segments[i] <= 1) {
+            continue;
+        }
+        msghdr& msg = batch.send_msgs[i].msg_hdr;
+        msg.msg_control = &batch.send_controls[i * UdpBatch::kControlSize];
+        msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &batch.send_segment_size[i], sizeof(uint16_t));
+    }
+    return count;
+}
+
+// 把回复发出去; 发送缓冲区满了UDP也不会重传, 剩下的直接丢掉
+inline void send_echo_batch(UdpReactor& reactor, UdpBatch& batch, int count) {
+    ReactorMetrics& metrics = reactor.metrics;
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(reactor.fd, &batch.send_msgs[sent], count - sent, MSG_DONTWAIT);
+        if (n > 0) {
+            for (int i = sent; i < sent + n; i++) {
+                metrics.bytes_out.add(batch.send_msgs[i].msg_len);
+            }
+            sent += n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            metrics.partial_sends.add();
+            for (int i = sent; i < count; i++) {
+                metrics.dropped_datagrams.add(batch.send_segments[i]);
+            }
+            return;
+        }
+        // 第一项就失败了, 只丢这一项, 后面的接着发
+        LOG_WARN("Failed to send datagram: %s", strerror(errno));
+        metrics.dropped_datagrams.add(batch.send_segments[sent]);
+        sent++;
+    }
+}
+
+// UDP没有连接要排空, 收到优雅退出直接停
+inline void run_udp_reactor(UdpReactor& reactor) {
+    UdpBatch batch(udp_options.batch, udp_options.gro ? kGroBufferSize : udp_options.max_datagram);
+    pollfd fds[2] = {{reactor.fd, POLLIN, 0}, {drain_event_fd, POLLIN, 0}};
+    nfds_t nfds = drain_event_fd != -1 ? 2 : 1;
+    while (!shutdown_server.load(std::memory_order_relaxed) && !drain_server.load(std::memory_order_relaxed)) {
+        int ready = poll(fds, nfds, 5000);
+        if (ready == -1 && errno != EINTR) {
+            LOG_ERROR("[reactor %d] Failed to poll udp socket: %s", reactor.id, strerror(errno));
+            shutdown_server = true;
+        }
+        if (ready <= 0 || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        uint64_t loop_start = now_ns();
+        reactor.metrics.loop_iterations.add();
+        // 和accept一样限制每次唤醒的批数, 没收完的数据报还在socket里, poll会马上再返回
+        for (int i = 0; i < udp_options.batches_per_wakeup; i++) {
+            batch.prepare_recv();
+            int received = recvmmsg(reactor.fd, batch.recv_msgs.data(), batch.size, MSG_DONTWAIT, nullptr);
+            if (received == -1) {
+                if (errno == EINTR) {
+                    i--;
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_WARN("[reactor %d] Failed to receive datagrams: %s", reactor.id, strerror(errno));
+                }
+                break;
+            }
+            reactor.metrics.events_per_wakeup.record(received);
+            send_echo_batch(reactor, batch, build_echo_batch(batch, received, reactor.metrics));
+            if (received < batch.size) {
+                // 没收满说明已经收空了, 省一次返回EAGAIN的系统调用
+                break;
+            }
+        }
+        reactor.metrics.loop_time_ns.record(now_ns() - loop_start);
+    }
+    close(reactor.fd);
+}
+
+#endif
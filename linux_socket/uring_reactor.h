@@ -0,0 +1,723 @@
+#ifndef LINUX_SOCKET_URING_REACTOR_H
+#define LINUX_SOCKET_URING_REACTOR_H
+
+// io_uring后端
+// 监听socket挂一个multishot accept, 每个连接挂一个multishot recv, 数据由内核直接收进提供的缓冲区环里,
+// 发送用sendmsg, 每轮循环产生的所有sqe用一次io_uring_enter提交并顺便等待下一批完成事件
+// 这样一个繁忙的连接几乎不需要额外的系统调用, 协议处理和epoll后端一样走handle_frames
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "connection_table.h"
+#include "server_common.h"
+
+// 直接用系统调用和mmap操作io_uring, 不依赖liburing
+class Uring {
+public:
+    Uring() = default;
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+    ~Uring() { destroy(); }
+
+    // 必须在之后提交sqe的那个线程里调用, 因为开了IORING_SETUP_SINGLE_ISSUER
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        // 只有reactor线程自己提交和收割, 告诉内核之后可以省掉很多跨线程的唤醒
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN
+                     | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        // multishot请求一个sqe会产生很多cqe, CQ要比SQ大得多
+        params.cq_entries = entries * 4;
+        ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd_ == -1 && errno == EINVAL) {
+            // 老内核不认识这些标志, 退回默认设置
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ring_fd_ == -1) {
+            LOG_ERROR("Failed to setup io_uring: %s", strerror(errno));
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+            LOG_ERROR("Kernel is too old for io_uring backend");
+            destroy();
+            return false;
+        }
+
+        size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ring_size_ = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+        ring_ptr_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (ring_ptr_ == MAP_FAILED) {
+            ring_ptr_ = nullptr;
+            LOG_ERROR("Failed to mmap io_uring: %s", strerror(errno));
+            destroy();
+            return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            LOG_ERROR("Failed to mmap io_uring sqes: %s", strerror(errno));
+            destroy();
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        char* ptr = static_cast<char*>(ring_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(ptr + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(ptr + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(ptr + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        cq_head_ = reinterpret_cast<unsigned*>(ptr + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(ptr + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(ptr + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(ptr + params.cq_off.cqes);
+
+        // sq数组和sqe一一对应, 初始化一次之后就不用再管了
+        unsigned* sq_array = reinterpret_cast<unsigned*>(ptr + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; i++) {
+            sq_array[i] = i;
+        }
+        sqe_tail_ = *sq_tail_;
+        return true;
+    }
+
+    // 取一个清零的sqe, SQ满了先把已有的提交掉
+    io_uring_sqe* get_sqe() {
+        if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            if (submit(0, -1) == -1 || sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+                return nullptr;
+            }
+        }
+        io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+        sqe_tail_++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // 提交所有准备好的sqe, 并等待至少wait_nr个完成事件, timeout_ms < 0表示一直等
+    // 返回值和io_uring_enter相同, 超时时errno为ETIME
+    int submit(unsigned wait_nr, int timeout_ms) {
+        unsigned to_submit = sqe_tail_ - *sq_tail_;
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        if (wait_nr > 0 && timeout_ms >= 0) {
+            __kernel_timespec ts{};
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            io_uring_getevents_arg arg{};
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+            return syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        }
+        return syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags, nullptr, 0);
+    }
+
+    // 依次处理所有已经完成的cqe, 返回处理了多少个
+    template <typename Func>
+    unsigned for_each_cqe(Func func) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        while (head != tail) {
+            // 拷贝一份再处理, 回调里可能会提交新的sqe
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            head++;
+            count++;
+            func(cqe);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    int register_buf_ring(void* ring_addr, unsigned entries, uint16_t bgid) {
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring_addr);
+        reg.ring_entries = entries;
+        reg.bgid = bgid;
+        return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1);
+    }
+
+    void destroy() {
+        if (sqes_ != nullptr) {
+            munmap(sqes_, sqes_size_);
+            sqes_ = nullptr;
+        }
+        if (ring_ptr_ != nullptr) {
+            munmap(ring_ptr_, ring_size_);
+            ring_ptr_ = nullptr;
+        }
+        if (ring_fd_ != -1) {
+            close(ring_fd_);
+            ring_fd_ = -1;
+        }
+    }
+
+private:
+    int ring_fd_ = -1;
+    void* ring_ptr_ = nullptr;
+    size_t ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    // 本地的sq尾部, 提交时才写回共享的sq_tail_
+    unsigned sqe_tail_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+// 提供给内核的缓冲区环, multishot recv收到数据时由内核自己挑一块缓冲区写进去
+class ProvidedBuffers {
+public:
+    ProvidedBuffers() = default;
+    ProvidedBuffers(const ProvidedBuffers&) = delete;
+    ProvidedBuffers& operator=(const ProvidedBuffers&) = delete;
+    ~ProvidedBuffers() {
+        if (ring_ != nullptr) {
+            munmap(ring_, ring_mem_size_);
+        }
+    }
+
+    // count必须是2的幂, 缓冲区编号只有16位, 最多32768个
+    bool init(Uring& uring, unsigned count, size_t buf_size, uint16_t bgid) {
+        if (count == 0 || (count & (count - 1)) != 0 || count > 32768 || buf_size == 0) {
+            LOG_ERROR("Invalid provided buffers: count %u, size %zu", count, buf_size);
+            return false;
+        }
+        ring_mem_size_ = count * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, ring_mem_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) {
+            LOG_ERROR("Failed to mmap buffer ring: %s", strerror(errno));
+            return false;
+        }
+        ring_ = static_cast<io_uring_buf_ring*>(ring);
+        mask_ = count - 1;
+        buf_size_ = buf_size;
+        memory_.reset(new char[count * buf_size]);
+        if (uring.register_buf_ring(ring_, count, bgid) == -1) {
+            LOG_ERROR("Failed to register buffer ring: %s", strerror(errno));
+            return false;
+        }
+        for (unsigned i = 0; i < count; i++) {
+            recycle(i);
+        }
+        publish();
+        return true;
+    }
+
+    char* buffer(uint16_t bid) { return memory_.get() + bid * buf_size_; }
+
+    // 把用完的缓冲区还给内核, publish之后才生效
+    void recycle(uint16_t bid) {
+        // 老版本头文件里bufs用__DECLARE_FLEX_ARRAY声明, 在C++里空结构体占1字节会让bufs偏移8字节,
+        // 所以不用ring_->bufs, 直接按io_uring_buf数组来算地址
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(ring_)[(tail_ + pending_) & mask_];
+        buf.addr = reinterpret_cast<uint64_t>(buffer(bid));
+        buf.len = buf_size_;
+        buf.bid = bid;
+        pending_++;
+    }
+
+    // 一批cqe处理完之后统一更新一次环的尾部
+    void publish() {
+        if (pending_ == 0) {
+            return;
+        }
+        tail_ += pending_;
+        pending_ = 0;
+        __atomic_store_n(&ring_->tail, tail_, __ATOMIC_RELEASE);
+    }
+
+private:
+    io_uring_buf_ring* ring_ = nullptr;
+    size_t ring_mem_size_ = 0;
+    std::unique_ptr<char[]> memory_;
+    size_t buf_size_ = 0;
+    unsigned mask_ = 0;
+    uint16_t tail_ = 0;
+    uint16_t pending_ = 0;
+};
+
+// io_uring后端的参数, 启动时设置好, 之后只读
+struct UringOptions {
+    // 提交队列的大小
+    unsigned entries = 1024;
+    // 每个reactor给内核多少个接收缓冲区, 每个多大; 个数必须是2的幂
+    unsigned buf_count = 1024;
+    size_t buf_size = 16 * 1024;
+};
+
+inline UringOptions uring_options;
+
+inline void add_uring_options(OptionParser& parser) {
+    parser.add("uring-entries", &uring_options.entries, "io_uring submission queue entries");
+    parser.add("uring-buf-count", &uring_options.buf_count, "provided receive buffers per reactor, power of 2");
+    parser.add("uring-buf-size", &uring_options.buf_size, "size of each provided receive buffer");
+}
+
+constexpr uint16_t kUringBufGroup = 0;
+// 一次sendmsg最多带多少段, 剩下的等这次发完再发
+constexpr int kUringMaxIov = 64;
+
+// user_data高32位是操作类型, 低32位是fd
+// 连接在所有请求都完成之前不会close(fd), 所以fd不会被复用, 不需要额外的代数
+enum UringOp : uint64_t {
+    kOpAccept = 1,
+    kOpRecv = 2,
+    kOpSend = 3,
+    // 背压时取消multishot recv, 它自己的完成事件不用处理
+    kOpCancel = 4,
+    // drain_event_fd上的poll, 完成说明要开始优雅退出
+    kOpDrain = 5,
+};
+
+inline uint64_t make_user_data(UringOp op, int fd) {
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+struct UringClient : Connection {
+    void reset(int fd) {
+        Connection::reset(fd);
+        recv_armed = false;
+        send_inflight = false;
+        closing = false;
+        send_len = 0;
+    }
+
+    // multishot recv还挂在内核里
+    bool recv_armed = false;
+    // 每个连接同时最多一个sendmsg在飞, 保证发送顺序
+    bool send_inflight = false;
+    // 已经决定关闭, 等在飞的请求都回来再真正close
+    bool closing = false;
+    // 在飞的sendmsg一共要发多少字节, 回来的比这少就是部分发送
+    size_t send_len = 0;
+    // sendmsg在完成之前内核会一直引用这两个, 所以放在连接里而不是栈上
+    msghdr send_msg{};
+    iovec send_iov[kUringMaxIov];
+};
+
+struct UringReactor {
+    int id = 0;
+    int listen_fd = -1;
+    Uring ring;
+    ProvidedBuffers buffers;
+    // 连接对象的地址不会变, 在飞的sendmsg可以放心引用UringClient里的字段
+    ConnectionTable<UringClient> clients;
+    ReactorMetrics metrics;
+    TimingWheel timers;
+    // 每轮io_uring_enter返回后更新一次
+    uint64_t now_ms = 0;
+    // 开始优雅退出之后, 到drain_deadline_ms还没关的连接直接关掉
+    bool draining = false;
+    uint64_t drain_deadline_ms = 0;
+};
+
+inline bool arm_accept(UringReactor& reactor) {
+    io_uring_sqe* sqe = reactor.ring.get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor.listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(kOpAccept, reactor.listen_fd);
+    return true;
+}
+
+inline bool arm_drain_poll(UringReactor& reactor) {
+    io_uring_sqe* sqe = reactor.ring.get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = drain_event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = make_user_data(kOpDrain, drain_event_fd);
+    return true;
+}
+
+inline bool arm_recv(UringReactor& reactor, UringClient& client) {
+    io_uring_sqe* sqe = reactor.ring.get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client.client_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kUringBufGroup;
+    sqe->user_data = make_user_data(kOpRecv, client.client_fd);
+    client.recv_armed = true;
+    return true;
+}
+
+// 取消挂着的multishot recv, 被取消的recv会带着-ECANCELED回来
+inline bool cancel_recv(UringReactor& reactor, UringClient& client) {
+    io_uring_sqe* sqe = reactor.ring.get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_user_data(kOpRecv, client.client_fd);
+    sqe->user_data = make_user_data(kOpCancel, client.client_fd);
+    return true;
+}
+
+// 有数据要发并且没有sendmsg在飞时提交一个, 它会在下一次submit时和其他sqe一起进内核
+inline bool queue_send(UringReactor& reactor, UringClient& client) {
+    if (client.send_inflight || client.send_buf.empty()) {
+        return true;
+    }
+    io_uring_sqe* sqe = reactor.ring.get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    client.send_msg = msghdr{};
+    client.send_msg.msg_iov = client.send_iov;
+    client.send_msg.msg_iovlen = client.send_buf.fill_iovec(client.send_iov, kUringMaxIov);
+    client.send_len = 0;
+    for (size_t i = 0; i < client.send_msg.msg_iovlen; i++) {
+        client.send_len += client.send_iov[i].iov_len;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client.client_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&client.send_msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(kOpSend, client.client_fd);
+    client.send_inflight = true;
+    return true;
+}
+
+// 所有请求都回来之后才真正关闭fd并释放连接
+inline void release_if_idle(UringReactor& reactor, UringClient& client) {
+    if (client.recv_armed || client.send_inflight) {
+        return;
+    }
+    close(client.client_fd);
+    reactor.clients.close(&client);
+    reactor.metrics.active_connections.sub();
+    release_connection();
+}
+
+inline void close_uring_client(UringReactor& reactor, UringClient& client) {
+    if (client.closing) {
+        return;
+    }
+    client.closing = true;
+    reactor.timers.cancel(&client.timer);
+    // 让挂着的recv和sendmsg尽快带着错误或者0字节回来
+    shutdown(client.client_fd, SHUT_RDWR);
+    release_if_idle(reactor, client);
+}
+
+inline void handle_uring_accept(UringReactor& reactor, const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE) && !reactor.draining) {
+        // multishot accept被内核停掉了(比如出错), 重新挂上
+        arm_accept(reactor);
+    }
+    if (cqe.res < 0) {
+        if (cqe.res != -ECANCELED) {
+            LOG_WARN("Failed to accept client: %s", strerror(-cqe.res));
+        }
+        return;
+    }
+    int client_fd = cqe.res;
+    if (!reserve_connection()) {
+        // 连接数满了, 直接关掉
+        close(client_fd);
+        reactor.metrics.rejected_connections.add();
+        return;
+    }
+    if (log_config.accept) {
+        // multishot accept不带对端地址, 要打日志时再查一次
+        LOG_INFO("[reactor %d] %s connected", reactor.id, peer_address(client_fd).c_str());
+    }
+
+    UringClient& client = *reactor.clients.open(client_fd);
+    reactor.metrics.accepts.add();
+    reactor.metrics.active_connections.add();
+    client.last_active_ms = reactor.now_ms;
+    update_connection_timer(reactor.timers, client);
+    if (reactor.draining) {
+        // 取消accept生效之前还可能收到连接, 对面已经连上了, 直接关掉会被当成失败; 和已有的连接一样排空,
+        // 不读新请求, 下一轮uring_drain_step里shutdown写端, 再读到对面关连接为止
+        client.draining = true;
+        client.read_paused = true;
+        return;
+    }
+    if (!arm_recv(reactor, client)) {
+        LOG_WARN("Failed to get sqe, discard client");
+        close_uring_client(reactor, client);
+    }
+}
+
+// 处理recv_buf里的帧并提交发送, 发送队列超过高水位时取消recv暂停接收, 返回false表示要关闭连接
+inline bool process_uring_input(UringReactor& reactor, UringClient& client) {
+    if (!handle_frames(client, reactor.metrics, reactor.now_ms) || !queue_send(reactor, client)) {
+        return false;
+    }
+    // 发送队列刚从空变成有数据时要从这里开始算写超时, 在飞的sendmsg一直完不成就不会有handle_uring_send来算
+    update_write_state(client, false, reactor.now_ms);
+    if (update_backpressure(client, reactor.metrics) && client.read_paused && client.recv_armed) {
+        if (!cancel_recv(reactor, client)) {
+            return false;
+        }
+    }
+    update_connection_timer(reactor.timers, client);
+    return true;
+}
+
+inline void handle_uring_recv(UringReactor& reactor, UringClient& client, const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        client.recv_armed = false;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && !client.closing && !client.write_shut) {
+            // 帧可能跨越多块提供的缓冲区, 所以搬进连接自己的recv_buf里再解析, 缓冲区马上还给内核
+            char* buf = client.recv_buf.prepare(cqe.res);
+            memcpy(buf, reactor.buffers.buffer(bid), cqe.res);
+            client.recv_buf.commit(cqe.res);
+            reactor.metrics.bytes_in.add(cqe.res);
+        }
+        reactor.buffers.recycle(bid);
+    }
+
+    if (client.closing) {
+        release_if_idle(reactor, client);
+        return;
+    }
+    if (cqe.res == 0) {
+        // 对面关了连接
+        close_uring_client(reactor, client);
+        return;
+    }
+    if (cqe.res == -ECANCELED) {
+        // 背压取消的recv; 取消生效之前可能已经恢复了, 这时马上重新挂上
+        if (!client.recv_armed && !client.read_paused && !arm_recv(reactor, client)) {
+            close_uring_client(reactor, client);
+        }
+        return;
+    }
+    if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+        LOG_WARN("Failed to receive message, disconnect: %s", strerror(-cqe.res));
+        close_uring_client(reactor, client);
+        return;
+    }
+    if (client.write_shut) {
+        // 优雅退出时回复都发完了, 收到的数据直接丢掉, 等对面关连接
+        if (!client.recv_armed && !arm_recv(reactor, client)) {
+            close_uring_client(reactor, client);
+        }
+        return;
+    }
+    if (client.read_paused) {
+        // 取消生效之前还会收到一些数据, 先攒在recv_buf里, 恢复之后再处理
+        return;
+    }
+    if (cqe.res > 0 && !process_uring_input(reactor, client)) {
+        close_uring_client(reactor, client);
+        return;
+    }
+    // 缓冲区环被用光(ENOBUFS)时multishot会停, 这一批用完的缓冲区还回去之后重新挂上
+    if (!client.recv_armed && !client.read_paused && !arm_recv(reactor, client)) {
+        close_uring_client(reactor, client);
+    }
+}
+
+inline void handle_uring_send(UringReactor& reactor, UringClient& client, const io_uring_cqe& cqe) {
+    client.send_inflight = false;
+    if (client.closing) {
+        release_if_idle(reactor, client);
+        return;
+    }
+    if (cqe.res <= 0) {
+        LOG_WARN("Error occur when sending message, disconnect: %s", strerror(-cqe.res));
+        close_uring_client(reactor, client);
+        return;
+    }
+    // 部分发送只是把偏移往后移, 剩下的接着发
+    reactor.metrics.bytes_out.add(cqe.res);
+    if ((size_t)cqe.res < client.send_len) {
+        reactor.metrics.partial_sends.add();
+    }
+    client.send_buf.consume(cqe.res);
+    update_write_state(client, true, reactor.now_ms);
+    if (!queue_send(reactor, client)) {
+        close_uring_client(reactor, client);
+        return;
+    }
+    if (update_backpressure(client, reactor.metrics) && !client.read_paused) {
+        // 发送队列降到低水位以下了, 先处理暂停期间攒下的数据, 再重新挂上recv
+        if (!process_uring_input(reactor, client)
+            || (!client.read_paused && !client.recv_armed && !arm_recv(reactor, client))) {
+            close_uring_client(reactor, client);
+            return;
+        }
+    }
+    update_connection_timer(reactor.timers, client);
+}
+
+inline void handle_uring_cqe(UringReactor& reactor, const io_uring_cqe& cqe) {
+    UringOp op = static_cast<UringOp>(cqe.user_data >> 32);
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+    if (op == kOpAccept) {
+        handle_uring_accept(reactor, cqe);
+        return;
+    }
+    if (op == kOpCancel || op == kOpDrain) {
+        // 优雅退出在每轮的最后统一检查drain_server
+        return;
+    }
+    UringClient* client = reactor.clients.find(fd);
+    if (client == nullptr) {
+        return;
+    }
+    if (op == kOpRecv) {
+        handle_uring_recv(reactor, *client, cqe);
+    } else if (op == kOpSend) {
+        handle_uring_send(reactor, *client, cqe);
+    }
+}
+
+// 开始优雅退出: 取消accept并关掉监听socket, 所有连接不再读新请求
+inline void start_uring_drain(UringReactor& reactor) {
+    reactor.draining = true;
+    reactor.drain_deadline_ms = reactor.now_ms + server_limits.drain_timeout_ms;
+    io_uring_sqe* sqe = reactor.ring.get_sqe();
+    if (sqe != nullptr) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = make_user_data(kOpAccept, reactor.listen_fd);
+        sqe->user_data = make_user_data(kOpCancel, reactor.listen_fd);
+    }
+    // 在飞的accept自己引用着监听socket, 这里关掉fd不影响取消
+    close(reactor.listen_fd);
+    std::vector<UringClient*> failed;
+    reactor.clients.for_each([&reactor, &failed](UringClient& client) {
+        if (client.closing) {
+            return;
+        }
+        client.draining = true;
+        client.read_paused = true;
+        if (client.recv_armed && !cancel_recv(reactor, client)) {
+            failed.push_back(&client);
+        }
+    });
+    for (UringClient* client : failed) {
+        close_uring_client(reactor, *client);
+    }
+    LOG_INFO("[reactor %d] draining %zu connections", reactor.id, reactor.clients.size());
+}
+
+// 优雅退出期间每轮调用一次: 回复发完的连接shutdown写端, 到了截止时间就全部关掉
+// 所有连接都释放了返回true
+inline bool uring_drain_step(UringReactor& reactor) {
+    bool expired = reactor.now_ms >= reactor.drain_deadline_ms;
+    std::vector<UringClient*> to_close;
+    reactor.clients.for_each([&](UringClient& client) {
+        if (client.closing) {
+            return;
+        }
+        if (expired) {
+            to_close.push_back(&client);
+        } else if (shut_drained_connection(client) && !client.recv_armed && !arm_recv(reactor, client)) {
+            to_close.push_back(&client);
+        }
+    });
+    for (UringClient* client : to_close) {
+        close_uring_client(reactor, *client);
+    }
+    return reactor.clients.size() == 0;
+}
+
+inline void run_uring_reactor(UringReactor& reactor) {
+    // 开了SINGLE_ISSUER, io_uring要在reactor自己的线程里创建
+    if (!reactor.ring.init(uring_options.entries)
+        || !reactor.buffers.init(reactor.ring, uring_options.buf_count, uring_options.buf_size, kUringBufGroup)
+        || !arm_accept(reactor) || (drain_event_fd != -1 && !arm_drain_poll(reactor))) {
+        shutdown_server = true;
+        close(reactor.listen_fd);
+        return;
+    }
+    reactor.now_ms = now_ns() / 1000000;
+    reactor.timers.init(reactor.now_ms);
+
+    while (!shutdown_server.load(std::memory_order_relaxed)) {
+        // 上一轮产生的所有sqe在这里一次提交, 同时等待下一批完成事件, 最多等到下一个定时器到期
+        int timeout = reactor.timers.next_timeout(reactor.now_ms);
+        if (timeout < 0 || timeout > 5000) {
+            timeout = 5000;
+        }
+        if (reactor.draining) {
+            uint64_t drain_left = reactor.drain_deadline_ms > reactor.now_ms ? reactor.drain_deadline_ms - reactor.now_ms : 0;
+            if (drain_left < (uint64_t)timeout) {
+                timeout = (int)drain_left;
+            }
+        }
+        if (reactor.ring.submit(1, timeout) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            LOG_ERROR("Failed to wait io_uring events: %s", strerror(errno));
+            shutdown_server = true;
+            break;
+        }
+        uint64_t loop_start = now_ns();
+        reactor.now_ms = loop_start / 1000000;
+        unsigned cqe_count = reactor.ring.for_each_cqe([&reactor](const io_uring_cqe& cqe) {
+            handle_uring_cqe(reactor, cqe);
+        });
+        reactor.timers.advance(reactor.now_ms, [&reactor](TimerNode* timer) {
+            UringClient& client = *static_cast<UringClient*>(static_cast<Connection*>(timer->owner));
+            const char* reason = check_connection_timeout(reactor.timers, client, reactor.now_ms);
+            if (reason != nullptr) {
+                LOG_INFO("[reactor %d] fd %d %s timeout, disconnect", reactor.id, client.client_fd, reason);
+                reactor.metrics.timeouts.add();
+                close_uring_client(reactor, client);
+            }
+        });
+        if (drain_server.load(std::memory_order_relaxed) && !reactor.draining) {
+            start_uring_drain(reactor);
+        }
+        bool drained = reactor.draining && uring_drain_step(reactor);
+        reactor.buffers.publish();
+        reactor.clients.reclaim();
+        reactor.metrics.loop_iterations.add();
+        reactor.metrics.events_per_wakeup.record(cqe_count);
+        reactor.metrics.loop_time_ns.record(now_ns() - loop_start);
+        if (drained) {
+            LOG_INFO("[reactor %d] drained", reactor.id);
+            break;
+        }
+    }
+
+    // 先关fd和io_uring, 让内核放掉对发送缓冲区的引用, 再释放连接
+    reactor.clients.for_each([](UringClient& client) {
+        close(client.client_fd);
+    });
+    if (!reactor.draining) {
+        close(reactor.listen_fd);
+    }
+    reactor.ring.destroy();
+    reactor.clients.clear();
+}
+
+#endif
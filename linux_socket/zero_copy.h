@@ -0,0 +1,257 @@
+#ifndef LINUX_SOCKET_ZERO_COPY_H
+#define LINUX_SOCKET_ZERO_COPY_H
+
+// 大块数据的零拷贝传输
+// 大的回声payload用splice经过一个pipe从socket直接搬回socket, 文件用sendfile直接从page cache发出去,
+// 数据都不经过用户态, 也不用按几KB一次的recv/send来回拷
+// 阻塞和非阻塞的fd都能用: 非阻塞时搬到某一边EAGAIN就停下, 告诉调用者在等哪一边
+
+#include <linux/openat2.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// 启动时设置好, 之后只读
+struct TransferOptions {
+    // 可以用serve file请求下载的文件都要在这个目录下, 空的表示不提供文件
+    std::string file_root;
+    // 每个pipe的容量, 越大splice的次数越少; 超过/proc/sys/fs/pipe-max-size时用系统默认值
+    int pipe_size = 1024 * 1024;
+};
+
+inline TransferOptions transfer_options;
+
+// splice用的中转pipe, 连接第一次需要时才创建
+class Pipe {
+public:
+    Pipe() = default;
+    Pipe(const Pipe&) = delete;
+    Pipe& operator=(const Pipe&) = delete;
+    ~Pipe() { close(); }
+
+    bool open() {
+        if (read_fd != -1) {
+            return true;
+        }
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return false;
+        }
+        read_fd = fds[0];
+        write_fd = fds[1];
+        // 调不大就用默认的64KB
+        fcntl(write_fd, F_SETPIPE_SZ, transfer_options.pipe_size);
+        int capacity_bytes = fcntl(write_fd, F_GETPIPE_SZ);
+        capacity = capacity_bytes > 0 ? capacity_bytes : 64 * 1024;
+        buffered = 0;
+        return true;
+    }
+
+    void close() {
+        if (read_fd != -1) {
+            ::close(read_fd);
+            ::close(write_fd);
+        }
+        read_fd = write_fd = -1;
+        buffered = 0;
+    }
+
+    int read_fd = -1;
+    int write_fd = -1;
+    size_t capacity = 0;
+    // 已经搬进pipe还没搬出去的字节数
+    size_t buffered = 0;
+};
+
+enum class TransferKind : uint8_t {
+    kNone,
+    kBulkEcho,  // 把socket上后面的remaining字节splice回同一个socket
+    kFile,      // 把file_fd从file_offset开始的remaining字节sendfile出去
+};
+
+// 一个连接上正在进行的零拷贝传输, 进行期间不解析后面的帧, 传完了再接着处理
+struct Transfer {
+    bool active() const { return kind != TransferKind::kNone; }
+
+    // 传完或者连接关闭时调用, pipe留着给这个连接的下一次传输用
+    void finish() {
+        if (file_fd != -1) {
+            close(file_fd);
+            file_fd = -1;
+        }
+        kind = TransferKind::kNone;
+        remaining = 0;
+        file_offset = 0;
+    }
+
+    TransferKind kind = TransferKind::kNone;
+    uint64_t remaining = 0;
+    int file_fd = -1;
+    off_t file_offset = 0;
+    Pipe pipe;
+};
+
+// splice_relay和send_file_chunk的结果, blocked表示停下来是因为哪一边暂时不能读写
+struct TransferProgress {
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    bool in_blocked = false;
+    bool out_blocked = false;
+};
+
+// 把in_fd上接下来的remaining字节经过pipe搬到out_fd, 每搬进来一段就扣掉remaining
+// 全部搬完或者两边都动不了时返回; 对面在payload发完之前关了连接也算出错, 返回false
+// flags传SPLICE_F_NONBLOCK表示fd是非阻塞的
+inline bool splice_relay(int in_fd, int out_fd, Pipe& pipe, uint64_t& remaining, unsigned flags, TransferProgress& progress) {
+    progress.in_blocked = progress.out_blocked = false;
+    while (remaining > 0 || pipe.buffered > 0) {
+        bool progressed = false;
+        progress.in_blocked = progress.out_blocked = false;
+        if (remaining > 0 && pipe.buffered < pipe.capacity) {
+            size_t want = pipe.capacity - pipe.buffered;
+            if (want > remaining) {
+                want = remaining;
+            }
+            ssize_t len = splice(in_fd, nullptr, pipe.write_fd, nullptr, want, SPLICE_F_MOVE | flags);
+            if (len > 0) {
+                remaining -= len;
+                pipe.buffered += len;
+                progress.bytes_in += len;
+                progressed = true;
+            } else if (len == 0) {
+                errno = ECONNRESET;
+                return false;
+            } else if (errno == EAGAIN) {
+                // socket里暂时没数据了, 也可能是pipe按页算已经满了, 下一轮搬出去一些之后会再试
+                progress.in_blocked = true;
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+        if (pipe.buffered > 0) {
+            unsigned more = remaining > 0 ? SPLICE_F_MORE : 0;
+            ssize_t len = splice(pipe.read_fd, nullptr, out_fd, nullptr, pipe.buffered, SPLICE_F_MOVE | flags | more);
+            if (len > 0) {
+                pipe.buffered -= len;
+                progress.bytes_out += len;
+                progressed = true;
+            } else if (len == -1 && errno == EAGAIN) {
+                progress.out_blocked = true;
+            } else if (len == -1 && errno != EINTR) {
+                return false;
+            }
+        }
+        if (!progressed && (progress.in_blocked || progress.out_blocked)) {
+            break;
+        }
+    }
+    return true;
+}
+
+// 从file_fd的offset开始往out_fd发remaining字节, 发完或者out_fd写不进去时返回, 出错返回false
+inline bool send_file_chunk(int out_fd, int file_fd, off_t& offset, uint64_t& remaining, TransferProgress& progress) {
+    progress.out_blocked = false;
+    while (remaining > 0) {
+        size_t want = remaining > (1U << 30) ? (1U << 30) : remaining;
+        ssize_t len = sendfile(out_fd, file_fd, &offset, want);
+        if (len > 0) {
+            remaining -= len;
+            progress.bytes_out += len;
+        } else if (len == 0) {
+            // 文件在发送过程中被截短了, 已经发出去的帧头对不上了, 只能断开
+            errno = EIO;
+            return false;
+        } else if (errno == EAGAIN) {
+            progress.out_blocked = true;
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 打开root下的相对路径path, 解析过程中不能离开root, 符号链接指到root外面也不行, 失败返回-1并设置errno
+// 用openat2的RESOLVE_BENEATH让内核检查; 老内核没有openat2时先realpath, 再看解析出来的路径是不是在root下面
+inline int open_beneath(const std::string& root, const std::string& path, int flags) {
+#ifdef SYS_openat2
+    int root_fd = open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        return -1;
+    }
+    open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd = syscall(SYS_openat2, root_fd, path.c_str(), &how, sizeof(how));
+    int saved_errno = errno;
+    close(root_fd);
+    if (fd != -1 || saved_errno != ENOSYS) {
+        errno = saved_errno;
+        return fd;
+    }
+#endif
+    char real_root[PATH_MAX];
+    char real_path[PATH_MAX];
+    if (realpath(root.c_str(), real_root) == nullptr || realpath((root + "/" + path).c_str(), real_path) == nullptr) {
+        return -1;
+    }
+    size_t root_len = strlen(real_root);
+    if (strncmp(real_path, real_root, root_len) != 0 || (real_path[root_len] != '/' && real_root[root_len - 1] != '/')) {
+        errno = EXDEV;
+        return -1;
+    }
+    return open(real_path, flags);
+}
+
+// 在file_root下打开要发送的文件, 失败返回-1, error里是可以回给客户端的原因
+// 只接受file_root下的相对路径, 带..的路径一律拒绝
+inline int open_served_file(const std::string& path, uint64_t& size, std::string& error) {
+    if (transfer_options.file_root.empty()) {
+        error = "serving files is disabled";
+        return -1;
+    }
+    if (path.empty() || path[0] == '/' || path == ".." || path.compare(0, 3, "../") == 0
+        || path.find("/../") != std::string::npos
+        || (path.size() >= 3 && path.compare(path.size() - 3, 3, "/..") == 0)) {
+        error = "invalid path";
+        return -1;
+    }
+    // 在reactor线程上打开, 没有写端的FIFO这类文件用阻塞的open会卡住整个reactor, 先非阻塞打开, 确认是普通文件再改回来
+    int file_fd = open_beneath(transfer_options.file_root, path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    if (file_fd == -1) {
+        error = "cannot open file: " + std::string(strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(file_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        error = "not a regular file";
+        close(file_fd);
+        return -1;
+    }
+    int flags = fcntl(file_fd, F_GETFL);
+    if (flags == -1 || fcntl(file_fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        error = "cannot open file: " + std::string(strerror(errno));
+        close(file_fd);
+        return -1;
+    }
+    // 长度要放进帧头的4个字节里
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+        error = "file too large";
+        close(file_fd);
+        return -1;
+    }
+    size = st.st_size;
+    return file_fd;
+}
+
+#endif